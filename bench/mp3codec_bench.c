@@ -0,0 +1,418 @@
+// Offline benchmark for the mp3codec~ core: pushes synthetic and file-based signals through
+// every quality level and toggle combination, without Max, and reports throughput, per-frame
+// codec latency and allocations.
+//
+// usage: mp3codec_bench [-s seconds] [-r samplerate] [-v vectorsize] [-q quality] [-m mask] [-e mode] [-p] [-l] [-b] [-R] [-c] [-n] [file.wav ...]
+//
+//   -s  length of the synthetic signals (default 10 s)
+//   -r  sample rate of the synthetic signals (default 44100)
+//   -v  samples per process call, like the host vector size (default 64)
+//   -q  only run this quality level (default: all)
+//   -m  only run this toggle mask (default: all 64), bits as in MASK_NAMES below
+//   -e  bitrate mode: cbr (default), abr or vbr (the mode attribute, deadline guard on)
+//   -p  feed LAME 16-bit PCM (the pcm16 attribute)
+//   -l  low latency mode (the lowlatency attribute)
+//   -b  batch frames per codec call (the render attribute)
+//   -R  keep LAME's bit reservoir (the reservoir attribute)
+//   -c  compact buffers (the compact attribute)
+//   -n  skip the synthetic signals
+//
+// WAV files may be 16/24/32-bit PCM or 32-bit float, mono or stereo; they are run at their
+// own sample rate.
+
+#include "mp3codec_core.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef CLAMP
+#define CLAMP(a, lo, hi) ((a) < (lo) ? (lo) : ((a) > (hi) ? (hi) : (a)))
+#endif
+
+#define TOGGLE_COMBINATIONS 64  // 2^6 compression toggles
+
+// Bit order of the -m mask and the mask column
+static const char *MASK_NAMES[] = {"lowpass", "highpass", "msstereo", "athonly", "experimental", "emphasis"};
+
+typedef struct _bench_signal {
+    char name[64];
+    double *left;
+    double *right;
+    long length;
+    long sample_rate;
+} t_bench_signal;
+
+typedef struct _bench_options {
+    double seconds;
+    long sample_rate;
+    long vector_size;
+    long quality;           // -1 = all
+    long mask;              // -1 = all
+    long mode;
+    long pcm16;
+    long low_latency;
+    long render;
+    long reservoir;
+    long compact;
+    long synthetic;
+} t_bench_options;
+
+// Totals over every run, for the summary line
+typedef struct _bench_totals {
+    long runs;
+    double samples;
+    double seconds;
+    double worst_p99;
+    long run_allocations;
+    long events;
+    long guarded;
+    long idle;
+} t_bench_totals;
+
+static int bench_signal_alloc(t_bench_signal *sig, const char *name, long length, long sample_rate)
+{
+    snprintf(sig->name, sizeof(sig->name), "%s", name);
+    sig->length = length;
+    sig->sample_rate = sample_rate;
+    sig->left = (double *)calloc(length, sizeof(double));
+    sig->right = (double *)calloc(length, sizeof(double));
+    return (sig->left && sig->right) ? 0 : -1;
+}
+
+static void bench_signal_free(t_bench_signal *sig)
+{
+    free(sig->left);
+    free(sig->right);
+    sig->left = sig->right = NULL;
+}
+
+// Synthetic signals
+
+static void bench_sine(t_bench_signal *sig)
+{
+    for (long i = 0; i < sig->length; i++) {
+        double t = (double)i / sig->sample_rate;
+        sig->left[i] = 0.5 * sin(2.0 * M_PI * 440.0 * t);
+        sig->right[i] = 0.5 * sin(2.0 * M_PI * 660.0 * t);
+    }
+}
+
+static void bench_noise(t_bench_signal *sig)
+{
+    unsigned int seed = 0x12345678u;
+    for (long i = 0; i < sig->length; i++) {
+        seed = seed * 1664525u + 1013904223u;
+        sig->left[i] = ((double)(seed >> 8) / (double)(1u << 24) * 2.0 - 1.0) * 0.5;
+        seed = seed * 1664525u + 1013904223u;
+        sig->right[i] = ((double)(seed >> 8) / (double)(1u << 24) * 2.0 - 1.0) * 0.5;
+    }
+}
+
+// Exponential sweep 20 Hz - 20 kHz over the whole signal
+static void bench_sweep(t_bench_signal *sig)
+{
+    double duration = (double)sig->length / sig->sample_rate;
+    double k = log(20000.0 / 20.0);
+    for (long i = 0; i < sig->length; i++) {
+        double t = (double)i / sig->sample_rate;
+        double phase = 2.0 * M_PI * 20.0 * duration / k * (exp(t / duration * k) - 1.0);
+        sig->left[i] = 0.5 * sin(phase);
+        sig->right[i] = 0.5 * cos(phase);
+    }
+}
+
+// WAV reader
+
+static unsigned int bench_le(const unsigned char *p, int bytes)
+{
+    unsigned int v = 0;
+    for (int i = bytes - 1; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static double bench_wav_sample(const unsigned char *p, int format, int bits)
+{
+    if (format == 3) {
+        float f;
+        memcpy(&f, p, sizeof(f));
+        return f;
+    }
+    switch (bits) {
+        case 16: return (short)bench_le(p, 2) / 32768.0;
+        case 24: return ((int)(bench_le(p, 3) << 8) >> 8) / 8388608.0;
+        case 32: return (int)bench_le(p, 4) / 2147483648.0;
+    }
+    return 0.0;
+}
+
+static int bench_load_wav(t_bench_signal *sig, const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    unsigned char header[12], chunk[8], fmt[16];
+    int have_fmt = 0, result = -1;
+    
+    if (!f) {
+        fprintf(stderr, "mp3codec_bench: Can't open %s\n", path);
+        return -1;
+    }
+    if (fread(header, 1, 12, f) != 12 || memcmp(header, "RIFF", 4) || memcmp(header + 8, "WAVE", 4)) {
+        fprintf(stderr, "mp3codec_bench: %s is not a WAV file\n", path);
+        fclose(f);
+        return -1;
+    }
+    
+    while (fread(chunk, 1, 8, f) == 8) {
+        unsigned int size = bench_le(chunk + 4, 4);
+        
+        if (!memcmp(chunk, "fmt ", 4) && size >= 16) {
+            if (fread(fmt, 1, 16, f) != 16) break;
+            fseek(f, (long)(size - 16 + (size & 1)), SEEK_CUR);
+            have_fmt = 1;
+        } else if (!memcmp(chunk, "data", 4) && have_fmt) {
+            int format = (int)bench_le(fmt, 2);
+            int channels = (int)bench_le(fmt + 2, 2);
+            int bits = (int)bench_le(fmt + 14, 2);
+            int frame_bytes = channels * bits / 8;
+            
+            if ((format != 1 && format != 3) || channels < 1 || channels > 2 ||
+                (format == 1 && bits != 16 && bits != 24 && bits != 32) || (format == 3 && bits != 32)) {
+                fprintf(stderr, "mp3codec_bench: %s: unsupported format %d, %d channels, %d bits\n",
+                        path, format, channels, bits);
+                break;
+            }
+            
+            unsigned char *data = (unsigned char *)malloc(size);
+            if (!data || fread(data, 1, size, f) != size) {
+                fprintf(stderr, "mp3codec_bench: %s: short data chunk\n", path);
+                free(data);
+                break;
+            }
+            
+            const char *base = strrchr(path, '/');
+            if (bench_signal_alloc(sig, base ? base + 1 : path, size / frame_bytes, bench_le(fmt + 4, 4)) == 0) {
+                for (long i = 0; i < sig->length; i++) {
+                    const unsigned char *p = data + i * frame_bytes;
+                    sig->left[i] = bench_wav_sample(p, format, bits);
+                    sig->right[i] = channels == 2 ? bench_wav_sample(p + bits / 8, format, bits) : sig->left[i];
+                }
+                result = 0;
+            }
+            free(data);
+            break;
+        } else {
+            fseek(f, (long)(size + (size & 1)), SEEK_CUR);
+        }
+    }
+    
+    if (result < 0 && !sig->left) {
+        fprintf(stderr, "mp3codec_bench: %s: no usable audio\n", path);
+    }
+    fclose(f);
+    return result;
+}
+
+// One signal through one configuration
+
+static void bench_run(const t_bench_signal *sig, long quality, long mask, const t_bench_options *opt,
+                      t_bench_totals *totals)
+{
+    static t_mp3codec_core core;    // Large (timing window, event ring); keep it off the stack
+    t_mp3codec_cpu_summary total;
+    double *out_left = (double *)calloc(opt->vector_size, sizeof(double));
+    double *out_right = (double *)calloc(opt->vector_size, sizeof(double));
+    
+    size_t heap_start = mp3codec_heap_in_use();
+    if (!out_left || !out_right || mp3codec_core_new(&core, NULL, NULL, NULL) < 0) {
+        fprintf(stderr, "mp3codec_bench: Failed to allocate buffers\n");
+        free(out_left);
+        free(out_right);
+        return;
+    }
+    
+    core.quality = quality;
+    core.mode = opt->mode;
+    core.pcm16 = opt->pcm16;
+    core.low_latency = opt->low_latency;
+    core.render = opt->render;
+    core.reservoir = opt->reservoir;
+    core.compact = opt->compact;
+    mp3codec_core_set_host_rate(&core, sig->sample_rate);
+    core.vector_size = opt->vector_size;
+    core.enable_lowpass = (mask >> 0) & 1;
+    core.enable_highpass = (mask >> 1) & 1;
+    core.enable_ms_stereo = (mask >> 2) & 1;
+    core.enable_ath_only = (mask >> 3) & 1;
+    core.enable_experimental = (mask >> 4) & 1;
+    core.enable_emphasis = (mask >> 5) & 1;
+    
+    if (mp3codec_init_processor(&core) < 0 || mp3codec_core_fit(&core) < 0) {
+        fprintf(stderr, "mp3codec_bench: Failed to initialize MP3 processor (quality %ld, mask %02lx)\n", quality, mask);
+        mp3codec_core_free(&core);
+        free(out_left);
+        free(out_right);
+        return;
+    }
+    
+    // Everything after this point is the audio path, which should not allocate
+    long setup_allocations = core.allocations;
+    size_t heap_setup = mp3codec_heap_in_use();
+    
+    uint64_t start = mp3codec_now_ns();
+    for (long pos = 0; pos < sig->length; pos += opt->vector_size) {
+        long n = MIN(opt->vector_size, sig->length - pos);
+        mp3codec_core_process(&core, sig->left + pos, sig->right + pos, out_left, out_right, n);
+    }
+    double elapsed = (mp3codec_now_ns() - start) / 1e9;
+    
+    long run_allocations = core.allocations - setup_allocations;
+    long heap_run = (long)mp3codec_heap_in_use() - (long)heap_setup;
+    
+    // No host hooks, so do the main thread's share by hand
+    int type;
+    long value, frame, events = 0;
+    mp3codec_state_retire(&core);
+    while (mp3codec_core_next_event(&core, &type, &value, &frame)) {
+        events++;
+    }
+    
+    double rate = elapsed > 0.0 ? sig->length / elapsed : 0.0;
+    if (mp3codec_core_cpu_summary(&core, MP3CODEC_CPU_TOTAL, &total)) {
+        printf("%-16s %2ld %4d  %02lx %5d %9.2f %8.1f %8.1f %8.1f %8.1f %8.1f %6ld %4ld %9ld %9ld %4ld\n",
+               sig->name, quality, QUALITY_BITRATES[quality], mask, core.total_latency_samples,
+               rate / 1e6, rate / sig->sample_rate,
+               total.p50, total.p90, total.p99, total.max, setup_allocations, run_allocations,
+               (long)(heap_setup - heap_start) / 1024, heap_run / 1024, events);
+        if (total.p99 > totals->worst_p99) totals->worst_p99 = total.p99;
+    } else {
+        printf("%-16s %2ld %4d  %02lx %5d %9.2f %8.1f  (signal shorter than one frame)\n",
+               sig->name, quality, QUALITY_BITRATES[quality], mask, core.total_latency_samples,
+               rate / 1e6, rate / sig->sample_rate);
+    }
+    
+    totals->runs++;
+    totals->samples += sig->length;
+    totals->seconds += elapsed;
+    totals->run_allocations += run_allocations;
+    totals->events += events;
+    totals->guarded += atomic_load_explicit(&core.stats.guarded_frames, memory_order_relaxed);
+    totals->idle += atomic_load_explicit(&core.stats.idle_frames, memory_order_relaxed);
+    
+    mp3codec_core_free(&core);
+    free(out_left);
+    free(out_right);
+}
+
+static void bench_usage(void)
+{
+    fprintf(stderr, "usage: mp3codec_bench [-s seconds] [-r samplerate] [-v vectorsize] [-q quality] [-m mask] [-e mode] [-p] [-l] [-b] [-R] [-c] [-n] [file.wav ...]\n");
+    fprintf(stderr, "  mask bits:");
+    for (int b = 0; b < 6; b++) {
+        fprintf(stderr, " %d=%s", 1 << b, MASK_NAMES[b]);
+    }
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv)
+{
+    t_bench_options opt = {10.0, 44100, 64, -1, -1, MP3CODEC_MODE_CBR, 0, 0, 0, 0, 0, 1};
+    t_bench_signal signals[16];
+    t_bench_totals totals = {0};
+    int count = 0, ch;
+    
+    while ((ch = getopt(argc, argv, "s:r:v:q:m:e:plbRcnh")) != -1) {
+        switch (ch) {
+            case 's': opt.seconds = atof(optarg); break;
+            case 'r': opt.sample_rate = atol(optarg); break;
+            case 'v': opt.vector_size = atol(optarg); break;
+            case 'q': opt.quality = CLAMP(atol(optarg), 0, QUALITY_LEVELS - 1); break;
+            case 'm': opt.mask = strtol(optarg, NULL, 0) & (TOGGLE_COMBINATIONS - 1); break;
+            case 'e':
+                for (opt.mode = 0; opt.mode < MP3CODEC_MODES; opt.mode++) {
+                    if (!strcmp(optarg, mp3codec_mode_name(opt.mode))) break;
+                }
+                if (opt.mode == MP3CODEC_MODES) {
+                    bench_usage();
+                    return 1;
+                }
+                break;
+            case 'p': opt.pcm16 = 1; break;
+            case 'l': opt.low_latency = 1; break;
+            case 'b': opt.render = 1; break;
+            case 'R': opt.reservoir = 1; break;
+            case 'c': opt.compact = 1; break;
+            case 'n': opt.synthetic = 0; break;
+            default: bench_usage(); return 1;
+        }
+    }
+    if (opt.seconds <= 0.0 || opt.sample_rate <= 0 || opt.vector_size <= 0) {
+        bench_usage();
+        return 1;
+    }
+    
+    mp3codec_core_setup();
+    
+    memset(signals, 0, sizeof(signals));
+    if (opt.synthetic) {
+        static void (*generators[])(t_bench_signal *) = {bench_sine, bench_noise, bench_sweep};
+        static const char *names[] = {"sine", "noise", "sweep"};
+        long length = (long)(opt.seconds * opt.sample_rate);
+        for (int g = 0; g < 3; g++) {
+            if (bench_signal_alloc(&signals[count], names[g], length, opt.sample_rate) < 0) {
+                fprintf(stderr, "mp3codec_bench: Out of memory\n");
+                return 1;
+            }
+            generators[g](&signals[count++]);
+        }
+    }
+    for (int a = optind; a < argc && count < 16; a++) {
+        if (bench_load_wav(&signals[count], argv[a]) == 0) {
+            count++;
+        }
+    }
+    if (!count) {
+        bench_usage();
+        return 1;
+    }
+    
+    printf("# mp3codec core benchmark: vector %ld, %s, %s input, %s ring, %s, %s, %s buffers, per-frame codec time over the last %d frames\n",
+           opt.vector_size, mp3codec_mode_name(opt.mode), opt.pcm16 ? "16-bit" : "float", opt.low_latency ? "low latency" : "default",
+           opt.render ? "batched frames" : "one frame per call", opt.reservoir ? "bit reservoir" : "no reservoir",
+           opt.compact ? "compact" : "full-size", CPU_WINDOW);
+    printf("# mask bits:");
+    for (int b = 0; b < 6; b++) {
+        printf(" %d=%s", 1 << b, MASK_NAMES[b]);
+    }
+    printf("\n");
+    printf("%-16s %2s %4s %3s %5s %9s %8s %8s %8s %8s %8s %6s %4s %9s %9s %4s\n",
+           "signal", "q", "kbps", "tgl", "delay", "Msmp/s", "xRT", "p50 us", "p90 us", "p99 us", "max us",
+           "allocs", "run", "setup KB", "run KB", "evts");
+    
+    for (int s = 0; s < count; s++) {
+        for (long q = 0; q < QUALITY_LEVELS; q++) {
+            if (opt.quality >= 0 && q != opt.quality) continue;
+            for (long m = 0; m < TOGGLE_COMBINATIONS; m++) {
+                if (opt.mask >= 0 && m != opt.mask) continue;
+                bench_run(&signals[s], q, m, &opt, &totals);
+            }
+        }
+    }
+    
+    if (totals.runs) {
+        printf("# %ld runs, %.2f Msamples/s overall, worst p99 %.1f us, %ld allocations on the audio path, %ld events, "
+               "%ld guarded frames, %ld idle frames\n",
+               totals.runs, totals.seconds > 0.0 ? totals.samples / totals.seconds / 1e6 : 0.0,
+               totals.worst_p99, totals.run_allocations, totals.events, totals.guarded, totals.idle);
+    }
+    
+    for (int s = 0; s < count; s++) {
+        bench_signal_free(&signals[s]);
+    }
+    return totals.run_allocations ? 2 : 0;
+}
@@ -0,0 +1,2623 @@
+#include "mp3codec_core.h"
+#include "mp3codec_kernels.h"
+#include "mp3codec_share.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <math.h>
+#ifdef __APPLE__
+#include <malloc/malloc.h>
+#include <mach/mach_time.h>
+#else
+#include <time.h>
+#endif
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+#include <malloc.h>
+#define MP3CODEC_HAVE_MALLINFO2 1
+#endif
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+#ifndef CLAMP
+#define CLAMP(a, lo, hi) ((a) < (lo) ? (lo) : ((a) > (hi) ? (hi) : (a)))
+#endif
+
+// Quality to bitrate mapping (0=best, 9=worst) - More aggressive for low quality
+// Note: LAME minimum CBR is 32 kbps - lower values get clamped to 32 kbps
+const int QUALITY_BITRATES[QUALITY_LEVELS] = {320, 256, 192, 160, 128, 112, 96, 64, 40, 32};
+
+static void mp3codec_log(t_mp3codec_core *c, int is_error, const char *fmt, ...)
+{
+    char message[512];
+    va_list args;
+    
+    if (!c->log) return;
+    va_start(args, fmt);
+    vsnprintf(message, sizeof(message), fmt, args);
+    va_end(args);
+    c->log(c->owner, is_error, message);
+}
+
+static inline void mp3codec_notify(t_mp3codec_core *c, int what)
+{
+    if (c->notify) c->notify(c->owner, what);
+}
+
+// Zeroed allocation, counted so the benchmark can check the audio path never allocates
+static void *mp3codec_alloc(t_mp3codec_core *c, size_t size)
+{
+    c->allocations++;
+    return calloc(1, size);
+}
+
+
+// Helper functions
+static inline float short_to_float(short sample) {
+    return sample / 32767.0f;
+}
+
+// Render batches arrive in bursts the free-running default ring can't absorb, so render mode
+// uses the measured, stream-aligned ring of low latency mode too
+static inline long mp3codec_aligned(const t_mp3codec_core *c)
+{
+    return c->low_latency || c->render;
+}
+
+// Ring length for a ring_mode: the aligned modes and @source use all of it, the default ring
+// is 4 frames, and a frame longer with the reservoir, which now and then sends a frame late.
+// A compact ring only holds what the mode it was fit for needs.
+static inline int mp3codec_ring_span(const t_mp3codec_core *c, long ring_mode)
+{
+    return ring_mode ? c->ring_capacity : MIN(MP3_FRAME_SIZE * (c->reservoir ? 5 : 4), c->ring_capacity);
+}
+
+// The two halves of mp3codec_encode_decode_frame, so callers can mix straight into the
+// ring or a queue slot once they know how many samples are coming
+static int mp3codec_frame_code(t_mp3codec_core *c, const float *left, const float *right, long frames);
+static void mp3codec_frame_mix(t_mp3codec_core *c, float *out_left, float *out_right, int count);
+
+// Bytes currently allocated from the process heap, used to estimate what a LAME pair costs.
+// Other threads allocating at the same time make this an estimate, not an exact figure.
+size_t mp3codec_heap_in_use(void)
+{
+#ifdef __APPLE__
+    malloc_statistics_t stats;
+    malloc_zone_statistics(NULL, &stats);
+    return stats.size_in_use;
+#elif defined(MP3CODEC_HAVE_MALLINFO2)
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+// SPSC queue helpers - head/tail are free-running counters
+static int mp3codec_queue_alloc(t_mp3codec_core *c, t_mp3codec_queue *q) {
+    if (!q->slots) {
+        q->slots = (t_mp3codec_frame*)mp3codec_alloc(c, FRAME_QUEUE_SLOTS * sizeof(t_mp3codec_frame));
+    }
+    atomic_store(&q->head, 0);
+    atomic_store(&q->tail, 0);
+    return q->slots ? 0 : -1;
+}
+
+static void mp3codec_queue_free(t_mp3codec_queue *q) {
+    if (q->slots) {
+        free(q->slots);
+        q->slots = NULL;
+    }
+}
+
+// Only safe while neither side is using the queue
+static inline void mp3codec_queue_clear(t_mp3codec_queue *q) {
+    atomic_store_explicit(&q->tail, atomic_load_explicit(&q->head, memory_order_relaxed), memory_order_release);
+}
+
+// Producer: returns the next free slot or NULL when full
+static inline t_mp3codec_frame *mp3codec_queue_write_slot(t_mp3codec_queue *q) {
+    unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    if (head - tail >= FRAME_QUEUE_SLOTS) return NULL;
+    return &q->slots[head % FRAME_QUEUE_SLOTS];
+}
+
+static inline void mp3codec_queue_commit(t_mp3codec_queue *q) {
+    atomic_fetch_add_explicit(&q->head, 1, memory_order_release);
+}
+
+// Consumer: returns the oldest filled slot or NULL when empty
+static inline t_mp3codec_frame *mp3codec_queue_read_slot(t_mp3codec_queue *q) {
+    unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (head == tail) return NULL;
+    return &q->slots[tail % FRAME_QUEUE_SLOTS];
+}
+
+static inline void mp3codec_queue_release(t_mp3codec_queue *q) {
+    atomic_fetch_add_explicit(&q->tail, 1, memory_order_release);
+}
+
+// Multi-producer event ring (audio thread and worker both report), single consumer.
+// A slot's sequence equals its index when free and index + 1 once written; a full ring
+// drops the event rather than waiting.
+static void mp3codec_event_push(t_mp3codec_core *c, int type, long value)
+{
+    unsigned int head = atomic_load_explicit(&c->event_head, memory_order_relaxed);
+    t_mp3codec_event *ev;
+    
+    for (;;) {
+        ev = &c->event_ring[head % EVENT_SLOTS];
+        unsigned int seq = atomic_load_explicit(&ev->sequence, memory_order_acquire);
+        int diff = (int)(seq - head);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&c->event_head, &head, head + 1, 
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            atomic_fetch_add_explicit(&c->stats.events_lost, 1, memory_order_relaxed);
+            return;
+        } else {
+            head = atomic_load_explicit(&c->event_head, memory_order_relaxed);
+        }
+    }
+    
+    ev->type = type;
+    ev->value = value;
+    ev->frame = atomic_load_explicit(&c->stats.frames_encoded, memory_order_relaxed);
+    atomic_store_explicit(&ev->sequence, head + 1, memory_order_release);
+    mp3codec_notify(c, MP3CODEC_NOTIFY_EVENT);
+}
+
+static inline void mp3codec_stat_add(atomic_long *counter, long n)
+{
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+#ifdef __APPLE__
+static mach_timebase_info_data_t mp3codec_timebase;  // Filled in once by mp3codec_core_setup
+#endif
+
+// Cheap enough to read around every codec call
+uint64_t mp3codec_now_ns(void)
+{
+#ifdef __APPLE__
+    return mach_absolute_time() * mp3codec_timebase.numer / mp3codec_timebase.denom;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+void mp3codec_core_setup(void)
+{
+    mp3codec_kernels_init();
+#ifdef __APPLE__
+    mach_timebase_info(&mp3codec_timebase);
+#endif
+}
+
+// Cores take the stagger slots in turn as they're created (main thread)
+static long mp3codec_stagger_clock;
+
+int mp3codec_core_new(t_mp3codec_core *c, void *owner, t_mp3codec_notify notify, t_mp3codec_log log)
+{
+    memset(c, 0, sizeof(*c));
+    c->owner = owner;
+    c->notify = notify;
+    c->log = log;
+    
+    // Initialize parameters
+    c->quality = 5;         // Default: 128 kbps
+    c->input_gain = 1.0;
+    c->output_gain = 1.0;
+    c->bypass = 0;
+    c->pcm16 = 0;           // Float PCM into LAME
+    c->low_latency = 0;     // Default 4-frame ring
+    c->mode = MP3CODEC_MODE_CBR;
+    c->guard = 1;           // Only has an effect in ABR/VBR
+    c->idle = 1;            // Silence costs nothing
+    c->reservoir = 0;       // Every frame stands alone: least latency
+    c->stagger = 0;         // Every core's frames complete in the same callback
+    c->compact = 0;         // Full-size rings until the host asks for a fit
+    c->stagger_slot = mp3codec_stagger_clock++ % STAGGER_SLOTS;
+    
+    // Initialize compression toggles (all aggressive settings enabled by default)
+    c->enable_lowpass = 1;
+    c->enable_highpass = 1;
+    c->enable_ms_stereo = 1;
+    c->enable_ath_only = 1;
+    c->enable_experimental = 1;
+    c->enable_emphasis = 1;
+    
+    c->sample_rate = 44100;
+    c->host_rate = 44100;
+    c->resample_quality = 1;
+    c->resampler.factor = 1;
+    c->channels = 2;
+    c->initialized = 0;
+    c->vector_size = 64;
+    
+    // Threaded pipeline starts inline; the host's worker switches it over
+    atomic_init(&c->pipeline_request, 0);
+    atomic_init(&c->pipeline_mode, 0);
+    atomic_init(&c->worker_claim, 0);
+    atomic_init(&c->held, 0);
+    atomic_init(&c->in_callback, 0);
+    
+    // Parameter changes hand over a new encoder state; the old one is retired
+    atomic_init(&c->pending_state, NULL);
+    atomic_init(&c->retire_head, 0);
+    atomic_init(&c->retire_tail, 0);
+    
+    // Morph pool is only built once morph is enabled
+    c->morph = -1.0;
+    c->morph_pool = QUALITY_LEVELS;
+    c->config_generation = 1;
+    for (int q = 0; q < QUALITY_LEVELS; q++) {
+        atomic_init(&c->pool_pending[q], NULL);
+    }
+    atomic_init(&c->pool_evict, 0);
+    atomic_init(&c->guard_pending, NULL);
+    atomic_init(&c->guard_evict, 0);
+    
+    // Telemetry counters, event ring and timing window
+    atomic_init(&c->stats.frames_encoded, 0);
+    atomic_init(&c->stats.bytes_produced, 0);
+    atomic_init(&c->stats.decode_errors, 0);
+    atomic_init(&c->stats.underruns, 0);
+    atomic_init(&c->stats.encode_errors, 0);
+    atomic_init(&c->stats.frames_dropped, 0);
+    atomic_init(&c->stats.events_lost, 0);
+    atomic_init(&c->stats.guarded_frames, 0);
+    atomic_init(&c->stats.tap_frames, 0);
+    atomic_init(&c->stats.tap_dropped, 0);
+    atomic_init(&c->stats.idle_frames, 0);
+    atomic_init(&c->stats.shared_frames, 0);
+    atomic_init(&c->stats.analysis_lost, 0);
+    atomic_init(&c->analysis_head, 0);
+    atomic_init(&c->analysis_tail, 0);
+    atomic_init(&c->analysis_notified, 0);
+    atomic_init(&c->tap_enabled, 0);
+    atomic_init(&c->tap_head, 0);
+    atomic_init(&c->tap_tail, 0);
+    atomic_init(&c->source_pending, NULL);
+    atomic_init(&c->source_retired, NULL);
+    atomic_init(&c->source_evict, 0);
+    atomic_init(&c->source_seek, -1);
+    atomic_init(&c->share_pending, NULL);
+    atomic_init(&c->share_retired, NULL);
+    atomic_init(&c->share_evict, 0);
+    for (unsigned int e = 0; e < EVENT_SLOTS; e++) {
+        atomic_init(&c->event_ring[e].sequence, e);
+    }
+    atomic_init(&c->event_head, 0);
+    for (int f = 0; f < CPU_WINDOW; f++) {
+        atomic_init(&c->cpu.encode_ns[f], 0);
+        atomic_init(&c->cpu.decode_ns[f], 0);
+    }
+    atomic_init(&c->cpu.frames, 0);
+    
+    return mp3codec_arena_alloc(c);
+}
+
+void mp3codec_core_free(t_mp3codec_core *c)
+{
+    mp3codec_cleanup_processor(c);
+    mp3codec_arena_free(c);
+    mp3codec_queues_free(c);
+    free(c->tap_ring);
+    c->tap_ring = NULL;
+    mp3codec_source_close(c->source);
+    mp3codec_source_close(atomic_exchange(&c->source_pending, NULL));
+    mp3codec_source_close(atomic_exchange(&c->source_retired, NULL));
+    c->source = NULL;
+    mp3codec_share_leave(c->share);
+    mp3codec_share_leave(atomic_exchange(&c->share_pending, NULL));
+    mp3codec_share_leave(atomic_exchange(&c->share_retired, NULL));
+    c->share = NULL;
+}
+
+const char *mp3codec_mode_name(long mode)
+{
+    static const char *mode_names[MP3CODEC_MODES] = {"cbr", "abr", "vbr"};
+    return (mode >= 0 && mode < MP3CODEC_MODES) ? mode_names[mode] : "cbr";
+}
+
+// Build a fully configured encoder/decoder pair for quality from the current toggles, in any
+// bitrate mode. fast picks LAME's cheapest algorithms whatever the quality (the guard state).
+// Runs on the main thread; never touches a state the codec owner is using.
+static t_mp3codec_state *mp3codec_state_build(t_mp3codec_core *c, long quality, long mode, short fast,
+                                              short verbose)
+{
+    size_t heap_before = mp3codec_heap_in_use();
+    
+    // Initialize encoder
+    lame_global_flags *gfp = lame_init();
+    if (!gfp) {
+        mp3codec_log(c, 1, "mp3codec~: Failed to initialize LAME encoder");
+        return NULL;
+    }
+    
+    // Basic audio parameters
+    lame_set_num_channels(gfp, c->channels);
+    lame_set_in_samplerate(gfp, c->sample_rate);
+    lame_set_out_samplerate(gfp, c->sample_rate);
+    
+    // CRITICAL: Set the bitrate mode and bitrate FIRST
+    if (mode == MP3CODEC_MODE_VBR) {
+        lame_set_VBR(gfp, vbr_mtrh);
+        lame_set_VBR_quality(gfp, (float)quality);  // -V 0 (best) to -V 9, like the quality scale
+    } else if (mode == MP3CODEC_MODE_ABR) {
+        lame_set_VBR(gfp, vbr_abr);
+        lame_set_VBR_mean_bitrate_kbps(gfp, QUALITY_BITRATES[quality]);
+    } else {
+        lame_set_VBR(gfp, vbr_off);
+        lame_set_brate(gfp, QUALITY_BITRATES[quality]);
+    }
+    
+    // Set quality parameter (affects psychoacoustic model)
+    lame_set_quality(gfp, fast ? 9 : quality);
+    
+    // Apply user-controlled aggressive compression settings
+    
+    // Always use joint stereo for low bitrates, unless overridden
+    if (c->channels == 1) {
+        lame_set_mode(gfp, MONO);
+    } else if (QUALITY_BITRATES[quality] <= 128) {
+        lame_set_mode(gfp, JOINT_STEREO);
+    } else {
+        lame_set_mode(gfp, STEREO);
+    }
+    
+    // Apply individual toggles
+    if (c->enable_ms_stereo && c->channels == 2) {
+        lame_set_force_ms(gfp, 1);           // Force mid/side stereo
+        if (verbose) mp3codec_log(c, 0, "mp3codec~: Enabled forced mid/side stereo");
+    }
+    
+    if (c->enable_ath_only) {
+        lame_set_ATHonly(gfp, 1);            // Use ATH only (more aggressive)
+        lame_set_ATHshort(gfp, 1);           // Use ATH for short blocks
+        lame_set_no_short_blocks(gfp, 0);    // Allow short blocks
+        if (verbose) mp3codec_log(c, 0, "mp3codec~: Enabled ATH-only psychoacoustic model");
+    }
+    
+    if (c->enable_emphasis) {
+        lame_set_emphasis(gfp, 1);           // Add emphasis
+        if (verbose) mp3codec_log(c, 0, "mp3codec~: Enabled pre-emphasis");
+    }
+    
+    if (c->enable_experimental) {
+        lame_set_experimentalX(gfp, 9);      // Most aggressive experimental settings
+        lame_set_experimentalY(gfp, 1);      // Additional experimental compression
+        if (verbose) mp3codec_log(c, 0, "mp3codec~: Enabled experimental compression modes");
+    }
+    
+    if (c->enable_lowpass) {
+        // Apply aggressive low-pass filtering based on quality
+        if (QUALITY_BITRATES[quality] <= 32) {
+            lame_set_lowpassfreq(gfp, 4000);  // Telephone quality
+        } else if (QUALITY_BITRATES[quality] <= 64) {
+            lame_set_lowpassfreq(gfp, 6000);  // Harsh filtering
+        } else {
+            lame_set_lowpassfreq(gfp, 8000);  // Moderate filtering
+        }
+        if (verbose) mp3codec_log(c, 0, "mp3codec~: Enabled low-pass filter (%d Hz)", 
+                          QUALITY_BITRATES[quality] <= 32 ? 4000 : 
+                          QUALITY_BITRATES[quality] <= 64 ? 6000 : 8000);
+    }
+    
+    if (c->enable_highpass) {
+        lame_set_highpassfreq(gfp, 100);     // Cut bass
+        if (verbose) mp3codec_log(c, 0, "mp3codec~: Enabled high-pass filter (100 Hz)");
+    }
+    
+    // The bit reservoir is off unless asked for: later frames put audio data in the bytes
+    // earlier ones left unused, so a frame can't be sent until the next is coded
+    lame_set_disable_reservoir(gfp, !c->reservoir);
+    
+    if (lame_init_params(gfp) < 0) {
+        // If LAME rejects the parameters (common with very low bitrates), try fallback
+        if (QUALITY_BITRATES[quality] <= 16) {
+            if (verbose) mp3codec_log(c, 0, "mp3codec~: LAME rejected %d kbps, trying 32 kbps fallback", QUALITY_BITRATES[quality]);
+            lame_set_brate(gfp, 32);
+            lame_set_lowpassfreq(gfp, 6000);  // Still keep aggressive filtering
+            
+            if (lame_init_params(gfp) < 0) {
+                mp3codec_log(c, 1, "mp3codec~: Failed to initialize LAME even with 32 kbps fallback");
+                lame_close(gfp);
+                return NULL;
+            } else {
+                if (verbose) mp3codec_log(c, 0, "mp3codec~: Successfully initialized with 32 kbps fallback");
+            }
+        } else {
+            mp3codec_log(c, 1, "mp3codec~: Failed to set LAME parameters for %d kbps", QUALITY_BITRATES[quality]);
+            lame_close(gfp);
+            return NULL;
+        }
+    }
+    
+    // Debug: Show actual LAME configuration
+    if (verbose) mp3codec_log(c, 0, "mp3codec~: LAME configured - Quality: %d, Bitrate: %d (%s), Mode: %d, Channels: %d", 
+                      lame_get_quality(gfp),
+                      mode == MP3CODEC_MODE_CBR ? lame_get_brate(gfp) : lame_get_VBR_mean_bitrate_kbps(gfp), 
+                      mp3codec_mode_name(mode),
+                      lame_get_mode(gfp),
+                      lame_get_num_channels(gfp));
+    
+    // Initialize decoder
+    hip_t hip = hip_decode_init();
+    if (!hip) {
+        mp3codec_log(c, 1, "mp3codec~: Failed to initialize LAME hip decoder");
+        lame_close(gfp);
+        return NULL;
+    }
+    
+    t_mp3codec_state *st = (t_mp3codec_state*)mp3codec_alloc(c, sizeof(t_mp3codec_state));
+    if (!st) {
+        hip_decode_exit(hip);
+        lame_close(gfp);
+        return NULL;
+    }
+    st->gfp = gfp;
+    st->hip = hip;
+    st->quality = quality;
+    st->generation = c->config_generation;
+    st->encoder_delay = lame_get_encoder_delay(gfp);
+    st->samples_fed = 0;
+    st->samples_out = 0;
+    st->samples_coded = 0;
+    st->stream_origin = 0;
+    
+    size_t heap_after = mp3codec_heap_in_use();
+    st->memory_bytes = heap_after > heap_before ? (long)(heap_after - heap_before) : 0;
+    return st;
+}
+
+t_mp3codec_state *mp3codec_state_new(t_mp3codec_core *c, long quality, short verbose)
+{
+    return mp3codec_state_build(c, quality, c->mode, 0, verbose);
+}
+
+void mp3codec_state_free(t_mp3codec_state *st)
+{
+    if (!st) return;
+    if (st->gfp) lame_close(st->gfp);
+    if (st->hip) hip_decode_exit(st->hip);
+    free(st);
+}
+
+// Spare states and measured delays for recently used configurations, shared by every core.
+// lame_init_params and the delay probe are the slow part of a parameter change, and a state
+// can't be reset to a fresh stream, so the cache holds states that have never encoded.
+typedef struct _mp3codec_cache_entry {
+    uint64_t key;                // mp3codec_config_key, 0 = empty
+    t_mp3codec_state *spare;     // Never-used state (spare table only)
+    int codec_delay;             // Measured delays (delay table only)
+    int codec_lag;
+    unsigned long used;          // Clock when stored, for least-recently-built eviction
+} t_mp3codec_cache_entry;
+
+static struct {
+    t_mp3codec_cache_entry spares[CONFIG_CACHE_SLOTS];
+    t_mp3codec_cache_entry delays[CONFIG_CACHE_SLOTS];
+    unsigned long clock;
+    long hits;
+    long misses;
+} mp3codec_cache;
+
+// Everything mp3codec_state_new configures LAME from. Toggle bits in the benchmark's mask order.
+static uint64_t mp3codec_config_key(const t_mp3codec_core *c, long quality)
+{
+    uint64_t toggles = (c->enable_lowpass ? 1 : 0) | (c->enable_highpass ? 2 : 0) |
+                       (c->enable_ms_stereo ? 4 : 0) | (c->enable_ath_only ? 8 : 0) |
+                       (c->enable_experimental ? 16 : 0) | (c->enable_emphasis ? 32 : 0);
+    
+    return (uint64_t)(c->reservoir ? 1 : 0) << 40 | (uint64_t)c->sample_rate << 16 |
+           (uint64_t)c->channels << 12 | (uint64_t)c->mode << 10 | toggles << 4 | (uint64_t)quality;
+}
+
+// The entry to overwrite: an empty one, or else the one stored longest ago
+static t_mp3codec_cache_entry *mp3codec_cache_victim(t_mp3codec_cache_entry *table)
+{
+    t_mp3codec_cache_entry *victim = &table[0];
+    
+    for (int i = 0; i < CONFIG_CACHE_SLOTS; i++) {
+        if (!table[i].key) return &table[i];
+        if (table[i].used < victim->used) victim = &table[i];
+    }
+    return victim;
+}
+
+t_mp3codec_state *mp3codec_state_acquire(t_mp3codec_core *c, long quality, short verbose, int refill)
+{
+    uint64_t key = mp3codec_config_key(c, quality);
+    t_mp3codec_state *st = NULL;
+    
+    for (int i = 0; i < CONFIG_CACHE_SLOTS; i++) {
+        t_mp3codec_cache_entry *e = &mp3codec_cache.spares[i];
+        if (e->key == key && e->spare) {
+            st = e->spare;
+            e->spare = NULL;
+            e->key = 0;
+            break;
+        }
+    }
+    
+    if (st) {
+        mp3codec_cache.hits++;
+        st->generation = c->config_generation;
+        if (verbose) mp3codec_log(c, 0, "mp3codec~: Quality %ld (%d kbps) taken from the config cache",
+                                  quality, QUALITY_BITRATES[quality]);
+    } else {
+        mp3codec_cache.misses++;
+        st = mp3codec_state_new(c, quality, verbose);
+        if (!st) return NULL;
+    }
+    
+    if (refill) {
+        c->cache_refill |= 1u << quality;
+        mp3codec_notify(c, MP3CODEC_NOTIFY_CACHE);
+    }
+    return st;
+}
+
+// Build a spare for every quality this core took one for, with its current configuration, so
+// switching back to a recent preset is a cache hit. Deferred by the host, off the message path.
+void mp3codec_cache_refill(t_mp3codec_core *c)
+{
+    unsigned int want = c->cache_refill;
+    
+    c->cache_refill = 0;
+    for (long q = 0; q < QUALITY_LEVELS; q++) {
+        if (!(want & (1u << q))) continue;
+        
+        t_mp3codec_state *st = mp3codec_state_new(c, q, 0);
+        if (!st) continue;
+        
+        t_mp3codec_cache_entry *e = mp3codec_cache_victim(mp3codec_cache.spares);
+        mp3codec_state_free(e->spare);
+        e->key = mp3codec_config_key(c, q);
+        e->spare = st;
+        e->used = ++mp3codec_cache.clock;
+    }
+}
+
+void mp3codec_cache_clear(void)
+{
+    for (int i = 0; i < CONFIG_CACHE_SLOTS; i++) {
+        mp3codec_state_free(mp3codec_cache.spares[i].spare);
+    }
+    memset(&mp3codec_cache, 0, sizeof(mp3codec_cache));
+}
+
+void mp3codec_cache_summary(long *spares, long *bytes, long *hits, long *misses)
+{
+    *spares = 0;
+    *bytes = 0;
+    for (int i = 0; i < CONFIG_CACHE_SLOTS; i++) {
+        if (!mp3codec_cache.spares[i].spare) continue;
+        (*spares)++;
+        *bytes += mp3codec_cache.spares[i].spare->memory_bytes;
+    }
+    *hits = mp3codec_cache.hits;
+    *misses = mp3codec_cache.misses;
+}
+
+// Queue a freshly built state for the codec owner to pick up at its next frame boundary
+int mp3codec_state_request(t_mp3codec_core *c)
+{
+    if (!c->initialized) {
+        return mp3codec_init_processor(c);
+    }
+    
+    t_mp3codec_state *st = mp3codec_state_acquire(c, c->quality, 1, 1);
+    if (!st) {
+        return -1;
+    }
+    mp3codec_state_publish(c, st);
+    return 0;
+}
+
+// Hand st (built for c->quality) to the codec owner for its next frame boundary
+void mp3codec_state_publish(t_mp3codec_core *c, t_mp3codec_state *st)
+{
+    // A state that was never picked up is simply superseded
+    t_mp3codec_state *stale = atomic_exchange_explicit(&c->pending_state, st, memory_order_acq_rel);
+    mp3codec_state_free(stale);
+    c->active_memory = st->memory_bytes;
+    
+    c->lame_encoder_delay = st->encoder_delay;
+    if (mp3codec_aligned(c)) {
+        mp3codec_measure_delay(c);
+    }
+    mp3codec_update_latency(c);
+    mp3codec_guard_update(c);
+}
+
+// Toggles or sample rate changed: rebuild the active state and every warm pool entry
+void mp3codec_config_changed(t_mp3codec_core *c)
+{
+    c->config_generation++;
+    mp3codec_state_request(c);
+    mp3codec_pool_update(c);
+}
+
+// qelem: free the states the codec owner swapped out
+void mp3codec_state_retire(t_mp3codec_core *c)
+{
+    unsigned int tail = atomic_load_explicit(&c->retire_tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&c->retire_head, memory_order_acquire);
+    
+    while (tail != head) {
+        mp3codec_state_free(c->retire_ring[tail % RETIRE_SLOTS]);
+        c->retire_ring[tail % RETIRE_SLOTS] = NULL;
+        tail++;
+    }
+    atomic_store_explicit(&c->retire_tail, tail, memory_order_release);
+    mp3codec_source_close(atomic_exchange_explicit(&c->source_retired, NULL, memory_order_acq_rel));
+    mp3codec_share_leave(atomic_exchange_explicit(&c->share_retired, NULL, memory_order_acq_rel));
+}
+
+// Keep the morph pool warm: build every quality in the window around the morph position
+// that is missing or stale, and drop the ones outside it. Main thread only.
+void mp3codec_pool_update(t_mp3codec_core *c)
+{
+    long lo = 0, hi = -1;  // Empty window: drop everything
+    unsigned int evict = 0;
+    
+    if (c->quality_signal && c->initialized) {
+        // The quality inlet can jump anywhere from one frame to the next
+        lo = 0;
+        hi = QUALITY_LEVELS - 1;
+    } else if (c->morph >= 0.0 && c->initialized) {
+        long warm = CLAMP(c->morph_pool, 2, QUALITY_LEVELS);
+        lo = CLAMP((long)c->morph - (warm - 2) / 2, 0, QUALITY_LEVELS - warm);
+        hi = lo + warm - 1;
+    }
+    
+    for (long q = 0; q < QUALITY_LEVELS; q++) {
+        if (q >= lo && q <= hi) {
+            if (c->pool_generation[q] == c->config_generation) continue;
+            
+            // The warm pool is a cache of its own, so it takes spares but doesn't ask for refills
+            t_mp3codec_state *st = mp3codec_state_acquire(c, q, 0, 0);
+            if (!st) {
+                mp3codec_log(c, 1, "mp3codec~: Failed to build morph state for quality %ld", q);
+                continue;
+            }
+            // Cancel any eviction still in flight before publishing the replacement
+            atomic_fetch_and_explicit(&c->pool_evict, ~(1u << q), memory_order_acq_rel);
+            mp3codec_state_free(atomic_exchange_explicit(&c->pool_pending[q], st, memory_order_acq_rel));
+            c->pool_generation[q] = c->config_generation;
+            c->pool_memory[q] = st->memory_bytes;
+        } else if (c->pool_generation[q]) {
+            mp3codec_state_free(atomic_exchange_explicit(&c->pool_pending[q], NULL, memory_order_acq_rel));
+            evict |= 1u << q;
+            c->pool_generation[q] = 0;
+            c->pool_memory[q] = 0;
+        }
+    }
+    
+    if (evict) {
+        atomic_fetch_or_explicit(&c->pool_evict, evict, memory_order_acq_rel);
+    }
+}
+
+// Keep the deadline guard's state in step with the quality: a CBR pair at the quality's bitrate
+// on LAME's fastest algorithms, which codes a frame in a fraction of what ABR/VBR at the same
+// quality take. Not taken from the config cache - spares there are full-cost states. Main thread.
+void mp3codec_guard_update(t_mp3codec_core *c)
+{
+    if (c->initialized && c->guard && c->mode != MP3CODEC_MODE_CBR) {
+        t_mp3codec_state *st = mp3codec_state_build(c, c->quality, MP3CODEC_MODE_CBR, 1, 0);
+        if (!st) {
+            mp3codec_log(c, 1, "mp3codec~: Failed to build the deadline guard state");
+            return;
+        }
+        atomic_store_explicit(&c->guard_evict, 0, memory_order_release);
+        mp3codec_state_free(atomic_exchange_explicit(&c->guard_pending, st, memory_order_acq_rel));
+        c->guard_built = 1;
+        c->guard_memory = st->memory_bytes;
+    } else if (c->guard_built) {
+        mp3codec_state_free(atomic_exchange_explicit(&c->guard_pending, NULL, memory_order_acq_rel));
+        atomic_store_explicit(&c->guard_evict, 1, memory_order_release);
+        c->guard_built = 0;
+        c->guard_memory = 0;
+    }
+}
+
+// Full processor setup. Only called while nothing else is running the codec
+// (object creation or after a failed setup); parameter changes go through mp3codec_state_request.
+int mp3codec_init_processor(t_mp3codec_core *c)
+{
+    mp3codec_cleanup_processor(c);
+    
+    if (!c->arena) {
+        return -1;
+    }
+    
+    t_mp3codec_state *st = mp3codec_state_acquire(c, c->quality, 1, 1);
+    if (!st) {
+        return -1;
+    }
+    
+    // Start from clean buffers; the arena itself lives as long as the object
+    memset(c->arena, 0, c->arena_size);
+    mp3codec_resampler_init(&c->resampler, c->resampler.factor, c->resample_quality);
+    for (int l = 0; l < MORPH_LANES; l++) {
+        t_mp3codec_lane *lane = &c->lanes[l];
+        lane->state = NULL;
+        lane->decode_pcm_fill = 0;
+        lane->discard_samples = 0;
+        lane->silent_frames = 0;
+        lane->decode_backlog = 0;
+        lane->gain = 0.0;
+    }
+    
+    // Reset buffer positions
+    c->encode_buffer_fill = 0;
+    c->ring_write_pos = 0;
+    c->ring_read_pos = 0;
+    c->ring_fill = 0;
+    c->ring_started = 0;
+    c->ring_written = 0;
+    c->ring_mode = mp3codec_aligned(c);
+    c->ring_size = mp3codec_ring_span(c, c->ring_mode);
+    c->samples_in = 0;
+    c->stagger_applied = 0;
+    c->frames_encoded = 0;
+    c->samples_decoded = 0;
+    c->tap_position = 0;
+    c->analysis_position = 0;
+    c->stream_delay = st->encoder_delay;
+    c->active = st;
+    c->active_memory = st->memory_bytes;
+    
+    // Get actual LAME delays after initialization
+    c->lame_encoder_delay = st->encoder_delay;
+    mp3codec_measure_delay(c);
+    
+    // Calculate total system latency
+    mp3codec_update_latency(c);
+    c->decode_delay_compensation = 0;  // Disable delay compensation for debugging
+    
+    c->initialized = 1;
+    mp3codec_pool_update(c);
+    mp3codec_guard_update(c);
+    
+    if (c->mode == MP3CODEC_MODE_VBR) {
+        mp3codec_log(c, 0, "mp3codec~: MP3 processor initialized - Quality %ld (VBR -V %ld), Total latency: %.1f ms (%d samples)", 
+             c->quality, c->quality, c->total_latency_ms, c->total_latency_samples);
+    } else {
+        mp3codec_log(c, 0, "mp3codec~: MP3 processor initialized - Quality %ld (%d kbps %s), Total latency: %.1f ms (%d samples)", 
+             c->quality, QUALITY_BITRATES[c->quality], c->mode == MP3CODEC_MODE_ABR ? "ABR" : "CBR", 
+             c->total_latency_ms, c->total_latency_samples);
+    }
+    
+    return 0;
+}
+
+// Carve every per-instance buffer out of the arena, each block cache-line aligned and the
+// left/right halves of each pair adjacent. With base == NULL only the total size is computed.
+// What a refit (mp3codec_core_fit) can resize goes last, so everything before it stays in
+// place; fixed, when given, is where it starts
+static size_t mp3codec_arena_layout(t_mp3codec_core *c, char *base, size_t *fixed)
+{
+    size_t offset = 0;
+    
+#define ARENA_TAKE(ptr, type, count) do { \
+        if (base) (ptr) = (type *)(base + offset); \
+        offset += ((count) * sizeof(type) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1); \
+    } while (0)
+    
+    // Preroll history
+    ARENA_TAKE(c->history_left, float, STATE_PREROLL_FRAMES * MP3_FRAME_SIZE);
+    ARENA_TAKE(c->history_right, float, STATE_PREROLL_FRAMES * MP3_FRAME_SIZE);
+    
+    // Resampler filters, histories and the codec-rate side of a block
+    t_mp3codec_resampler *r = &c->resampler;
+    ARENA_TAKE(r->coeffs, float, RESAMPLE_MAX_TAPS);
+    ARENA_TAKE(r->phase_coeffs, float, RESAMPLE_MAX_TAPS);
+    for (int ch = 0; ch < 2; ch++) {
+        ARENA_TAKE(r->in_history[ch], float, RESAMPLE_MAX_TAPS - 1 + RESAMPLE_BLOCK);
+        ARENA_TAKE(r->out_history[ch], float, RESAMPLE_MAX_PHASE_TAPS - 1 + RESAMPLE_BLOCK / 2);
+        ARENA_TAKE(r->fifo[ch], float, RESAMPLE_BLOCK + 2 * RESAMPLE_MAX_FACTOR);
+    }
+    ARENA_TAKE(c->codec_in_left, double, RESAMPLE_BLOCK / 2);
+    ARENA_TAKE(c->codec_in_right, double, RESAMPLE_BLOCK / 2);
+    ARENA_TAKE(c->codec_out_left, double, RESAMPLE_BLOCK / 2);
+    ARENA_TAKE(c->codec_out_right, double, RESAMPLE_BLOCK / 2);
+    
+    // Fitted side: frame (or batch) being filled, per-lane bitstream and decoded PCM, mixed
+    // frame, then the ring
+    if (fixed) *fixed = offset;
+    ARENA_TAKE(c->encode_buffer_left, float, MP3_FRAME_SIZE * c->arena_frames);
+    ARENA_TAKE(c->encode_buffer_right, float, MP3_FRAME_SIZE * c->arena_frames);
+    for (int l = 0; l < MORPH_LANES; l++) {
+        if (l < c->arena_lanes) {
+            ARENA_TAKE(c->lanes[l].bitstream, unsigned char, MP3_BUFFER_SIZE);
+            ARENA_TAKE(c->lanes[l].decode_pcm_left, short, PCM_BUFFER_SIZE);
+            ARENA_TAKE(c->lanes[l].decode_pcm_right, short, PCM_BUFFER_SIZE);
+        } else if (base) {
+            c->lanes[l].bitstream = NULL;
+            c->lanes[l].decode_pcm_left = c->lanes[l].decode_pcm_right = NULL;
+        }
+    }
+    ARENA_TAKE(c->decode_out_left, float, PCM_BUFFER_SIZE);
+    ARENA_TAKE(c->decode_out_right, float, PCM_BUFFER_SIZE);
+    ARENA_TAKE(c->output_ring_left, float, c->ring_capacity);
+    ARENA_TAKE(c->output_ring_right, float, c->ring_capacity);
+    
+#undef ARENA_TAKE
+    
+    return offset;
+}
+
+// Allocate the buffer arena once per object; reinitialisation only clears it
+int mp3codec_arena_alloc(t_mp3codec_core *c)
+{
+    c->ring_capacity = OUTPUT_RING_SIZE;
+    c->arena_lanes = MORPH_LANES;
+    c->arena_frames = RENDER_BATCH_FRAMES;
+    c->arena_size = mp3codec_arena_layout(c, NULL, NULL);
+    c->arena_block = mp3codec_alloc(c, c->arena_size + ARENA_ALIGN);
+    if (!c->arena_block) {
+        c->arena = NULL;
+        return -1;
+    }
+    
+    c->arena = (char *)(((uintptr_t)c->arena_block + ARENA_ALIGN - 1) & ~(uintptr_t)(ARENA_ALIGN - 1));
+    memset(c->arena, 0, c->arena_size);
+    mp3codec_arena_layout(c, c->arena, NULL);
+    c->ring_size = MP3_FRAME_SIZE * 4;  // 4608 samples; low latency mode uses all of OUTPUT_RING_SIZE
+    return 0;
+}
+
+void mp3codec_arena_free(t_mp3codec_core *c)
+{
+    if (c->arena_block) {
+        free(c->arena_block);
+    }
+    c->arena_block = NULL;
+    c->arena = NULL;
+    c->encode_buffer_left = c->encode_buffer_right = NULL;
+    c->history_left = c->history_right = NULL;
+    c->decode_out_left = c->decode_out_right = NULL;
+    c->output_ring_left = c->output_ring_right = NULL;
+    for (int l = 0; l < MORPH_LANES; l++) {
+        c->lanes[l].bitstream = NULL;
+        c->lanes[l].decode_pcm_left = c->lanes[l].decode_pcm_right = NULL;
+    }
+}
+
+static long mp3codec_gcd(long a, long b)
+{
+    while (b) {
+        long t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Samples the codec sees per call: the host vector, or when resampling, the host vector
+// divided by the factor
+static long mp3codec_codec_vector(const t_mp3codec_core *c)
+{
+    long vector = c->vector_size > 0 ? c->vector_size : 64;
+    if (c->resampler.factor > 1) {
+        vector = MAX(MIN(vector, RESAMPLE_BLOCK) / c->resampler.factor, 1);
+    }
+    return vector;
+}
+
+// Where this core's frames complete within a frame period: its slot's eighth of a frame,
+// rounded down to a multiple of gcd(vector, frame) so callbacks end at the same points in
+// the frame as unstaggered and the low latency ring needs no extra depth. Cores in a share
+// group stay in step with it, and a render has no callbacks to spread frames over.
+static long mp3codec_stagger_phase(const t_mp3codec_core *c)
+{
+    if (!c->stagger || c->render || c->share) {
+        return 0;
+    }
+    long step = mp3codec_gcd(mp3codec_codec_vector(c), MP3_FRAME_SIZE);
+    long phase = c->stagger_slot * (MP3_FRAME_SIZE / STAGGER_SLOTS);
+    return phase - phase % step;
+}
+
+// Codec owner, between callbacks: move the frame boundaries to phase by putting silence in
+// front of the next input, as if the host had sent it. Stream positions stay consistent, so
+// the reported latency holds; the output skips over the inserted samples once. Waits for a
+// callback with room when a render batch fills the encode buffer.
+static void mp3codec_stagger_shift(t_mp3codec_core *c, long phase)
+{
+    long zeros = ((phase - c->stagger_applied) % MP3_FRAME_SIZE + MP3_FRAME_SIZE) % MP3_FRAME_SIZE;
+    if (c->encode_buffer_fill + zeros > MP3_FRAME_SIZE * c->arena_frames) {
+        return;
+    }
+    
+    memset(c->encode_buffer_left + c->encode_buffer_fill, 0, zeros * sizeof(float));
+    memset(c->encode_buffer_right + c->encode_buffer_fill, 0, zeros * sizeof(float));
+    c->encode_buffer_fill += (int)zeros;
+    c->samples_in += zeros;
+    c->stagger_applied = phase;
+    if (!c->ring_mode) {
+        // The default ring is read by position; keep it the same distance behind the input
+        c->ring_read_pos = (int)((c->ring_read_pos + zeros) % c->ring_size);
+        c->ring_fill = MAX(c->ring_fill - zeros, 0);
+    }
+}
+
+// Input goes to the codec a frame at a time, or a batch at a time when rendering inline into
+// an encode buffer of frames frames
+static long mp3codec_span(const t_mp3codec_core *c, int frames)
+{
+    return MP3_FRAME_SIZE * ((c->render && !c->threaded && frames > 1) ? RENDER_BATCH_FRAMES : 1);
+}
+
+// Aligned only: measured lag, and a ring just deep enough for the worst point in the batch
+// cycle: callbacks end at most span - gcd(vector, span) samples into a batch
+static int mp3codec_aligned_buffer(const t_mp3codec_core *c, int frames)
+{
+    long span = mp3codec_span(c, frames);
+    return c->codec_lag + (int)(span - mp3codec_gcd(mp3codec_codec_vector(c), span));
+}
+
+// The worker has PIPELINE_DEADLINE_FRAMES frame periods to return each frame
+static int mp3codec_pipeline_latency(const t_mp3codec_core *c)
+{
+    return c->threaded ? MP3_FRAME_SIZE * PIPELINE_DEADLINE_FRAMES : 0;
+}
+
+void mp3codec_update_latency(t_mp3codec_core *c)
+{
+    int previous = c->total_latency_samples;
+    
+    c->pipeline_latency_samples = mp3codec_pipeline_latency(c);
+    if (mp3codec_aligned(c)) {
+        long vector = mp3codec_codec_vector(c);
+        c->lame_decoder_delay = c->codec_delay - c->lame_encoder_delay;
+        c->buffer_latency_samples = mp3codec_aligned_buffer(c, c->arena_frames);
+        c->output_delay = MIN(c->buffer_latency_samples + c->pipeline_latency_samples,
+                              c->ring_capacity - (int)MIN(vector, MP3_FRAME_SIZE * 2));
+    } else {
+        c->lame_decoder_delay = 528;  // Standard hip decoder delay
+        c->buffer_latency_samples = (int)mp3codec_span(c, c->arena_frames) +
+                                    (c->reservoir ? MP3_FRAME_SIZE : 0);  // Our frame buffering
+    }
+    
+    // Aligned, the output plays output_delay behind the decoder, shallower where the ring caps it
+    c->total_latency_samples = c->lame_encoder_delay + c->lame_decoder_delay +
+                               (mp3codec_aligned(c) ? c->output_delay :
+                                c->buffer_latency_samples + c->pipeline_latency_samples);
+    
+    // Resampled: the codec's delay in host samples, plus the two filters
+    c->resample_latency_samples = (int)mp3codec_resampler_latency(c->resampler.factor, c->resample_quality);
+    c->total_latency_samples = c->total_latency_samples * (int)c->resampler.factor + c->resample_latency_samples;
+    c->total_latency_ms = (double)c->total_latency_samples / (double)c->host_rate * 1000.0;
+    
+    if (c->total_latency_samples != previous) {
+        mp3codec_notify(c, MP3CODEC_NOTIFY_LATENCY);
+    }
+}
+
+// Start the ring over from silence for ring_mode, at the current stream position
+static void mp3codec_ring_restart(t_mp3codec_core *c, long ring_mode)
+{
+    c->ring_mode = ring_mode;
+    c->ring_size = mp3codec_ring_span(c, ring_mode);
+    memset(c->output_ring_left, 0, c->ring_capacity * sizeof(float));
+    memset(c->output_ring_right, 0, c->ring_capacity * sizeof(float));
+    c->ring_write_pos = (int)(c->ring_written % c->ring_size);
+    c->ring_read_pos = (int)(c->samples_in % c->ring_size);
+    c->ring_fill = 0;
+}
+
+// Ring a compact core needs with its current settings and an encode buffer of frames frames:
+// the aligned ring's output delay plus the vector (the bound mp3codec_update_latency keeps
+// to), or the default ring's frames, and always a vector and a frame for @source, which plays
+// through the ring as a FIFO
+static int mp3codec_ring_need(const t_mp3codec_core *c, int frames)
+{
+    long vector = mp3codec_codec_vector(c);
+    long need = mp3codec_aligned(c) ?
+        mp3codec_aligned_buffer(c, frames) + mp3codec_pipeline_latency(c) + MIN(vector, MP3_FRAME_SIZE * 2) :
+        MP3_FRAME_SIZE * (c->reservoir ? 5 : 4);
+    need = MAX(need, c->vector_size + MP3_FRAME_SIZE);
+    return (int)MIN(need, OUTPUT_RING_SIZE);
+}
+
+// What a fit lays out. Compact, a second lane only where morph, the quality inlet or the
+// guard (which only acts in abr/vbr) can start one, and a render batch only while rendering or
+// while input left over from one (fill samples) is still buffered; the next fit drops that batch.
+static void mp3codec_fit_target(const t_mp3codec_core *c, int fill, int *capacity, int *lanes, int *frames)
+{
+    int guard = c->guard && c->mode != MP3CODEC_MODE_CBR;
+    *lanes = (!c->compact || c->morph >= 0.0 || c->quality_signal || guard) ? MORPH_LANES : 1;
+    *frames = (!c->compact || c->render || fill > MP3_FRAME_SIZE) ? RENDER_BATCH_FRAMES : 1;
+    *capacity = c->compact ? mp3codec_ring_need(c, *frames) : OUTPUT_RING_SIZE;
+}
+
+int mp3codec_core_fit_due(const t_mp3codec_core *c)
+{
+    int capacity, lanes, frames;
+    mp3codec_fit_target(c, 0, &capacity, &lanes, &frames);
+    return c->arena && (capacity != c->ring_capacity || lanes != c->arena_lanes || frames != c->arena_frames);
+}
+
+int mp3codec_core_fit(t_mp3codec_core *c)
+{
+    if (!c->arena) {
+        return -1;
+    }
+    
+    int capacity, lanes, frames;
+    mp3codec_fit_target(c, c->encode_buffer_fill, &capacity, &lanes, &frames);
+    if (capacity == c->ring_capacity && lanes == c->arena_lanes && frames == c->arena_frames) {
+        mp3codec_update_latency(c);
+        return 0;
+    }
+    
+    int previous[3] = {c->ring_capacity, c->arena_lanes, c->arena_frames};
+    size_t fixed;
+    c->ring_capacity = capacity;
+    c->arena_lanes = lanes;
+    c->arena_frames = frames;
+    size_t size = mp3codec_arena_layout(c, NULL, &fixed);
+    char *block = mp3codec_alloc(c, size + ARENA_ALIGN);
+    if (!block) {
+        c->ring_capacity = previous[0];
+        c->arena_lanes = previous[1];
+        c->arena_frames = previous[2];
+        mp3codec_update_latency(c);
+        return -1;
+    }
+    
+    // The part ahead of fixed is laid out the same; the buffered input and the lanes that stay
+    // are copied one by one
+    float *encode_left = c->encode_buffer_left, *encode_right = c->encode_buffer_right;
+    t_mp3codec_lane old_lanes[MORPH_LANES];
+    memcpy(old_lanes, c->lanes, sizeof(old_lanes));
+    char *arena = (char *)(((uintptr_t)block + ARENA_ALIGN - 1) & ~(uintptr_t)(ARENA_ALIGN - 1));
+    mp3codec_arena_layout(c, arena, NULL);
+    memcpy(arena, c->arena, fixed);
+    memcpy(c->encode_buffer_left, encode_left, c->encode_buffer_fill * sizeof(float));
+    memcpy(c->encode_buffer_right, encode_right, c->encode_buffer_fill * sizeof(float));
+    for (int l = 0; l < MORPH_LANES; l++) {
+        t_mp3codec_lane *lane = &c->lanes[l];
+        if (l < MIN(lanes, previous[1])) {
+            memcpy(lane->bitstream, old_lanes[l].bitstream, MP3_BUFFER_SIZE);
+            memcpy(lane->decode_pcm_left, old_lanes[l].decode_pcm_left, PCM_BUFFER_SIZE * sizeof(short));
+            memcpy(lane->decode_pcm_right, old_lanes[l].decode_pcm_right, PCM_BUFFER_SIZE * sizeof(short));
+        } else if (l >= lanes) {
+            // A lane without buffers can't run; a later frame rejoins its state with preroll
+            lane->state = NULL;
+            lane->decode_pcm_fill = 0;
+            lane->gain = 0.0;
+            lane->target = 0.0;
+        }
+    }
+    if (c->tap_lane >= lanes) {
+        c->tap_lane = 0;
+    }
+    free(c->arena_block);
+    c->arena_block = block;
+    c->arena = arena;
+    c->arena_size = size;
+    
+    mp3codec_ring_restart(c, c->ring_mode);
+    mp3codec_update_latency(c);
+    return 0;
+}
+
+void mp3codec_core_memory(const t_mp3codec_core *c, t_mp3codec_memory *out)
+{
+    out->core = (long)sizeof(t_mp3codec_core);
+    out->arena = c->arena ? (long)(c->arena_size + ARENA_ALIGN) : 0;
+    out->queues = (c->input_queue.slots ? FRAME_QUEUE_SLOTS : 0) * (long)sizeof(t_mp3codec_frame) +
+                  (c->output_queue.slots ? FRAME_QUEUE_SLOTS : 0) * (long)sizeof(t_mp3codec_frame);
+    out->tap = c->tap_ring ? TAP_RING_SIZE : 0;
+    out->states = c->active_memory + c->guard_memory;
+    for (int q = 0; q < QUALITY_LEVELS; q++) {
+        out->states += c->pool_memory[q];
+    }
+    out->ring = c->ring_capacity;
+    int capacity, lanes, frames;
+    mp3codec_fit_target(c, 0, &capacity, &lanes, &frames);
+    out->ring_needed = mp3codec_ring_need(c, frames);
+}
+
+// Main thread, DSP off: choose the codec rate for a host rate. Up to CODEC_MAX_RATE LAME runs at
+// the host rate; above it, at the host rate divided by the smallest power of two that gets
+// there (88.2/96 kHz -> 44.1/48 kHz). The resampler only restarts when the factor changes, and
+// returns 1 only when the codec rate changed, in which case the states need rebuilding.
+int mp3codec_core_set_host_rate(t_mp3codec_core *c, long host_rate)
+{
+    long factor = 1;
+    
+    while (host_rate / factor > CODEC_MAX_RATE && factor < RESAMPLE_MAX_FACTOR && host_rate % (factor * 2) == 0) {
+        factor *= 2;
+    }
+    
+    c->host_rate = host_rate;
+    if (factor != c->resampler.factor) {
+        mp3codec_resampler_init(&c->resampler, factor, c->resample_quality);
+    }
+    if (host_rate / factor == c->sample_rate) {
+        return 0;
+    }
+    c->sample_rate = host_rate / factor;
+    return 1;
+}
+
+// Run a click through a throwaway pair built like the active one, and record where it comes
+// out of the decoder (codec_delay) and how far decoded output trails the input at a frame
+// boundary (codec_lag). Main thread; falls back to the nominal figures if the click is lost.
+void mp3codec_measure_delay(t_mp3codec_core *c)
+{
+    float probe_left[MP3_FRAME_SIZE];
+    float probe_right[MP3_FRAME_SIZE];
+    unsigned char mp3_buffer[MP3_BUFFER_SIZE];
+    short pcm_left[PCM_BUFFER_SIZE];
+    short pcm_right[PCM_BUFFER_SIZE];
+    const long click = MP3_FRAME_SIZE / 2;  // Input sample the click sits on
+    long decoded = 0, peak_at = -1, lag = 0;
+    int peak = 0;
+    
+    // With the reservoir on, LAME can hold a frame back until the next one is coded. How often
+    // depends on the material, and a click followed by silence never shows it, so the ring is
+    // always given that extra frame.
+    const int reservoir_lag = c->reservoir ? MP3_FRAME_SIZE : 0;
+    
+    c->codec_delay = c->lame_encoder_delay + 528 + 1;
+    c->codec_lag = 2 * MP3_FRAME_SIZE + reservoir_lag;
+    
+    // The probe is deterministic, so each configuration only needs measuring once
+    uint64_t key = mp3codec_config_key(c, c->quality);
+    for (int i = 0; i < CONFIG_CACHE_SLOTS; i++) {
+        if (mp3codec_cache.delays[i].key == key) {
+            c->codec_delay = mp3codec_cache.delays[i].codec_delay;
+            c->codec_lag = mp3codec_cache.delays[i].codec_lag;
+            return;
+        }
+    }
+    
+    t_mp3codec_state *st = mp3codec_state_new(c, c->quality, 0);
+    if (!st) {
+        return;
+    }
+    
+    for (long f = 0; f < DELAY_PROBE_FRAMES; f++) {
+        memset(probe_left, 0, sizeof(probe_left));
+        memset(probe_right, 0, sizeof(probe_right));
+        if (f == 0) {
+            probe_left[click] = probe_right[click] = 0.5f;
+        }
+        
+        int mp3_bytes = lame_encode_buffer_ieee_float(st->gfp, probe_left, probe_right, MP3_FRAME_SIZE, 
+                                                      mp3_buffer, MP3_BUFFER_SIZE);
+        int n = mp3_bytes > 0 ? hip_decode(st->hip, mp3_buffer, mp3_bytes, pcm_left, pcm_right) : 0;
+        for (int i = 0; i < n; i++) {
+            int level = abs(pcm_left[i]) + abs(pcm_right[i]);
+            if (level > peak) {
+                peak = level;
+                peak_at = decoded + i;
+            }
+        }
+        decoded += n > 0 ? n : 0;
+        lag = MAX(lag, (f + 1) * MP3_FRAME_SIZE - decoded);
+    }
+    mp3codec_state_free(st);
+    
+    // Only trust the click if it clearly survived the lowpass/ATH toggles
+    if (peak_at >= click && peak > 1000) {
+        c->codec_delay = (int)(peak_at - click);
+        c->codec_lag = (int)lag + reservoir_lag;
+    }
+    
+    t_mp3codec_cache_entry *e = mp3codec_cache_victim(mp3codec_cache.delays);
+    e->key = key;
+    e->codec_delay = c->codec_delay;
+    e->codec_lag = c->codec_lag;
+    e->used = ++mp3codec_cache.clock;
+}
+
+void mp3codec_cleanup_processor(t_mp3codec_core *c)
+{
+    if (!c) return;
+    
+    // Ensure processing is disabled first
+    c->initialized = 0;
+    
+    // Clear LAME objects safely
+    mp3codec_state_free(c->active);
+    c->active = NULL;
+    mp3codec_state_free(atomic_exchange(&c->pending_state, NULL));
+    for (int q = 0; q < QUALITY_LEVELS; q++) {
+        mp3codec_state_free(c->pool[q]);
+        c->pool[q] = NULL;
+        mp3codec_state_free(atomic_exchange(&c->pool_pending[q], NULL));
+        c->pool_generation[q] = 0;
+        c->pool_memory[q] = 0;
+    }
+    atomic_store(&c->pool_evict, 0);
+    mp3codec_state_free(c->guard_state);
+    c->guard_state = NULL;
+    mp3codec_state_free(atomic_exchange(&c->guard_pending, NULL));
+    atomic_store(&c->guard_evict, 0);
+    c->guard_built = 0;
+    c->guard_memory = 0;
+    c->guard_on = 0;
+    c->guard_hold = 0;
+    c->guard_cost_ns = 0;
+    c->guard_ref_ns = 0;
+    c->active_memory = 0;
+    mp3codec_state_retire(c);
+    
+    for (int l = 0; l < MORPH_LANES; l++) {
+        c->lanes[l].state = NULL;
+        c->lanes[l].decode_pcm_fill = 0;
+    }
+    
+    // Reset buffer state
+    c->encode_buffer_fill = 0;
+    c->ring_write_pos = 0;
+    c->ring_read_pos = 0;
+    c->ring_fill = 0;
+    c->ring_started = 0;
+    c->ring_written = 0;
+    c->samples_in = 0;
+    c->stagger_applied = 0;
+}
+
+// Low latency output: output sample n plays decoded sample n - output_delay, straight from the
+// ring's stream position, so the delay is exact however the codec's output bunches up. Anything
+// not decoded yet (or already overwritten) comes out as silence.
+static void mp3codec_ring_read_aligned(t_mp3codec_core *c, long stream_start, double *out_left, 
+                                       double *out_right, long sampleframes)
+{
+    long first = stream_start - c->output_delay;           // Decoded sample for out[0]
+    long oldest = MAX(0, c->ring_written - c->ring_size);  // Oldest sample still in the ring
+    long lo = CLAMP(oldest - first, 0, sampleframes);
+    long hi = CLAMP(c->ring_written - first, lo, sampleframes);
+    
+    memset(out_left, 0, lo * sizeof(double));
+    memset(out_right, 0, lo * sizeof(double));
+    
+    long pos = lo;
+    while (pos < hi) {
+        long index = (first + pos) % c->ring_size;
+        long span = MIN(hi - pos, c->ring_size - index);
+        mp3codec_kernels->gain_to_double(out_left + pos, c->output_ring_left + index, c->output_gain, span);
+        mp3codec_kernels->gain_to_double(out_right + pos, c->output_ring_right + index, c->output_gain, span);
+        pos += span;
+    }
+    
+    if (hi < sampleframes) {
+        memset(out_left + hi, 0, (sampleframes - hi) * sizeof(double));
+        memset(out_right + hi, 0, (sampleframes - hi) * sizeof(double));
+        if (c->ring_started) {
+            mp3codec_stat_add(&c->stats.underruns, 1);
+            mp3codec_event_push(c, MP3CODEC_EVENT_UNDERRUN, sampleframes - hi);
+        }
+    }
+}
+
+// Drop the first frames from the encode buffer, keeping whatever input follows them
+static void mp3codec_encode_buffer_consume(t_mp3codec_core *c, long frames)
+{
+    int used = (int)(frames * MP3_FRAME_SIZE);
+    int rest = c->encode_buffer_fill - used;
+    if (rest > 0) {
+        memmove(c->encode_buffer_left, c->encode_buffer_left + used, rest * sizeof(float));
+        memmove(c->encode_buffer_right, c->encode_buffer_right + used, rest * sizeof(float));
+    }
+    c->encode_buffer_fill = MAX(rest, 0);
+}
+
+// Audio thread: take over the source the main thread published, or let the current one go
+static void mp3codec_source_adopt(t_mp3codec_core *c)
+{
+    // The last one handed back hasn't been freed yet; try again next callback
+    if (atomic_load_explicit(&c->source_retired, memory_order_acquire)) {
+        return;
+    }
+    
+    t_mp3codec_source *old = c->source;
+    if (atomic_exchange_explicit(&c->source_evict, 0, memory_order_acq_rel)) {
+        c->source = NULL;
+    }
+    t_mp3codec_source *next = atomic_exchange_explicit(&c->source_pending, NULL, memory_order_acq_rel);
+    if (next) {
+        c->source = next;
+    }
+    if (c->source == old) {
+        return;
+    }
+    
+    if (old) {
+        atomic_store_explicit(&c->source_retired, old, memory_order_release);
+        mp3codec_notify(c, MP3CODEC_NOTIFY_RETIRE);
+    }
+    c->ring_mode = -1;  // Start the ring over for whatever plays next
+    c->source_position = 0;
+    c->source_ended = 0;
+}
+
+// Decode-only output: decode source frames into the ring (a plain FIFO here) until it covers
+// the callback, then read it out. Past the end of the file the output is silent.
+static void mp3codec_source_play(t_mp3codec_core *c, double *out_left, double *out_right, long sampleframes)
+{
+    t_mp3codec_source *s = c->source;
+    
+    long seek = atomic_exchange_explicit(&c->source_seek, -1, memory_order_acq_rel);
+    if (seek >= 0) {
+        mp3codec_source_seek(s, seek);
+        c->ring_write_pos = c->ring_read_pos;
+        c->ring_fill = 0;
+        c->source_position = seek;
+        c->source_ended = 0;
+    }
+    
+    // At any other rate the file would play at the wrong speed (the host warns about it)
+    if (s->sample_rate != c->sample_rate) {
+        memset(out_left, 0, sampleframes * sizeof(double));
+        memset(out_right, 0, sampleframes * sizeof(double));
+        return;
+    }
+    
+    long decoded = 0;
+    while (c->ring_fill < sampleframes && c->ring_size - c->ring_fill >= s->frame_samples) {
+        decoded = mp3codec_source_decode(s);
+        if (decoded < 0) break;
+        for (long i = 0; i < decoded; i++) {
+            c->output_ring_left[c->ring_write_pos] = short_to_float(s->pcm_left[i]);
+            c->output_ring_right[c->ring_write_pos] = short_to_float(s->pcm_right[i]);
+            if (++c->ring_write_pos == c->ring_size) {
+                c->ring_write_pos = 0;
+            }
+        }
+        c->ring_fill += decoded;
+    }
+    
+    long to_read = MIN(c->ring_fill, sampleframes);
+    long first = MIN(to_read, (long)(c->ring_size - c->ring_read_pos));
+    mp3codec_kernels->gain_to_double(out_left, c->output_ring_left + c->ring_read_pos, c->output_gain, first);
+    mp3codec_kernels->gain_to_double(out_right, c->output_ring_right + c->ring_read_pos, c->output_gain, first);
+    if (to_read > first) {
+        mp3codec_kernels->gain_to_double(out_left + first, c->output_ring_left, c->output_gain, to_read - first);
+        mp3codec_kernels->gain_to_double(out_right + first, c->output_ring_right, c->output_gain, to_read - first);
+    }
+    c->ring_read_pos = (int)((c->ring_read_pos + to_read) % c->ring_size);
+    c->ring_fill -= to_read;
+    c->source_position += to_read;
+    
+    if (to_read < sampleframes) {
+        memset(out_left + to_read, 0, (sampleframes - to_read) * sizeof(double));
+        memset(out_right + to_read, 0, (sampleframes - to_read) * sizeof(double));
+        if (decoded < 0 && !c->source_ended) {
+            c->source_ended = 1;
+            mp3codec_event_push(c, MP3CODEC_EVENT_SOURCE_END, c->source_position);
+        }
+    }
+}
+
+static void mp3codec_core_process_codec(t_mp3codec_core *c, const double *in_left, const double *in_right,
+                                        double *out_left, double *out_right, long sampleframes)
+{
+    // Check if we're in a valid state before proceeding
+    if (!c->initialized) {
+        // If not initialized, output silence and return
+        memset(out_left, 0, sampleframes * sizeof(double));
+        memset(out_right, 0, sampleframes * sizeof(double));
+        return;
+    }
+    
+    if (c->bypass) {
+        // Bypass mode - pass input directly to output
+        mp3codec_kernels->gain2(out_left, in_left, c->input_gain, c->output_gain, sampleframes);
+        mp3codec_kernels->gain2(out_right, in_right, c->input_gain, c->output_gain, sampleframes);
+        return;
+    }
+    
+    // Check buffer pointers
+    if (!c->encode_buffer_left || !c->encode_buffer_right || !c->output_ring_left || !c->output_ring_right) {
+        // Output silence if buffers not ready
+        memset(out_left, 0, sampleframes * sizeof(double));
+        memset(out_right, 0, sampleframes * sizeof(double));
+        return;
+    }
+    
+    // Follow the main thread's pipeline request. Switching happens here, between
+    // callbacks, so the worker never sees gfp/hip while this thread still uses them.
+    long pipeline_mode = atomic_load_explicit(&c->pipeline_mode, memory_order_relaxed);
+    long pipeline_request = atomic_load_explicit(&c->pipeline_request, memory_order_acquire);
+    if (pipeline_request != pipeline_mode) {
+        if (pipeline_request) {
+            mp3codec_queue_clear(&c->input_queue);
+            mp3codec_queue_clear(&c->output_queue);
+        }
+        pipeline_mode = pipeline_request;
+        atomic_store_explicit(&c->pipeline_mode, pipeline_mode, memory_order_release);
+    }
+    
+    mp3codec_source_adopt(c);
+    
+    // Follow the low latency (and render) setting, the reservoir, or the source. The modes lay
+    // the ring out differently, so start it over from silence at the current stream position.
+    long ring_mode = c->source ? SOURCE_RING_MODE : mp3codec_aligned(c);
+    if (ring_mode != c->ring_mode || mp3codec_ring_span(c, ring_mode) != c->ring_size) {
+        mp3codec_ring_restart(c, ring_mode);
+    }
+    
+    if (c->source) {
+        mp3codec_source_play(c, out_left, out_right, sampleframes);
+        return;
+    }
+    
+    long phase = mp3codec_stagger_phase(c);
+    if (phase != c->stagger_applied) {
+        mp3codec_stagger_shift(c, phase);
+    }
+    
+    long stream_start = c->samples_in;
+    int samples_processed = 0;
+    
+    // Render mode gathers a batch of frames per codec call (once a compact arena has room for
+    // one); the worker always takes single frames
+    int batch_size = MP3_FRAME_SIZE * ((c->render && !pipeline_mode && c->arena_frames > 1) ? RENDER_BATCH_FRAMES : 1);
+    
+    // Process input in chunks
+    while (samples_processed < sampleframes) {
+        int samples_to_copy = sampleframes - samples_processed;
+        int buffer_space = MAX(batch_size - c->encode_buffer_fill, 0);
+        
+        if (samples_to_copy > buffer_space) {
+            samples_to_copy = buffer_space;
+        }
+        
+        // Copy samples to encode buffer with input gain
+        mp3codec_kernels->gain_to_float(c->encode_buffer_left + c->encode_buffer_fill, 
+                                        in_left + samples_processed, c->input_gain, samples_to_copy);
+        mp3codec_kernels->gain_to_float(c->encode_buffer_right + c->encode_buffer_fill, 
+                                        in_right + samples_processed, c->input_gain, samples_to_copy);
+        
+        c->encode_buffer_fill += samples_to_copy;
+        samples_processed += samples_to_copy;
+        c->samples_in += samples_to_copy;
+        
+        // If we have a full frame (or batch), encode it. Leaving render mode can leave more
+        // than one frame buffered; those go out one per pass.
+        if (c->encode_buffer_fill >= batch_size) {
+            // Sample the quality inlet on the frame's last sample (host-rate index when resampled)
+            if (c->quality_cursor) {
+                double q = c->quality_cursor[(samples_processed - 1) * c->resampler.factor];
+                c->quality_sampled = CLAMP(q, 0.0, (double)(QUALITY_LEVELS - 1));
+            }
+            
+            if (pipeline_mode) {
+                // Collect whatever the worker finished during the previous frame period
+                t_mp3codec_frame *done;
+                while ((done = mp3codec_queue_read_slot(&c->output_queue))) {
+                    mp3codec_ring_write(c, done->left, done->right, done->count);
+                    mp3codec_queue_release(&c->output_queue);
+                }
+                
+                // Hand this frame to the worker (dropped if the worker has fallen behind)
+                t_mp3codec_frame *slot = mp3codec_queue_write_slot(&c->input_queue);
+                if (slot) {
+                    memcpy(slot->left, c->encode_buffer_left, MP3_FRAME_SIZE * sizeof(float));
+                    memcpy(slot->right, c->encode_buffer_right, MP3_FRAME_SIZE * sizeof(float));
+                    slot->count = MP3_FRAME_SIZE;
+                    slot->quality = c->quality_sampled;
+                    slot->deadline_ns = mp3codec_now_ns() +
+                                        (uint64_t)MP3_FRAME_SIZE * PIPELINE_DEADLINE_FRAMES * 1000000000ull /
+                                        (uint64_t)c->sample_rate;
+                    mp3codec_queue_commit(&c->input_queue);
+                    mp3codec_notify(c, MP3CODEC_NOTIFY_FRAME);
+                } else {
+                    mp3codec_stat_add(&c->stats.frames_dropped, 1);
+                    mp3codec_event_push(c, MP3CODEC_EVENT_DROPPED, 1);
+                }
+                
+                mp3codec_encode_buffer_consume(c, 1);
+                continue;
+            }
+            
+            long frames = MIN(c->encode_buffer_fill / MP3_FRAME_SIZE, RENDER_BATCH_FRAMES);
+            c->frame_quality = c->quality_sampled;
+            // Inline, the frame has to fit in this callback; a render has no deadline
+            c->frame_deadline_ns = c->render ? 0 : c->callback_end_ns;
+            int decoded_samples = mp3codec_frame_code(c, c->encode_buffer_left, c->encode_buffer_right, frames);
+            
+            // Keep any input past the batch
+            mp3codec_encode_buffer_consume(c, frames);
+            
+            if (decoded_samples < 0) {
+                break;  // Invalid state - stop encoding this vector
+            }
+            
+            if (decoded_samples > 0) {
+                // Mix straight into the ring when the frame fits before the wrap
+                if (c->ring_size - c->ring_write_pos >= decoded_samples) {
+                    mp3codec_frame_mix(c, c->output_ring_left + c->ring_write_pos, 
+                                       c->output_ring_right + c->ring_write_pos, decoded_samples);
+                    mp3codec_ring_advance(c, decoded_samples);
+                } else {
+                    float *mix_left = c->decode_out_left, *mix_right = c->decode_out_right;
+                    mp3codec_frame_mix(c, mix_left, mix_right, decoded_samples);
+                    mp3codec_ring_write(c, mix_left, mix_right, decoded_samples);
+                }
+            }
+        }
+    }
+    
+    if (c->ring_mode) {
+        mp3codec_ring_read_aligned(c, stream_start, out_left, out_right, sampleframes);
+        return;
+    }
+    
+    // Output from ring buffer
+    int available;
+    if (c->ring_write_pos >= c->ring_read_pos) {
+        available = c->ring_write_pos - c->ring_read_pos;
+    } else {
+        available = (c->ring_size - c->ring_read_pos) + c->ring_write_pos;
+    }
+    
+    // With compensation on, read only down to the latency threshold and pad with silence
+    long to_read = sampleframes;
+    if (c->decode_delay_compensation) {
+        to_read = CLAMP((long)available - c->total_latency_samples, 0, sampleframes);
+    }
+    
+    if (to_read > 0) {
+        // **OUTPUTTING MP3 PROCESSED AUDIO** in at most two contiguous spans
+        long first = MIN(to_read, (long)(c->ring_size - c->ring_read_pos));
+        mp3codec_kernels->gain_to_double(out_left, c->output_ring_left + c->ring_read_pos, c->output_gain, first);
+        mp3codec_kernels->gain_to_double(out_right, c->output_ring_right + c->ring_read_pos, c->output_gain, first);
+        if (to_read > first) {
+            mp3codec_kernels->gain_to_double(out_left + first, c->output_ring_left, c->output_gain, to_read - first);
+            mp3codec_kernels->gain_to_double(out_right + first, c->output_ring_right, c->output_gain, to_read - first);
+        }
+        c->ring_read_pos = (int)((c->ring_read_pos + to_read) % c->ring_size);
+        
+        // Reading past what has been decoded replays old ring contents; once output has
+        // started, count that as an underrun
+        if (to_read > c->ring_fill) {
+            if (c->ring_started) {
+                mp3codec_stat_add(&c->stats.underruns, 1);
+                mp3codec_event_push(c, MP3CODEC_EVENT_UNDERRUN, to_read - c->ring_fill);
+            }
+            c->ring_fill = 0;
+        } else {
+            c->ring_fill -= to_read;
+        }
+    }
+    if (to_read < sampleframes) {
+        // Not enough samples yet - output silence
+        memset(out_left + to_read, 0, (sampleframes - to_read) * sizeof(double));
+        memset(out_right + to_read, 0, (sampleframes - to_read) * sizeof(double));
+    }
+}
+
+void mp3codec_core_hold(t_mp3codec_core *c, int hold)
+{
+    atomic_store(&c->held, hold != 0);
+}
+
+int mp3codec_core_busy(t_mp3codec_core *c)
+{
+    return atomic_load(&c->in_callback);
+}
+
+static void mp3codec_core_process_host(t_mp3codec_core *c, const double *in_left, const double *in_right,
+                                       double *out_left, double *out_right, long sampleframes);
+
+// Audio thread entry point, at the host rate. Silent while the main thread holds the core.
+void mp3codec_core_process(t_mp3codec_core *c, const double *in_left, const double *in_right,
+                           double *out_left, double *out_right, long sampleframes)
+{
+    // Sequentially consistent on both sides: either the main thread sees this callback inside,
+    // or this callback sees held and stays out
+    atomic_store(&c->in_callback, 1);
+    if (atomic_load(&c->held)) {
+        memset(out_left, 0, sampleframes * sizeof(double));
+        memset(out_right, 0, sampleframes * sizeof(double));
+    } else {
+        mp3codec_core_process_host(c, in_left, in_right, out_left, out_right, sampleframes);
+    }
+    atomic_store_explicit(&c->in_callback, 0, memory_order_release);
+}
+
+// Above CODEC_MAX_RATE the signal goes through the codec a block at a time at the codec rate;
+// bypass and silence stay at the host rate.
+static void mp3codec_core_process_host(t_mp3codec_core *c, const double *in_left, const double *in_right,
+                                       double *out_left, double *out_right, long sampleframes)
+{
+    t_mp3codec_resampler *r = &c->resampler;
+    
+    // The next callback is due one period of this one (not the largest vector) from now
+    c->callback_end_ns = (c->guard && c->mode != MP3CODEC_MODE_CBR && c->host_rate > 0) ?
+                         mp3codec_now_ns() + (uint64_t)sampleframes * 1000000000ull / (uint64_t)c->host_rate : 0;
+    if (r->factor == 1 || !c->initialized || c->bypass) {
+        c->quality_cursor = c->quality_signal ? c->quality_input : NULL;
+        mp3codec_core_process_codec(c, in_left, in_right, out_left, out_right, sampleframes);
+        return;
+    }
+    
+    // Follow the resample quality; designing the filters doesn't allocate
+    if (r->quality != c->resample_quality) {
+        mp3codec_resampler_init(r, r->factor, c->resample_quality);
+    }
+    
+    for (long done = 0; done < sampleframes; ) {
+        long n = MIN(sampleframes - done, RESAMPLE_BLOCK);
+        long m = mp3codec_resample_down(r, in_left + done, in_right + done, n, c->codec_in_left, c->codec_in_right);
+        c->quality_cursor = (c->quality_signal && c->quality_input) ? c->quality_input + done : NULL;
+        mp3codec_core_process_codec(c, c->codec_in_left, c->codec_in_right, c->codec_out_left, c->codec_out_right, m);
+        mp3codec_resample_up(r, c->codec_out_left, c->codec_out_right, m, out_left + done, out_right + done, n);
+        done += n;
+    }
+}
+
+// MSB-first reader over a frame's side information
+typedef struct _mp3codec_bits {
+    const unsigned char *p;
+    long bit;
+} t_mp3codec_bits;
+
+static inline int mp3codec_bits_read(t_mp3codec_bits *b, int count)
+{
+    int value = 0;
+    for (int i = 0; i < count; i++, b->bit++) {
+        value = (value << 1) | ((b->p[b->bit >> 3] >> (7 - (b->bit & 7))) & 1);
+    }
+    return value;
+}
+
+// Codec owner: read what the frame at p coded from its header and side information and queue
+// it for the host. The frame is already whole (mp3codec_mpeg_frame checked its length).
+static void mp3codec_analysis_push(t_mp3codec_core *c, const unsigned char *p, long length, long frame)
+{
+    int mpeg1 = ((p[1] >> 3) & 3) == 3;
+    int channels = (p[3] >> 6) == 3 ? 1 : 2;
+    int granules = mpeg1 ? 2 : 1;
+    int crc = (p[1] & 1) ? 0 : 2;
+    long side_bytes = mpeg1 ? (channels == 1 ? 17 : 32) : (channels == 1 ? 9 : 17);
+    long rate = 0, samples = 0;
+    
+    if (4 + crc + side_bytes > length) return;
+    mp3codec_mpeg_frame(p, length, &samples, &rate);
+    
+    unsigned int head = atomic_load_explicit(&c->analysis_head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&c->analysis_tail, memory_order_acquire);
+    if (head - tail >= ANALYSIS_SLOTS) {
+        mp3codec_stat_add(&c->stats.analysis_lost, 1);
+        return;
+    }
+    
+    t_mp3codec_frame_info *info = &c->analysis_ring[head % ANALYSIS_SLOTS];
+    info->frame = frame;
+    info->bytes = (int)length;
+    long slot_scale = mpeg1 ? 144000 : 72000;  // Frame length = scale * kbps / rate, rounded down
+    info->kbps = (int)(((length - ((p[2] >> 1) & 1)) * rate + slot_scale / 2) / slot_scale);
+    info->ms_stereo = (p[3] >> 6) == 1 && (p[3] & 0x20);  // Joint stereo with the M/S extension
+    
+    // Side information layout per ISO 11172-3 2.4.1.7 (MPEG2: 13818-3, one granule)
+    t_mp3codec_bits b = {p + 4 + crc, 0};
+    info->reservoir = mp3codec_bits_read(&b, mpeg1 ? 9 : 8);
+    b.bit += mpeg1 ? (channels == 1 ? 5 : 3) + 4 * channels : channels;  // Private bits, scfsi
+    for (int gr = 0; gr < 2; gr++) {
+        for (int ch = 0; ch < 2; ch++) {
+            if (gr >= granules || ch >= channels) {
+                info->block_type[gr][ch] = -1;
+                continue;
+            }
+            b.bit += 12 + 9 + 8 + (mpeg1 ? 4 : 9);  // part2_3_length, big_values, global_gain, scalefac_compress
+            if (mp3codec_bits_read(&b, 1)) {
+                info->block_type[gr][ch] = mp3codec_bits_read(&b, 2);
+                b.bit += 1 + 2 * 5 + 3 * 3;          // mixed_block_flag, table_select, subblock_gain
+            } else {
+                info->block_type[gr][ch] = 0;
+                b.bit += 3 * 5 + 4 + 3;              // table_select, region0/1_count
+            }
+            b.bit += mpeg1 ? 3 : 2;                  // (preflag,) scalefac_scale, count1table_select
+        }
+    }
+    
+    atomic_store_explicit(&c->analysis_head, head + 1, memory_order_release);
+    if (!atomic_exchange_explicit(&c->analysis_notified, 1, memory_order_acq_rel)) {
+        mp3codec_notify(c, MP3CODEC_NOTIFY_ANALYSIS);
+    }
+}
+
+// Codec owner: walk the MP3 frames the last encoder call produced, keeping the state's stream
+// position, and queue the tapped lane's new ones for the writer and the frame analysis. Never
+// blocks: a frame that doesn't fit is dropped and counted.
+static void mp3codec_tap_frames(t_mp3codec_core *c, t_mp3codec_lane *lane)
+{
+    t_mp3codec_state *st = lane->state;
+    int tapping = lane == &c->lanes[c->tap_lane] &&
+                  atomic_load_explicit(&c->tap_enabled, memory_order_acquire);  // Publishes tap_ring
+    int analysing = lane == &c->lanes[c->tap_lane] && c->analysis;
+    unsigned int head = atomic_load_explicit(&c->tap_head, memory_order_relaxed);
+    unsigned int tail = tapping ? atomic_load_explicit(&c->tap_tail, memory_order_acquire) : 0;
+    long samples = 0;
+    
+    for (long offset = 0, length; offset < lane->bitstream_bytes; offset += length) {
+        length = mp3codec_mpeg_frame(lane->bitstream + offset, lane->bitstream_bytes - offset, &samples, NULL);
+        if (!length) break;
+        
+        long position = st->stream_origin + st->samples_coded;
+        st->samples_coded += samples;
+        if (analysing && position >= c->analysis_position) {
+            mp3codec_analysis_push(c, lane->bitstream + offset, length, position / samples);
+            c->analysis_position = position + samples;
+        }
+        if (!tapping || position < c->tap_position) continue;
+        
+        if (TAP_RING_SIZE - (head - tail) < (unsigned int)length) {
+            mp3codec_stat_add(&c->stats.tap_dropped, 1);
+            mp3codec_event_push(c, MP3CODEC_EVENT_TAP_DROPPED, length);
+        } else {
+            unsigned int at = head & (TAP_RING_SIZE - 1);
+            long first = MIN(length, (long)(TAP_RING_SIZE - at));
+            memcpy(c->tap_ring + at, lane->bitstream + offset, first);
+            memcpy(c->tap_ring, lane->bitstream + offset + first, length - first);
+            head += (unsigned int)length;
+            mp3codec_stat_add(&c->stats.tap_frames, 1);
+        }
+        c->tap_position = position + samples;
+    }
+    atomic_store_explicit(&c->tap_head, head, memory_order_release);
+}
+
+// Run one frame through a lane's encoder/decoder, appending decoded samples to the lane's
+// decode_pcm_left/right. The encoder writes into the lane's bitstream buffer and hip decodes
+// it from there; hip keeps any partial frame itself, so no bytes are ever held back or
+// dropped here. Returns the number of samples added after preroll discard.
+static int mp3codec_codec_frame(t_mp3codec_core *c, t_mp3codec_lane *lane, const float *left, const float *right,
+                                long frames)
+{
+    int samples = (int)(frames * MP3_FRAME_SIZE);
+    int mp3_bytes = 0;
+    uint64_t start = mp3codec_now_ns();
+    
+    if (c->pcm16) {
+        // Legacy path: clip to 16 bit before the codec sees the signal, PCM16_CHUNK samples at
+        // a time on the stack. LAME buffers its input, so the bitstream is that of one call.
+        short pcm_left[PCM16_CHUNK];
+        short pcm_right[PCM16_CHUNK];
+        
+        for (int done = 0; done < samples && mp3_bytes >= 0; done += PCM16_CHUNK) {
+            int n = MIN(PCM16_CHUNK, samples - done);
+            mp3codec_kernels->float_to_s16(pcm_left, left + done, n);
+            mp3codec_kernels->float_to_s16(pcm_right, right + done, n);
+            
+            int bytes = lame_encode_buffer(lane->state->gfp, 
+                                           pcm_left, 
+                                           pcm_right, 
+                                           n, 
+                                           lane->bitstream + mp3_bytes, 
+                                           MP3_BUFFER_SIZE - mp3_bytes);
+            mp3_bytes = bytes < 0 ? bytes : mp3_bytes + bytes;
+        }
+    } else {
+        // LAME takes normalised float directly - no conversion pass, no clipping
+        mp3_bytes = lame_encode_buffer_ieee_float(lane->state->gfp, 
+                                                left, 
+                                                right, 
+                                                samples, 
+                                                lane->bitstream, 
+                                                MP3_BUFFER_SIZE);
+    }
+    c->cpu.frame_encode_ns += mp3codec_now_ns() - start;
+    lane->state->samples_fed += samples;
+    
+    if (mp3_bytes < 0) {
+        mp3codec_stat_add(&c->stats.encode_errors, 1);
+        mp3codec_event_push(c, MP3CODEC_EVENT_ENCODE_ERROR, mp3_bytes);
+        lane->bitstream_bytes = 0;
+        return 0;
+    }
+    mp3codec_stat_add(&c->stats.bytes_produced, mp3_bytes);
+    lane->bitstream_bytes = mp3_bytes;
+    mp3codec_tap_frames(c, lane);
+    
+    // Hand the new bytes to hip, then take one decoded frame at a time while there is room;
+    // anything left stays inside hip for the next call. Runs even with no new bytes, so a
+    // backlog drains as soon as the lane has room again.
+    int offset = lane->decode_pcm_fill;
+    int decoded_samples = 0;
+    int bytes = mp3_bytes;
+    start = mp3codec_now_ns();
+    lane->decode_backlog = 1;
+    while (offset + decoded_samples <= PCM_BUFFER_SIZE - MP3_FRAME_SIZE) {
+        int n = hip_decode1(lane->state->hip, 
+                            lane->bitstream, 
+                            bytes, 
+                            lane->decode_pcm_left + offset + decoded_samples, 
+                            lane->decode_pcm_right + offset + decoded_samples);
+        bytes = 0;
+        if (n < 0) {
+            mp3codec_stat_add(&c->stats.decode_errors, 1);
+            mp3codec_event_push(c, MP3CODEC_EVENT_DECODE_ERROR, n);
+            break;
+        }
+        if (n == 0) {
+            lane->decode_backlog = 0;
+            break;  // hip needs the rest of the frame
+        }
+        decoded_samples += n;
+    }
+    c->cpu.frame_decode_ns += mp3codec_now_ns() - start;
+    lane->state->samples_out += decoded_samples;
+    
+    if (decoded_samples == 0) {
+        return 0;
+    }
+    if (c->channels == 1) {
+        // Mono streams only decode into the left buffer; keep the rest of the path stereo
+        memcpy(lane->decode_pcm_right + offset, lane->decode_pcm_left + offset, decoded_samples * sizeof(short));
+    }
+    
+    // Drop output the timeline has already delivered (see mp3codec_lane_join)
+    if (lane->discard_samples > 0) {
+        int skip = (int)MIN(lane->discard_samples, decoded_samples);
+        memmove(lane->decode_pcm_left + offset, lane->decode_pcm_left + offset + skip, 
+                (decoded_samples - skip) * sizeof(short));
+        memmove(lane->decode_pcm_right + offset, lane->decode_pcm_right + offset + skip, 
+                (decoded_samples - skip) * sizeof(short));
+        decoded_samples -= skip;
+        lane->discard_samples -= skip;
+    }
+    
+    lane->decode_pcm_fill += decoded_samples;
+    return decoded_samples;
+}
+
+// Stand in for mp3codec_codec_frame on a lane that has coded SILENCE_FRAMES of digital silence:
+// the codec's delay lines have flushed by then, so the frame would decode to zeros. Append
+// those zeros and advance the state's accounts as if it had run; the next non-silent frame
+// picks up the untouched codec where it left off. LAME's adaptive state (the ATH adjustment)
+// doesn't see the skipped frames, so the frames after a resume can differ from @idle 0.
+static void mp3codec_lane_idle(t_mp3codec_lane *lane, long frames)
+{
+    long samples = frames * MP3_FRAME_SIZE;
+    long skip = MIN(lane->discard_samples, samples);
+    
+    lane->state->samples_fed += samples;
+    lane->state->samples_out += samples;
+    lane->state->samples_coded += samples;
+    lane->bitstream_bytes = 0;
+    lane->discard_samples -= skip;
+    memset(lane->decode_pcm_left + lane->decode_pcm_fill, 0, (samples - skip) * sizeof(short));
+    memset(lane->decode_pcm_right + lane->decode_pcm_fill, 0, (samples - skip) * sizeof(short));
+    lane->decode_pcm_fill += (int)(samples - skip);
+}
+
+// Whether lane can skip a silent frame: it has flushed the codec with silence, hip holds no
+// decoded frames it had no room for, and the zeros fit. A recording is always coded in full.
+static int mp3codec_lane_can_idle(t_mp3codec_core *c, t_mp3codec_lane *lane, long frames)
+{
+    return lane->silent_frames >= SILENCE_FRAMES && !lane->decode_backlog &&
+           lane->decode_pcm_fill + frames * MP3_FRAME_SIZE <= PCM_BUFFER_SIZE &&
+           !atomic_load_explicit(&c->tap_enabled, memory_order_relaxed);
+}
+
+// Start running st in lane. Recent input is replayed into the encoder so its delay line is
+// full, and the part of its output the timeline already delivered is dropped, so the lane's
+// first sample lines up with the next output sample.
+static void mp3codec_lane_join(t_mp3codec_core *c, t_mp3codec_lane *lane, t_mp3codec_state *st)
+{
+    long preroll = MIN(c->frames_encoded, STATE_PREROLL_FRAMES);
+    long preroll_start = (c->frames_encoded - preroll) * MP3_FRAME_SIZE;
+    
+    lane->state = st;
+    lane->decode_pcm_fill = 0;
+    lane->silent_frames = 0;  // The preroll doesn't count as silence coded
+    lane->decode_backlog = 0;
+    lane->discard_samples = c->samples_decoded - preroll_start + (st->encoder_delay - c->stream_delay);
+    
+    // Line the state's own input count up with the stream, as if it had run all along
+    st->stream_origin = preroll_start - st->samples_fed;
+    
+    // A state that ran before (a pool level morphed back to, the guard state) still holds the
+    // tail of that stint; its output only reaches the preroll after that has come out
+    lane->discard_samples += st->samples_fed - st->samples_out;
+    if (lane->discard_samples < 0) {
+        lane->discard_samples = 0;
+    }
+    
+    for (long f = STATE_PREROLL_FRAMES - preroll; f < STATE_PREROLL_FRAMES; f++) {
+        mp3codec_codec_frame(c, lane, c->history_left + f * MP3_FRAME_SIZE, 
+                             c->history_right + f * MP3_FRAME_SIZE, 1);
+    }
+}
+
+// Codec owner: hand a state back to the main thread for freeing. Never blocks or deallocates.
+static void mp3codec_retire(t_mp3codec_core *c, t_mp3codec_state *st)
+{
+    unsigned int head = atomic_load_explicit(&c->retire_head, memory_order_relaxed);
+    
+    // Lanes only borrow states, so forget any lane still pointing at this one
+    for (int l = 0; l < MORPH_LANES; l++) {
+        if (c->lanes[l].state == st) {
+            c->lanes[l].state = NULL;
+        }
+    }
+    
+    c->retire_ring[head % RETIRE_SLOTS] = st;
+    atomic_store_explicit(&c->retire_head, head + 1, memory_order_release);
+    mp3codec_notify(c, MP3CODEC_NOTIFY_RETIRE);
+}
+
+// Codec owner: take over whatever the main thread has published since the last frame
+static void mp3codec_adopt_states(t_mp3codec_core *c)
+{
+    unsigned int head = atomic_load_explicit(&c->retire_head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&c->retire_tail, memory_order_acquire);
+    
+    // Worst case this frame retires the active state, every pool entry and the guard state
+    if (RETIRE_SLOTS - (head - tail) < QUALITY_LEVELS + 2) {
+        return;  // Main thread is behind; try again next frame
+    }
+    
+    t_mp3codec_state *next = atomic_exchange_explicit(&c->pending_state, NULL, memory_order_acq_rel);
+    if (next) {
+        mp3codec_retire(c, c->active);
+        c->active = next;
+    }
+    
+    // Evictions first, so a replacement published after an eviction survives it
+    unsigned int evict = atomic_exchange_explicit(&c->pool_evict, 0, memory_order_acq_rel);
+    for (int q = 0; q < QUALITY_LEVELS; q++) {
+        if ((evict & (1u << q)) && c->pool[q]) {
+            mp3codec_retire(c, c->pool[q]);
+            c->pool[q] = NULL;
+        }
+    }
+    for (int q = 0; q < QUALITY_LEVELS; q++) {
+        t_mp3codec_state *st = atomic_exchange_explicit(&c->pool_pending[q], NULL, memory_order_acq_rel);
+        if (st) {
+            if (c->pool[q]) {
+                mp3codec_retire(c, c->pool[q]);
+            }
+            c->pool[q] = st;
+        }
+    }
+    
+    if (atomic_exchange_explicit(&c->guard_evict, 0, memory_order_acq_rel) && c->guard_state) {
+        mp3codec_retire(c, c->guard_state);
+        c->guard_state = NULL;
+        c->guard_on = 0;
+        c->guard_hold = 0;
+    }
+    t_mp3codec_state *guard = atomic_exchange_explicit(&c->guard_pending, NULL, memory_order_acq_rel);
+    if (guard) {
+        if (c->guard_state) {
+            mp3codec_retire(c, c->guard_state);
+        }
+        c->guard_state = guard;
+    }
+}
+
+// Deadline guard: a full ABR/VBR frame that would end past the frame's deadline, going by what
+// the last one took, runs on the guard state instead. The guard then holds for a while, since
+// every switch costs the incoming state a preroll. Afterwards the full state only comes back if
+// a frame plus that preroll fits the deadline, going by its last cost scaled down by however
+// much faster the guard state has got since it took over (a load spike passing); otherwise the
+// guard holds again, so a full state that can't keep up never gets a frame it would miss with.
+static int mp3codec_guard_check(t_mp3codec_core *c, long frames)
+{
+    if (!c->guard_state || !c->frame_deadline_ns) {
+        c->guard_on = 0;
+        return 0;
+    }
+    
+    uint64_t now = mp3codec_now_ns();
+    if (!c->guard_on) {
+        if (now + c->guard_cost_ns <= c->frame_deadline_ns) {
+            return 0;
+        }
+        mp3codec_event_push(c, MP3CODEC_EVENT_GUARD, (long)(c->guard_cost_ns / 1000));
+        c->guard_on = 1;
+        c->guard_hold = GUARD_HOLD_FRAMES - 1;
+        c->guard_ref_ns = 0;
+    } else if (c->guard_hold > 0) {
+        c->guard_hold--;
+    } else {
+        uint64_t cost = c->guard_cost_ns;
+        if (c->guard_ref_ns && c->guard_fast_ns < c->guard_ref_ns) {
+            cost = (uint64_t)((double)cost * (double)c->guard_fast_ns / (double)c->guard_ref_ns);
+        }
+        if (now + cost * (1 + STATE_PREROLL_FRAMES) <= c->frame_deadline_ns) {
+            c->guard_on = 0;
+            return 0;
+        }
+        c->guard_hold = GUARD_HOLD_FRAMES - 1;
+    }
+    mp3codec_stat_add(&c->stats.guarded_frames, frames);
+    return 1;
+}
+
+// Choose the states to run this frame and their mix weights. Without morphing (or while the
+// pool is still warming up) that is just the active state. A connected quality inlet stands
+// in for morph, at the value it had when the frame was completed.
+static void mp3codec_morph_select(t_mp3codec_core *c, t_mp3codec_state **want, double *weight)
+{
+    want[0] = c->active;
+    weight[0] = 1.0;
+    want[1] = NULL;
+    weight[1] = 0.0;
+    
+    double m = c->quality_signal ? c->frame_quality : c->morph;
+    if (m < 0.0) return;
+    m = CLAMP(m, 0.0, (double)(QUALITY_LEVELS - 1));
+    
+    int a = (int)m;
+    int b = MIN(a + 1, QUALITY_LEVELS - 1);
+    double frac = m - a;
+    
+    // Fall back to the nearest warm level if the exact one isn't built yet
+    t_mp3codec_state *st_a = c->pool[a];
+    for (int d = 1; !st_a && d < QUALITY_LEVELS; d++) {
+        if (a - d >= 0 && c->pool[a - d]) st_a = c->pool[a - d];
+        else if (a + d < QUALITY_LEVELS && c->pool[a + d]) st_a = c->pool[a + d];
+    }
+    if (!st_a) return;
+    
+    // A compact arena laid out for one lane stays on the lower level until it is refitted
+    want[0] = st_a;
+    if (frac > 0.0 && c->arena_lanes > 1 && c->pool[b] && c->pool[b] != st_a) {
+        want[1] = c->pool[b];
+        weight[0] = 1.0 - frac;
+        weight[1] = frac;
+    }
+}
+
+// Encode one frame and decode it into decode_out_left/right, crossfading the morph lanes.
+// Called by whichever thread currently owns the codec.
+// Returns decoded samples, or -1 when the codec is not in a usable state.
+int mp3codec_encode_decode_frame(t_mp3codec_core *c, const float *left, const float *right)
+{
+    int decoded_samples = mp3codec_frame_code(c, left, right, 1);
+    if (decoded_samples > 0) {
+        mp3codec_frame_mix(c, c->decode_out_left, c->decode_out_right, decoded_samples);
+    }
+    return decoded_samples;
+}
+
+// Codec owner: pick up a share group published by the main thread, handing the last one back
+static void mp3codec_share_adopt(t_mp3codec_core *c)
+{
+    // The last one handed back hasn't been left yet; try again next frame
+    if (atomic_load_explicit(&c->share_retired, memory_order_acquire)) {
+        return;
+    }
+    
+    t_mp3codec_share *old = c->share;
+    short changed = 0;
+    if (atomic_exchange_explicit(&c->share_evict, 0, memory_order_acq_rel)) {
+        c->share = NULL;
+        changed = 1;
+    }
+    t_mp3codec_share *next = atomic_exchange_explicit(&c->share_pending, NULL, memory_order_acq_rel);
+    if (next) {
+        c->share = next;
+        changed = 1;
+    }
+    
+    // Every join holds its own reference, even to the group already in use
+    if (changed && old) {
+        atomic_store_explicit(&c->share_retired, old, memory_order_release);
+        mp3codec_notify(c, MP3CODEC_NOTIFY_RETIRE);
+    }
+}
+
+// Whether the frame can be shared, and what it is filed under. Only one state at full weight
+// with nothing fading out counts: its output then depends on nothing but the state's settings,
+// the input and where the timeline stands.
+static short mp3codec_share_file(t_mp3codec_core *c, t_mp3codec_state **want, const double *weight,
+                                 short guarded, const float *left, const float *right, long frames)
+{
+    if (!c->share || guarded || !want[0] || weight[0] != 1.0 || (want[1] && weight[1] > 0.0) ||
+        want[0]->generation != c->config_generation) {
+        return 0;
+    }
+    for (int l = 0; l < MORPH_LANES; l++) {
+        if (c->lanes[l].state && c->lanes[l].gain != (c->lanes[l].state == want[0] ? 1.0 : 0.0)) {
+            return 0;
+        }
+    }
+    
+    long samples = frames * MP3_FRAME_SIZE;
+    uint64_t hash = SHARE_HASH_SEED;
+    hash = mp3codec_share_hash(hash, c->history_left, STATE_PREROLL_FRAMES * MP3_FRAME_SIZE);
+    hash = mp3codec_share_hash(hash, c->history_right, STATE_PREROLL_FRAMES * MP3_FRAME_SIZE);
+    hash = mp3codec_share_hash(hash, left, samples);
+    hash = mp3codec_share_hash(hash, right, samples);
+    
+    c->share_tag.key = mp3codec_config_key(c, want[0]->quality) ^ (uint64_t)c->pcm16 << 48 ^ (uint64_t)frames << 52;
+    c->share_tag.hash = hash;
+    c->share_tag.lag = c->frames_encoded * MP3_FRAME_SIZE - c->samples_decoded;
+    return 1;
+}
+
+// Keep the most recent frames for the next lane join, advance the timeline and record what
+// the frame cost per frame (including any lane preroll it paid for)
+static void mp3codec_frame_done(t_mp3codec_core *c, const float *left, const float *right, long frames,
+                                int decoded_samples)
+{
+    long keep_frames = MIN(frames, STATE_PREROLL_FRAMES);
+    long shift = (STATE_PREROLL_FRAMES - keep_frames) * MP3_FRAME_SIZE;
+    memmove(c->history_left, c->history_left + keep_frames * MP3_FRAME_SIZE, shift * sizeof(float));
+    memmove(c->history_right, c->history_right + keep_frames * MP3_FRAME_SIZE, shift * sizeof(float));
+    memcpy(c->history_left + shift, left + (frames - keep_frames) * MP3_FRAME_SIZE, 
+           keep_frames * MP3_FRAME_SIZE * sizeof(float));
+    memcpy(c->history_right + shift, right + (frames - keep_frames) * MP3_FRAME_SIZE, 
+           keep_frames * MP3_FRAME_SIZE * sizeof(float));
+    
+    c->frames_encoded += frames;
+    c->samples_decoded += decoded_samples;
+    mp3codec_stat_add(&c->stats.frames_encoded, frames);
+    
+    unsigned int slot = atomic_load_explicit(&c->cpu.frames, memory_order_relaxed) % CPU_WINDOW;
+    atomic_store_explicit(&c->cpu.encode_ns[slot], (unsigned int)MIN(c->cpu.frame_encode_ns / frames, UINT32_MAX), memory_order_relaxed);
+    atomic_store_explicit(&c->cpu.decode_ns[slot], (unsigned int)MIN(c->cpu.frame_decode_ns / frames, UINT32_MAX), memory_order_relaxed);
+    atomic_fetch_add_explicit(&c->cpu.frames, 1, memory_order_release);
+}
+
+// Run frames (1 to RENDER_BATCH_FRAMES) through every lane and return how many samples all
+// of them can mix
+static int mp3codec_frame_code(t_mp3codec_core *c, const float *left, const float *right, long frames)
+{
+    t_mp3codec_state *want[MORPH_LANES];
+    double weight[MORPH_LANES];
+    double target[MORPH_LANES] = {0.0, 0.0};
+    short keep[MORPH_LANES] = {0, 0};
+    
+    // Safety check LAME state and initialized flag
+    if (!c->initialized || !c->active) {
+        mp3codec_event_push(c, MP3CODEC_EVENT_INVALID_STATE, 0);
+        return -1;
+    }
+    
+    // Pick up new states at this frame boundary
+    c->cpu.frame_encode_ns = 0;
+    c->cpu.frame_decode_ns = 0;
+    mp3codec_adopt_states(c);
+    mp3codec_share_adopt(c);
+    mp3codec_morph_select(c, want, weight);
+    short guarded = mp3codec_guard_check(c, frames);
+    if (guarded) {
+        want[0] = c->guard_state;
+        weight[0] = 1.0;
+        want[1] = NULL;
+        weight[1] = 0.0;
+    }
+    
+    // Another core in the group may have coded this very frame already. Taking it leaves the
+    // lanes behind, so they are dropped; a later frame coded here rejoins them with preroll,
+    // like any state that sat out. A recording needs this core's own bitstream.
+    c->share_hit = 0;
+    c->share_store = mp3codec_share_file(c, want, weight, guarded, left, right, frames);
+    if (c->share_store && !atomic_load_explicit(&c->tap_enabled, memory_order_relaxed)) {
+        long count = mp3codec_share_find(c->share, &c->share_tag, c->decode_out_left, c->decode_out_right);
+        if (count >= 0) {
+            for (int l = 0; l < MORPH_LANES; l++) {
+                c->lanes[l].state = NULL;
+                c->lanes[l].gain = 0.0;
+                c->lanes[l].target = 0.0;
+            }
+            c->share_store = 0;
+            c->share_hit = 1;
+            mp3codec_stat_add(&c->stats.shared_frames, frames);
+            mp3codec_frame_done(c, left, right, frames, (int)count);
+            return (int)count;
+        }
+    }
+    
+    // Lanes already running a wanted state keep it, so only a newcomer needs preroll
+    for (int w = 0; w < MORPH_LANES; w++) {
+        for (int l = 0; want[w] && l < MORPH_LANES; l++) {
+            if (!keep[l] && c->lanes[l].state == want[w]) {
+                keep[l] = 1;
+                target[l] = weight[w];
+                want[w] = NULL;
+            }
+        }
+    }
+    short any_kept = keep[0] || keep[1];
+    for (int w = 0; w < MORPH_LANES; w++) {
+        for (int l = 0; want[w] && l < MORPH_LANES; l++) {
+            if (!keep[l]) {
+                mp3codec_lane_join(c, &c->lanes[l], want[w]);
+                // Fade a newcomer in next to a running lane; splice it in when it replaces everything
+                c->lanes[l].gain = any_kept ? 0.0 : weight[w];
+                keep[l] = 1;
+                target[l] = weight[w];
+                want[w] = NULL;
+            }
+        }
+    }
+    for (int l = 0; l < MORPH_LANES; l++) {
+        if (!keep[l]) {
+            c->lanes[l].state = NULL;
+            c->lanes[l].gain = 0.0;
+        }
+        c->lanes[l].target = target[l];
+    }
+    c->tap_lane = (c->lanes[1].state && target[1] > target[0]) ? 1 : 0;
+    
+    // Digital silence: each lane codes it until its codec has flushed, then skips the codec.
+    // LAME codes float input below one 16-bit step as signal, so only zeros count; pcm16
+    // truncates anything below SILENCE_PEAK to zero.
+    long samples = frames * MP3_FRAME_SIZE;
+    short silent = 0;
+    if (c->idle) {
+        float peak = MAX(mp3codec_kernels->peak(left, samples), mp3codec_kernels->peak(right, samples));
+        silent = c->pcm16 ? peak < SILENCE_PEAK : peak == 0.0f;
+    }
+    
+    // Run the frame through every live lane; the timeline advances by what all of them have
+    int decoded_samples = PCM_BUFFER_SIZE;
+    uint64_t lanes_ns = c->cpu.frame_encode_ns + c->cpu.frame_decode_ns;  // Preroll so far
+    short lanes_run = 0, lanes_idle = 0;
+    for (int l = 0; l < MORPH_LANES; l++) {
+        t_mp3codec_lane *lane = &c->lanes[l];
+        if (!lane->state) continue;
+        if (silent && mp3codec_lane_can_idle(c, lane, frames)) {
+            mp3codec_lane_idle(lane, frames);
+            lanes_idle++;
+        } else {
+            mp3codec_codec_frame(c, lane, left, right, frames);
+            lanes_run++;
+        }
+        lane->silent_frames = silent ? lane->silent_frames + frames : 0;
+        decoded_samples = MIN(decoded_samples, lane->decode_pcm_fill);
+    }
+    if (!lanes_idle) {
+        uint64_t cost = c->cpu.frame_encode_ns + c->cpu.frame_decode_ns - lanes_ns;
+        if (!guarded) {
+            c->guard_cost_ns = cost;
+        } else {
+            c->guard_fast_ns = cost;
+            if (!c->guard_ref_ns) c->guard_ref_ns = cost;
+        }
+    }
+    if (lanes_idle && !lanes_run) {
+        mp3codec_stat_add(&c->stats.idle_frames, frames);
+    }
+    
+    mp3codec_frame_done(c, left, right, frames, decoded_samples);
+    return decoded_samples;
+}
+
+// Mix count samples of every live lane into out, with per-lane gain ramps across the frame
+// so morph moves don't zipper, and drop them from the lanes
+static void mp3codec_frame_mix(t_mp3codec_core *c, float *out_left, float *out_right, int count)
+{
+    if (c->share_hit) {
+        if (out_left != c->decode_out_left) {
+            memcpy(out_left, c->decode_out_left, count * sizeof(float));
+            memcpy(out_right, c->decode_out_right, count * sizeof(float));
+        }
+        c->share_hit = 0;
+        return;
+    }
+    
+    memset(out_left, 0, count * sizeof(float));
+    memset(out_right, 0, count * sizeof(float));
+    for (int l = 0; l < MORPH_LANES; l++) {
+        t_mp3codec_lane *lane = &c->lanes[l];
+        if (!lane->state) continue;
+        
+        float gain = (float)lane->gain;
+        float step = count ? (float)((lane->target - lane->gain) / count) : 0.0f;
+        for (int i = 0; i < count; i++) {
+            gain += step;
+            out_left[i] += short_to_float(lane->decode_pcm_left[i]) * gain;
+            out_right[i] += short_to_float(lane->decode_pcm_right[i]) * gain;
+        }
+        
+        lane->decode_pcm_fill -= count;
+        memmove(lane->decode_pcm_left, lane->decode_pcm_left + count, lane->decode_pcm_fill * sizeof(short));
+        memmove(lane->decode_pcm_right, lane->decode_pcm_right + count, lane->decode_pcm_fill * sizeof(short));
+        if (count) {
+            lane->gain = lane->target;
+        }
+    }
+    
+    if (c->share_store) {
+        mp3codec_share_store(c->share, &c->share_tag, out_left, out_right, count);
+        c->share_store = 0;
+    }
+}
+
+// Account for count samples already written at ring_write_pos (no wrap)
+void mp3codec_ring_advance(t_mp3codec_core *c, int count)
+{
+    c->ring_fill = MIN(c->ring_fill + count, c->ring_size);
+    c->ring_started |= (count > 0);
+    c->ring_written += count;
+    c->ring_write_pos += count;
+    if (c->ring_write_pos >= c->ring_size) {
+        c->ring_write_pos = 0;
+    }
+}
+
+// Copy into the ring in at most two contiguous spans (up to the end, then from the start)
+void mp3codec_ring_write(t_mp3codec_core *c, const float *left, const float *right, int count)
+{
+    c->ring_fill = MIN(c->ring_fill + count, c->ring_size);
+    c->ring_started |= (count > 0);
+    c->ring_written += count;
+    while (count > 0) {
+        int span = MIN(count, c->ring_size - c->ring_write_pos);
+        memcpy(c->output_ring_left + c->ring_write_pos, left, span * sizeof(float));
+        memcpy(c->output_ring_right + c->ring_write_pos, right, span * sizeof(float));
+        c->ring_write_pos += span;
+        if (c->ring_write_pos >= c->ring_size) {
+            c->ring_write_pos = 0;
+        }
+        left += span;
+        right += span;
+        count -= span;
+    }
+}
+
+void mp3codec_core_set_source(t_mp3codec_core *c, t_mp3codec_source *s)
+{
+    // Cancel any drop still in flight before publishing the replacement
+    if (s) {
+        atomic_store_explicit(&c->source_evict, 0, memory_order_release);
+    }
+    mp3codec_source_close(atomic_exchange_explicit(&c->source_pending, s, memory_order_acq_rel));
+    if (!s) {
+        atomic_store_explicit(&c->source_evict, 1, memory_order_release);
+    }
+}
+
+void mp3codec_core_seek_source(t_mp3codec_core *c, long sample)
+{
+    atomic_store_explicit(&c->source_seek, MAX(sample, 0), memory_order_release);
+}
+
+void mp3codec_core_set_share(t_mp3codec_core *c, t_mp3codec_share *g)
+{
+    // As mp3codec_core_set_source: a group never picked up is simply left again
+    if (g) {
+        atomic_store_explicit(&c->share_evict, 0, memory_order_release);
+    }
+    mp3codec_share_leave(atomic_exchange_explicit(&c->share_pending, g, memory_order_acq_rel));
+    if (!g) {
+        atomic_store_explicit(&c->share_evict, 1, memory_order_release);
+    }
+}
+
+// Frame queues for the threaded pipeline, allocated the first time a worker starts
+int mp3codec_queues_alloc(t_mp3codec_core *c)
+{
+    if (mp3codec_queue_alloc(c, &c->input_queue) < 0 || mp3codec_queue_alloc(c, &c->output_queue) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Queues outlive the worker so a late audio callback never touches freed slots
+void mp3codec_queues_free(t_mp3codec_core *c)
+{
+    mp3codec_queue_free(&c->input_queue);
+    mp3codec_queue_free(&c->output_queue);
+}
+
+int mp3codec_tap_alloc(t_mp3codec_core *c)
+{
+    if (!c->tap_ring) {
+        c->tap_ring = (unsigned char *)mp3codec_alloc(c, TAP_RING_SIZE);
+    }
+    return c->tap_ring ? 0 : -1;
+}
+
+long mp3codec_tap_peek(t_mp3codec_core *c, const unsigned char **first, long *first_len,
+                       const unsigned char **second, long *second_len)
+{
+    unsigned int tail = atomic_load_explicit(&c->tap_tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&c->tap_head, memory_order_acquire);
+    unsigned int at = tail & (TAP_RING_SIZE - 1);
+    long waiting = (long)(head - tail);
+    
+    *first = c->tap_ring + at;
+    *first_len = MIN(waiting, (long)(TAP_RING_SIZE - at));
+    *second = c->tap_ring;
+    *second_len = waiting - *first_len;
+    return waiting;
+}
+
+void mp3codec_tap_release(t_mp3codec_core *c, long bytes)
+{
+    atomic_fetch_add_explicit(&c->tap_tail, (unsigned int)bytes, memory_order_release);
+}
+
+// Worker thread: owns the codec while the audio thread runs in threaded mode
+int mp3codec_core_worker_step(t_mp3codec_core *c)
+{
+    t_mp3codec_frame *in = NULL;
+    t_mp3codec_frame *out = NULL;
+    
+    // Any number of pool threads may offer to run this core; one at a time gets it
+    if (atomic_exchange_explicit(&c->worker_claim, 1, memory_order_acquire)) {
+        return 0;
+    }
+    
+    // Wait until the audio thread has actually handed over the codec
+    if (atomic_load_explicit(&c->pipeline_mode, memory_order_acquire)) {
+        in = mp3codec_queue_read_slot(&c->input_queue);
+        out = mp3codec_queue_write_slot(&c->output_queue);
+    }
+    if (!in || !out) {
+        atomic_store_explicit(&c->worker_claim, 0, memory_order_release);
+        return 0;
+    }
+    
+    uint64_t deadline = in->deadline_ns;
+    c->frame_quality = in->quality;
+    c->frame_deadline_ns = deadline;
+    int decoded_samples = mp3codec_frame_code(c, in->left, in->right, 1);
+    mp3codec_queue_release(&c->input_queue);
+    
+    // Slots hold PCM_BUFFER_SIZE samples, as much as a lane can, so mix straight into one
+    if (decoded_samples > 0) {
+        mp3codec_frame_mix(c, out->left, out->right, decoded_samples);
+        out->count = decoded_samples;
+        mp3codec_queue_commit(&c->output_queue);
+    }
+    
+    // Late frames are still delivered; the audio thread underran while it waited for them
+    uint64_t now = mp3codec_now_ns();
+    if (now > deadline) {
+        mp3codec_stat_add(&c->stats.deadline_misses, 1);
+        mp3codec_event_push(c, MP3CODEC_EVENT_LATE, (long)((now - deadline) / 1000));
+    }
+    atomic_store_explicit(&c->worker_claim, 0, memory_order_release);
+    return 1;
+}
+
+// Read without the claim, so the answer is only a scheduling hint
+uint64_t mp3codec_core_next_deadline(t_mp3codec_core *c)
+{
+    if (!atomic_load_explicit(&c->pipeline_mode, memory_order_acquire)) {
+        return UINT64_MAX;
+    }
+    t_mp3codec_frame *in = mp3codec_queue_read_slot(&c->input_queue);
+    return in ? in->deadline_ns : UINT64_MAX;
+}
+
+// Multichannel hosts run one core per channel pair, all driven by the first one's parameters
+void mp3codec_core_copy_params(t_mp3codec_core *dst, const t_mp3codec_core *src)
+{
+    dst->quality = src->quality;
+    dst->mode = src->mode;
+    dst->guard = src->guard;
+    dst->idle = src->idle;
+    dst->reservoir = src->reservoir;
+    dst->stagger = src->stagger;
+    dst->analysis = src->analysis;
+    dst->compact = src->compact;
+    dst->morph = src->morph;
+    dst->morph_pool = src->morph_pool;
+    dst->quality_signal = src->quality_signal;
+    dst->enable_lowpass = src->enable_lowpass;
+    dst->enable_highpass = src->enable_highpass;
+    dst->enable_ms_stereo = src->enable_ms_stereo;
+    dst->enable_ath_only = src->enable_ath_only;
+    dst->enable_experimental = src->enable_experimental;
+    dst->enable_emphasis = src->enable_emphasis;
+    dst->low_latency = src->low_latency;
+    dst->render = src->render;
+    dst->threaded = src->threaded;
+    dst->resample_quality = src->resample_quality;
+    mp3codec_core_set_host_rate(dst, src->host_rate);  // Sets sample_rate to match
+    dst->vector_size = src->vector_size;
+    mp3codec_core_follow(dst, src);
+}
+
+void mp3codec_core_follow(t_mp3codec_core *dst, const t_mp3codec_core *src)
+{
+    dst->input_gain = src->input_gain;
+    dst->output_gain = src->output_gain;
+    dst->bypass = src->bypass;
+    dst->pcm16 = src->pcm16;
+}
+
+// Main thread: take the oldest event the audio path queued. Returns 0 when there is none.
+int mp3codec_core_next_event(t_mp3codec_core *c, int *type, long *value, long *frame)
+{
+    t_mp3codec_event *ev = &c->event_ring[c->event_tail % EVENT_SLOTS];
+    if (atomic_load_explicit(&ev->sequence, memory_order_acquire) != c->event_tail + 1) {
+        return 0;
+    }
+    
+    *type = ev->type;
+    *value = ev->value;
+    *frame = ev->frame;
+    atomic_store_explicit(&ev->sequence, c->event_tail + EVENT_SLOTS, memory_order_release);
+    c->event_tail++;
+    return 1;
+}
+
+int mp3codec_core_next_frame_info(t_mp3codec_core *c, t_mp3codec_frame_info *info)
+{
+    unsigned int tail = atomic_load_explicit(&c->analysis_tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&c->analysis_head, memory_order_acquire);
+    
+    if (tail == head) {
+        // Re-arm the notification, then look once more for a record that came in meanwhile
+        atomic_store_explicit(&c->analysis_notified, 0, memory_order_seq_cst);
+        head = atomic_load_explicit(&c->analysis_head, memory_order_seq_cst);
+        if (tail == head) {
+            return 0;
+        }
+    }
+    *info = c->analysis_ring[tail % ANALYSIS_SLOTS];
+    atomic_store_explicit(&c->analysis_tail, tail + 1, memory_order_release);
+    return 1;
+}
+
+const char *mp3codec_event_name(int type)
+{
+    static const char *event_names[] = {
+        "Decode error", "Encode error", "Output underrun", "Worker behind, frame dropped",
+        "Worker missed frame deadline", "Invalid codec state", "Deadline guard took over",
+        "Recorder behind, MP3 frame dropped", "Source file ended"
+    };
+    return (type >= 0 && type <= MP3CODEC_EVENT_SOURCE_END) ? event_names[type] : "Unknown event";
+}
+
+static int mp3codec_compare_uint(const void *a, const void *b)
+{
+    unsigned int ua = *(const unsigned int *)a;
+    unsigned int ub = *(const unsigned int *)b;
+    return (ua > ub) - (ua < ub);
+}
+
+// Main thread: summarise one column of the timing window (last CPU_WINDOW frames).
+// Returns 0 if no frame has been timed yet.
+int mp3codec_core_cpu_summary(t_mp3codec_core *c, int stage, t_mp3codec_cpu_summary *out)
+{
+    unsigned int ns[CPU_WINDOW];
+    long count = MIN(atomic_load_explicit(&c->cpu.frames, memory_order_acquire), CPU_WINDOW);
+    double sum = 0.0;
+    
+    out->frames = count;
+    if (!count) {
+        return 0;
+    }
+    
+    for (long i = 0; i < count; i++) {
+        unsigned int encode = atomic_load_explicit(&c->cpu.encode_ns[i], memory_order_relaxed);
+        unsigned int decode = atomic_load_explicit(&c->cpu.decode_ns[i], memory_order_relaxed);
+        ns[i] = stage == MP3CODEC_CPU_ENCODE ? encode : stage == MP3CODEC_CPU_DECODE ? decode : encode + decode;
+        sum += ns[i];
+    }
+    qsort(ns, count, sizeof(unsigned int), mp3codec_compare_uint);
+    
+    out->min = ns[0] / 1000.0;
+    out->max = ns[count - 1] / 1000.0;
+    out->mean = sum / count / 1000.0;
+    out->p50 = ns[MIN(count - 1, (long)ceil(count * 0.50) - 1)] / 1000.0;
+    out->p90 = ns[MIN(count - 1, (long)ceil(count * 0.90) - 1)] / 1000.0;
+    out->p99 = ns[MIN(count - 1, (long)ceil(count * 0.99) - 1)] / 1000.0;
+    return 1;
+}
@@ -0,0 +1,507 @@
+#ifndef MP3CODEC_CORE_H
+#define MP3CODEC_CORE_H
+
+// Max-independent codec core: encoder/decoder states, morph lanes, the frame buffer and
+// the output ring. mp3codec~.c wraps it as an MSP object; bench/ drives it offline.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <lame/lame.h>
+#include "mp3codec_resample.h"
+#include "mp3codec_source.h"
+
+#define MP3_FRAME_SIZE 1152        // MPEG1 frame size in samples
+#define RENDER_BATCH_FRAMES 3      // Frames per codec call in render mode (a lane's decode buffer holds 4)
+#define MP3_BUFFER_SIZE (MP3_FRAME_SIZE * RENDER_BATCH_FRAMES * 5 / 4 + 7200)  // LAME's worst case for one batch
+#define PCM_BUFFER_SIZE (MP3_FRAME_SIZE * 4)  // PCM buffer with headroom
+#define PCM16_CHUNK 576            // Samples converted to 16 bit per LAME call with pcm16 (on the stack)
+#define FRAME_QUEUE_SLOTS 4        // Frames in flight per direction in threaded mode
+#define PIPELINE_DEADLINE_FRAMES 1 // Frame periods a worker has to return a frame in threaded mode
+#define STATE_PREROLL_FRAMES 2     // Input history replayed into a new encoder state before it takes over
+#define QUALITY_LEVELS 10          // Entries in QUALITY_BITRATES
+#define MORPH_LANES 2              // States that can run (and crossfade) at the same time
+#define RETIRE_SLOTS 32            // States waiting for the main thread to free them
+#define ARENA_ALIGN 64             // Cache line size for the per-instance buffer arena
+#define EVENT_SLOTS 64             // Telemetry events waiting for the main thread
+#define CPU_WINDOW 512             // Frames of codec timing kept for the cpu message (~12 s)
+#define OUTPUT_RING_SIZE (MP3_FRAME_SIZE * 8)  // Ring capacity; the default mode only uses 4 or 5 frames of it
+#define DELAY_PROBE_FRAMES 8       // Frames run through the throwaway pair that measures codec delay
+#define CODEC_MAX_RATE 48000       // Highest rate MPEG1 layer III codes; above it the host rate is resampled
+#define CONFIG_CACHE_SLOTS 16      // Spare states (and measured delays) kept process-wide, least recently built go first
+#define GUARD_HOLD_FRAMES 16       // Frames the guard state keeps running once it has taken over (~0.4 s)
+#define TAP_RING_SIZE (1 << 18)    // Bitstream bytes waiting for the recorder (~6.5 s at 320 kbps, power of two)
+#define SOURCE_RING_MODE 2         // ring_mode while @source plays: the ring is a plain FIFO of OUTPUT_RING_SIZE
+#define SILENCE_FRAMES 4           // Silent frames a lane codes before it idles (flushes the codec's delay line)
+#define SILENCE_PEAK (1.0f / 32768.0f)  // pcm16: frame peak below which the input converts to zeros
+#define ANALYSIS_SLOTS 128         // Frame analysis records waiting for the main thread (~3 s)
+#define STAGGER_SLOTS 8            // Frame phases @stagger spreads cores over (eighths of a frame)
+
+// Quality to bitrate mapping (0=best, 9=worst)
+extern const int QUALITY_BITRATES[QUALITY_LEVELS];
+
+// Bitrate modes (the mode attribute). ABR aims at the quality's bitrate, VBR codes quality q as -V q.
+enum {
+    MP3CODEC_MODE_CBR,
+    MP3CODEC_MODE_ABR,
+    MP3CODEC_MODE_VBR,
+    MP3CODEC_MODES
+};
+
+// Encoder/decoder pair, built on the main thread and handed to the codec owner
+typedef struct _mp3codec_state {
+    lame_global_flags *gfp;
+    hip_t hip;
+    long quality;          // Quality the pair was configured for
+    long generation;       // Config generation (toggles, sample rate) it was built from
+    int encoder_delay;
+    long memory_bytes;     // Heap used by LAME for this pair (0 if unknown)
+    long samples_fed;      // Input the encoder has taken, over every lane it ran on (codec owner only)
+    long samples_out;      // Output hip has returned for it, before any discard (codec owner only)
+    long samples_coded;    // Samples covered by the MP3 frames the encoder has emitted (codec owner only)
+    long stream_origin;    // Stream sample its input started at, as if it had never paused (codec owner only)
+} t_mp3codec_state;
+
+// One state running on the shared input stream, with its own bitstream and decoded output
+typedef struct _mp3codec_lane {
+    t_mp3codec_state *state;     // Borrowed from active/pool, NULL when idle
+    unsigned char *bitstream;    // Encoder output, handed to hip in place
+    short *decode_pcm_left;
+    short *decode_pcm_right;
+    int decode_pcm_fill;         // Decoded samples not yet mixed into the output
+    int bitstream_bytes;         // What the last encoder call put in bitstream
+    long discard_samples;        // Preroll output still to be dropped
+    long silent_frames;          // Silent frames coded in a row since the input or the state changed
+    short decode_backlog;        // hip stopped for want of room, so it may still hold decoded frames
+    double gain;                 // Mix weight reached at the end of the last frame
+    double target;               // Mix weight to reach by the end of the current frame
+} t_mp3codec_lane;
+
+// One stereo frame handed between the audio thread and the codec worker
+typedef struct _mp3codec_frame {
+    float left[PCM_BUFFER_SIZE];
+    float right[PCM_BUFFER_SIZE];
+    int count;             // Valid samples in left/right
+    uint64_t deadline_ns;  // mp3codec_now_ns() by which the audio thread needs it back
+    double quality;        // Quality inlet value sampled at the end of the frame
+} t_mp3codec_frame;
+
+// Lock-free single-producer/single-consumer frame queue
+typedef struct _mp3codec_queue {
+    t_mp3codec_frame *slots;     // FRAME_QUEUE_SLOTS entries
+    atomic_uint head;            // Written by the producer only
+    atomic_uint tail;            // Written by the consumer only
+} t_mp3codec_queue;
+
+// Audio-path events, reported on the main thread
+enum {
+    MP3CODEC_EVENT_DECODE_ERROR,      // value: hip_decode return code
+    MP3CODEC_EVENT_ENCODE_ERROR,      // value: lame_encode_buffer return code
+    MP3CODEC_EVENT_UNDERRUN,          // value: samples read past the decoded output
+    MP3CODEC_EVENT_DROPPED,           // value: frames the worker had no room for
+    MP3CODEC_EVENT_LATE,              // value: microseconds past the deadline
+    MP3CODEC_EVENT_INVALID_STATE,     // value: unused
+    MP3CODEC_EVENT_GUARD,             // value: microseconds the last full frame took
+    MP3CODEC_EVENT_TAP_DROPPED,       // value: bytes of the MP3 frame the tap ring had no room for
+    MP3CODEC_EVENT_SOURCE_END         // value: samples of the source file played
+};
+
+typedef struct _mp3codec_event {
+    atomic_uint sequence;        // Slot ownership, see mp3codec_event_push
+    int type;
+    long value;
+    long frame;                  // stats.frames_encoded when it happened
+} t_mp3codec_event;
+
+// Counters written from the audio thread and the codec worker, read by the stats message
+typedef struct _mp3codec_stats {
+    atomic_long frames_encoded;
+    atomic_long bytes_produced;
+    atomic_long decode_errors;
+    atomic_long underruns;
+    atomic_long encode_errors;
+    atomic_long frames_dropped;
+    atomic_long deadline_misses; // Frames a worker returned after their deadline
+    atomic_long events_lost;     // Events that found the event ring full
+    atomic_long guarded_frames;  // Frames the deadline guard coded on its cheap CBR state
+    atomic_long tap_frames;      // MP3 frames handed to the bitstream tap
+    atomic_long tap_dropped;     // MP3 frames the tap ring had no room for
+    atomic_long idle_frames;     // Frames the codec skipped as digital silence
+    atomic_long shared_frames;   // Frames copied from another core in the share group
+    atomic_long analysis_lost;   // Frame analysis records that found the ring full
+} t_mp3codec_stats;
+
+// One coded MP3 frame as heard, read from its header and side information (@analysis)
+typedef struct _mp3codec_frame_info {
+    long frame;            // Stream frame index
+    int bytes;             // Whole frame, header included
+    int kbps;
+    int ms_stereo;         // 1 = mid/side, 0 = left/right or mono
+    int reservoir;         // main_data_begin: bytes of this frame's audio data in earlier frames
+    int block_type[2][2];  // Per granule and channel: 0 long, 1 start, 2 short, 3 stop, -1 none
+} t_mp3codec_frame_info;
+
+// What a shared frame is filed under (@share, mp3codec_share.h)
+typedef struct _mp3codec_share_tag {
+    uint64_t key;          // Configuration, quality and batch size of the state that coded it
+    uint64_t hash;         // The frame's input and the STATE_PREROLL_FRAMES before it
+    long lag;              // Input coded minus output decoded before it, so the output lines up
+} t_mp3codec_share_tag;
+
+typedef struct _mp3codec_share t_mp3codec_share;
+
+// Per-frame codec cost, written by the codec owner and summarised by mp3codec_core_cpu_summary
+typedef struct _mp3codec_cpu {
+    atomic_uint encode_ns[CPU_WINDOW];   // LAME encode time of each recent frame, all lanes
+    atomic_uint decode_ns[CPU_WINDOW];   // hip decode time of each recent frame, all lanes
+    atomic_uint frames;                  // Frames recorded, free-running
+    uint64_t frame_encode_ns;            // Frame in progress (codec owner only)
+    uint64_t frame_decode_ns;
+} t_mp3codec_cpu;
+
+enum {
+    MP3CODEC_CPU_ENCODE,
+    MP3CODEC_CPU_DECODE,
+    MP3CODEC_CPU_TOTAL
+};
+
+// Summary of one column of the cpu window, in microseconds
+typedef struct _mp3codec_cpu_summary {
+    long frames;
+    double min;
+    double mean;
+    double p50;
+    double p90;
+    double p99;
+    double max;
+} t_mp3codec_cpu_summary;
+
+// What the core asks its host to do on the main thread (FRAME comes from the audio thread)
+enum {
+    MP3CODEC_NOTIFY_RETIRE,      // Call mp3codec_state_retire
+    MP3CODEC_NOTIFY_EVENT,       // Drain mp3codec_core_next_event
+    MP3CODEC_NOTIFY_LATENCY,     // total_latency_samples changed (main thread only)
+    MP3CODEC_NOTIFY_CACHE,       // Call mp3codec_cache_refill when idle (main thread only)
+    MP3CODEC_NOTIFY_ANALYSIS,    // Drain mp3codec_core_next_frame_info (once per drain)
+    MP3CODEC_NOTIFY_FRAME        // A frame is queued for the worker: wake it (audio thread, real-time safe)
+};
+
+typedef void (*t_mp3codec_notify)(void *owner, int what);
+typedef void (*t_mp3codec_log)(void *owner, int is_error, const char *message);
+
+typedef struct _mp3codec_core {
+    // LAME encoder/decoder - active is only touched by the codec owner (audio thread or worker)
+    t_mp3codec_state *active;
+    _Atomic(t_mp3codec_state *) pending_state;  // Main thread -> codec owner
+    
+    // States the codec owner has finished with, freed on the main thread
+    t_mp3codec_state *retire_ring[RETIRE_SLOTS];
+    atomic_uint retire_head;        // Codec owner only
+    atomic_uint retire_tail;        // Main thread only
+    
+    // Quality morphing - prebuilt states per quality, crossfaded two at a time
+    double morph;                   // -1 = off, 0.0-9.0 position between quality levels
+    long morph_pool;                // States kept warm around the morph position (2-10)
+    t_mp3codec_state *pool[QUALITY_LEVELS];                   // Codec owner only
+    _Atomic(t_mp3codec_state *) pool_pending[QUALITY_LEVELS]; // Main thread -> codec owner
+    atomic_uint pool_evict;         // Bitmask of pool entries the main thread has dropped
+    long pool_generation[QUALITY_LEVELS];  // Main thread's view of what it has published
+    long pool_memory[QUALITY_LEVELS];
+    long active_memory;             // Main thread: memory_bytes of the state last handed to the codec owner
+    long guard_memory;
+    long config_generation;         // Bumped whenever toggles or the sample rate change
+    
+    // Signal-rate quality - while connected it takes over from morph and keeps every level warm
+    long quality_signal;            // 1 while the host has a signal on the quality inlet
+    const double *quality_input;    // This callback's quality signal (host rate), set by the host
+    const double *quality_cursor;   // quality_input at the start of the block being coded
+    double quality_sampled;         // Value at the last frame boundary (audio thread only)
+    double frame_quality;           // Value for the frame being coded (codec owner only)
+    unsigned int cache_refill;      // Bitmask of qualities whose cached spare this core took
+    
+    // Deadline guard - in ABR/VBR a frame that would finish too late runs on a cheap CBR state
+    long guard;                     // 0/1
+    t_mp3codec_state *guard_state;  // Codec owner only
+    _Atomic(t_mp3codec_state *) guard_pending;  // Main thread -> codec owner
+    atomic_int guard_evict;         // Set when the main thread has dropped the guard state
+    long guard_built;               // Main thread: a guard state has been published
+    long guard_on;                  // The guard state is coding in place of the full one (codec owner only)
+    long guard_hold;                // Frames left before the full state is considered again (codec owner only)
+    uint64_t guard_cost_ns;         // What the last full frame took, kept while guarded (codec owner only)
+    uint64_t guard_fast_ns;         // What the last guarded frame took (codec owner only)
+    uint64_t guard_ref_ns;          // What the first guarded frame of this takeover took (codec owner only)
+    uint64_t frame_deadline_ns;     // When the frame being coded has to be done, 0 = no deadline
+    uint64_t callback_end_ns;       // End of the current callback's period while the guard is on (audio thread)
+    
+    // Parameters
+    long quality;          // 0-9 LAME quality scale
+    long mode;             // MP3CODEC_MODE_CBR/ABR/VBR
+    double input_gain;     // 0.0-4.0
+    double output_gain;    // 0.0-4.0
+    long bypass;           // 0/1
+    long pcm16;            // 0/1 - feed LAME 16-bit PCM instead of float
+    long low_latency;      // 0/1 - minimum safe ring depth and an exact, sample-aligned delay
+    long render;           // 0/1 - offline bounce: RENDER_BATCH_FRAMES frames per codec call (inline only)
+    long idle;             // 0/1 - skip encode/decode once the input has been digitally silent a while
+    long reservoir;        // 0/1 - let LAME use the bit reservoir (better transients, a frame more latency)
+    long stagger;          // 0/1 - run this core's frames at its own phase, not in step with every other core
+    long analysis;         // 0/1 - record every coded frame for mp3codec_core_next_frame_info
+    long compact;          // 0/1 - smallest arena (mp3codec_core_fit): ring fit to the latency
+    
+    // Individual aggressive compression toggles
+    long enable_lowpass;   // 0/1 - 4kHz low-pass filter
+    long enable_highpass;  // 0/1 - 100Hz high-pass filter
+    long enable_ms_stereo; // 0/1 - Force mid/side stereo
+    long enable_ath_only;  // 0/1 - ATH-only psychoacoustic model
+    long enable_experimental; // 0/1 - Experimental compression modes
+    long enable_emphasis;  // 0/1 - Pre-emphasis
+    
+    // Audio processing state
+    long sample_rate;      // Codec rate LAME runs at: host_rate / resampler.factor
+    long host_rate;
+    long resample_quality; // 0-2, resampler filter length when host_rate > CODEC_MAX_RATE
+    long channels;         // 2, or 1 for a mono core (multichannel hosts)
+    long initialized;
+    
+    // Buffers for encoding
+    float *encode_buffer_left;
+    float *encode_buffer_right;
+    int encode_buffer_fill;
+    
+    // Buffers for decoding - lane 0 carries the active state, lane 1 the morph partner
+    t_mp3codec_lane lanes[MORPH_LANES];
+    float *decode_out_left;     // Mixed output of the current frame
+    float *decode_out_right;
+    
+    // All of the buffers above and below live in one arena allocated by mp3codec_arena_alloc
+    char *arena_block;          // As returned by the allocator
+    char *arena;                // arena_block rounded up to ARENA_ALIGN
+    size_t arena_size;
+    int arena_lanes;            // Lanes with buffers: MORPH_LANES, or 1 where nothing can start a second (compact)
+    int arena_frames;           // Frames the encode buffer holds: RENDER_BATCH_FRAMES, or 1 compact without @render
+    
+    // Ring buffer for output smoothing
+    float *output_ring_left;
+    float *output_ring_right;
+    int ring_write_pos;
+    int ring_read_pos;
+    int ring_size;
+    int ring_capacity;              // Samples allocated per ring: OUTPUT_RING_SIZE, or what a compact core needs
+    long ring_fill;                 // Decoded samples the output has not read yet (audio thread only)
+    long ring_started;              // Set once the first decoded samples reach the ring
+    long ring_written;              // Decoded samples written since init, the ring's stream position
+    long ring_mode;                 // low_latency as the audio thread last applied it, SOURCE_RING_MODE while playing @source
+    long samples_in;                // Input samples fed to the codec since init (audio thread only)
+    long stagger_slot;              // Phase slot handed out at creation, 0 to STAGGER_SLOTS - 1
+    long stagger_applied;           // Silence put in front of the stream for the current phase (audio thread only)
+    
+    // Host rate <-> codec rate, with the codec-rate signal of the block in flight
+    t_mp3codec_resampler resampler;
+    double *codec_in_left;          // RESAMPLE_BLOCK / 2 samples each
+    double *codec_in_right;
+    double *codec_out_left;
+    double *codec_out_right;
+    
+    // Input history and stream position, used to splice in a new encoder state
+    float *history_left;    // STATE_PREROLL_FRAMES frames
+    float *history_right;
+    long frames_encoded;    // Frames fed to the codec since init
+    long samples_decoded;   // Decoded samples delivered since init
+    int stream_delay;       // Encoder delay the output timeline was started with
+    
+    // Latency tracking and compensation
+    int total_latency_samples;      // At the host rate; the parts above are at the codec rate
+    double total_latency_ms;
+    int lame_encoder_delay;
+    int lame_decoder_delay;
+    int buffer_latency_samples;
+    int decode_delay_compensation;
+    int pipeline_latency_samples;
+    int resample_latency_samples;   // Host samples the resampler filters add (0 when not resampling)
+    int codec_delay;                // Measured: input sample n comes out as decoded sample n + codec_delay
+    int codec_lag;                  // Measured: most input the codec holds back at a frame boundary
+    int output_delay;               // Low latency: output sample n plays decoded sample n - output_delay
+    
+    // Threaded pipeline - the worker owns the codec while pipeline_mode is 1
+    long threaded;                  // 0/1, host has asked for a worker
+    atomic_long pipeline_request;   // Set by main thread once the worker is up
+    atomic_long pipeline_mode;      // Mode the audio thread is running (audio thread only writes)
+    t_mp3codec_queue input_queue;   // Audio thread -> worker
+    t_mp3codec_queue output_queue;  // Worker -> audio thread
+    atomic_int worker_claim;        // Set while a worker thread is running this core
+    
+    // Refit while audio runs - the audio thread stays out of the arena while held is set
+    atomic_int held;                // Set by the main thread around mp3codec_core_fit
+    atomic_int in_callback;         // Set while the audio thread is inside mp3codec_core_process
+    
+    // Bitstream tap - the MP3 frames behind what the output plays, for a recorder or streamer.
+    // One stream, from the lane with the largest mix weight; each frame is placed by the stream
+    // position it codes, so lane switches neither repeat nor skip any.
+    unsigned char *tap_ring;        // TAP_RING_SIZE bytes, NULL until mp3codec_tap_alloc
+    atomic_int tap_enabled;         // Set by the host while a writer is draining the ring
+    atomic_uint tap_head;           // Written by the codec owner only
+    atomic_uint tap_tail;           // Written by the writer thread only
+    long tap_position;              // Stream sample the next tapped frame has to start at (codec owner only)
+    int tap_lane;                   // Lane being tapped this frame (codec owner only)
+    
+    // Frame analysis - what each frame of the tapped lane coded, parsed from the bitstream the
+    // codec already produced. SPSC like the tap; the host is notified once per drain.
+    t_mp3codec_frame_info analysis_ring[ANALYSIS_SLOTS];
+    atomic_uint analysis_head;      // Written by the codec owner only
+    atomic_uint analysis_tail;      // Written by the main thread only
+    atomic_int analysis_notified;   // Set by the first record after a drain
+    long analysis_position;         // Stream sample the next analysed frame has to start at (codec owner only)
+    
+    // Decode-only playback - a pre-encoded file replaces the codec on the output (@source).
+    // Published like the guard state, but the audio thread always owns it, threaded or not.
+    t_mp3codec_source *source;      // Audio thread only
+    _Atomic(t_mp3codec_source *) source_pending;   // Main thread -> audio thread
+    _Atomic(t_mp3codec_source *) source_retired;   // Audio thread -> main thread, freed by state_retire
+    atomic_int source_evict;        // Set when the main thread has dropped the source
+    atomic_long source_seek;        // Sample to continue the source from, -1 = none
+    long source_position;           // Source sample the next output sample plays (audio thread only)
+    long source_ended;              // Set once the end has been reported (audio thread only)
+    
+    // Output sharing - a frame another core in the group already coded is copied, not coded
+    // (@share). Published like the guard state; the group goes back through share_retired.
+    t_mp3codec_share *share;        // Codec owner only
+    _Atomic(t_mp3codec_share *) share_pending;     // Main thread -> codec owner
+    _Atomic(t_mp3codec_share *) share_retired;     // Codec owner -> main thread, left by state_retire
+    atomic_int share_evict;         // Set when the main thread has left the group
+    t_mp3codec_share_tag share_tag; // What the frame being coded is filed under (codec owner only)
+    short share_store;              // frame_mix files its output under share_tag
+    short share_hit;                // decode_out already holds the frame, copied from the group
+    
+    // Telemetry - nothing on the audio path logs directly
+    t_mp3codec_stats stats;
+    t_mp3codec_event event_ring[EVENT_SLOTS];
+    atomic_uint event_head;         // Producers (audio thread, worker) claim slots here
+    unsigned int event_tail;        // Main thread only
+    t_mp3codec_cpu cpu;
+    long vector_size;               // Host callback size, for the deadline share
+    long allocations;               // Blocks the core itself has allocated so far
+    
+    // Host hooks, all optional
+    void *owner;
+    t_mp3codec_notify notify;
+    t_mp3codec_log log;
+} t_mp3codec_core;
+
+// Once per process, before any core is used
+void mp3codec_core_setup(void);
+
+// Lifetime: core_new allocates the buffer arena and sets default parameters,
+// core_free releases everything (no other thread may be using the core)
+int mp3codec_core_new(t_mp3codec_core *c, void *owner, t_mp3codec_notify notify, t_mp3codec_log log);
+void mp3codec_core_free(t_mp3codec_core *c);
+
+// Main thread
+int mp3codec_init_processor(t_mp3codec_core *c);
+void mp3codec_cleanup_processor(t_mp3codec_core *c);
+int mp3codec_arena_alloc(t_mp3codec_core *c);
+void mp3codec_arena_free(t_mp3codec_core *c);
+t_mp3codec_state *mp3codec_state_new(t_mp3codec_core *c, long quality, short verbose);
+void mp3codec_state_free(t_mp3codec_state *st);
+
+// Process-wide cache of spare states keyed by (quality, mode, toggles, channels, sample rate).
+// Main thread only. acquire takes a spare when there is one and builds the state otherwise;
+// with refill set it asks the host (MP3CODEC_NOTIFY_CACHE) to build a replacement later.
+t_mp3codec_state *mp3codec_state_acquire(t_mp3codec_core *c, long quality, short verbose, int refill);
+void mp3codec_cache_refill(t_mp3codec_core *c);
+void mp3codec_cache_clear(void);
+void mp3codec_cache_summary(long *spares, long *bytes, long *hits, long *misses);
+int mp3codec_state_request(t_mp3codec_core *c);
+void mp3codec_state_publish(t_mp3codec_core *c, t_mp3codec_state *st);
+void mp3codec_state_retire(t_mp3codec_core *c);
+void mp3codec_config_changed(t_mp3codec_core *c);
+void mp3codec_pool_update(t_mp3codec_core *c);
+void mp3codec_guard_update(t_mp3codec_core *c);
+const char *mp3codec_mode_name(long mode);
+void mp3codec_update_latency(t_mp3codec_core *c);
+int mp3codec_core_set_host_rate(t_mp3codec_core *c, long host_rate);
+void mp3codec_measure_delay(t_mp3codec_core *c);
+int mp3codec_queues_alloc(t_mp3codec_core *c);
+void mp3codec_queues_free(t_mp3codec_core *c);
+
+// Bitstream tap. alloc (main thread, once; kept until core_free) must come before tap_enabled
+// is set. The writer thread takes what is waiting as at most two spans straight from the ring,
+// writes them and releases the bytes; nothing is copied on either side.
+int mp3codec_tap_alloc(t_mp3codec_core *c);
+long mp3codec_tap_peek(t_mp3codec_core *c, const unsigned char **first, long *first_len,
+                       const unsigned char **second, long *second_len);
+void mp3codec_tap_release(t_mp3codec_core *c, long bytes);
+
+// Decode-only playback. Main thread: set hands the core an opened source (NULL = back to the
+// codec; the source is freed by mp3codec_state_retire once the audio thread lets it go) and
+// seek moves it, in samples at the file's rate.
+void mp3codec_core_set_source(t_mp3codec_core *c, t_mp3codec_source *s);
+void mp3codec_core_seek_source(t_mp3codec_core *c, long sample);
+
+// Output sharing. Main thread: hand the core a reference from mp3codec_share_join (NULL =
+// leave); the core drops it through mp3codec_state_retire once the codec owner lets go.
+void mp3codec_core_set_share(t_mp3codec_core *c, t_mp3codec_share *g);
+int mp3codec_core_next_event(t_mp3codec_core *c, int *type, long *value, long *frame);
+
+// Main thread: the oldest frame analysis record. Returns 0 once the ring is empty, which also
+// re-arms MP3CODEC_NOTIFY_ANALYSIS.
+int mp3codec_core_next_frame_info(t_mp3codec_core *c, t_mp3codec_frame_info *info);
+const char *mp3codec_event_name(int type);
+int mp3codec_core_cpu_summary(t_mp3codec_core *c, int stage, t_mp3codec_cpu_summary *out);
+
+// Audio thread: one callback's worth of stereo audio in, the same amount out
+void mp3codec_core_process(t_mp3codec_core *c, const double *in_left, const double *in_right,
+                           double *out_left, double *out_right, long sampleframes);
+
+// Codec owner
+int mp3codec_encode_decode_frame(t_mp3codec_core *c, const float *left, const float *right);
+void mp3codec_ring_write(t_mp3codec_core *c, const float *left, const float *right, int count);
+void mp3codec_ring_advance(t_mp3codec_core *c, int count);
+
+// Worker thread: run one queued frame if there is one. Returns 1 if it did any work.
+// Safe to call from several threads at once; a core another thread is running is skipped.
+int mp3codec_core_worker_step(t_mp3codec_core *c);
+
+// Worker thread: deadline of the oldest frame waiting for this core, UINT64_MAX if none.
+// Schedulers serving several cores run the earliest one first.
+uint64_t mp3codec_core_next_deadline(t_mp3codec_core *c);
+
+// Multichannel hosts run one core per channel pair, all driven by the first one's parameters.
+// copy_params copies every parameter except channels (main thread, before a rebuild);
+// follow copies the ones the audio path reads without a rebuild (audio thread, per callback).
+void mp3codec_core_copy_params(t_mp3codec_core *dst, const t_mp3codec_core *src);
+void mp3codec_core_follow(t_mp3codec_core *dst, const t_mp3codec_core *src);
+
+// Bytes currently allocated from the process heap (0 where the platform can't tell)
+size_t mp3codec_heap_in_use(void);
+
+// Main thread, no other thread in the core (held or DSP off, and off the scheduler): lay the
+// arena out again for compact, the current latency and the lanes and render batch the
+// settings can use. Everything but the ring and any dropped lane carries over; the ring
+// restarts from silence. Returns -1, keeping the old arena, when out of memory.
+int mp3codec_core_fit(t_mp3codec_core *c);
+
+// Main thread: 1 when mp3codec_core_fit would lay the arena out differently
+int mp3codec_core_fit_due(const t_mp3codec_core *c);
+
+// Main thread: while held, the audio thread outputs silence without touching the arena.
+// Holding doesn't wait; mp3codec_core_busy is 1 until a callback already inside has left.
+void mp3codec_core_hold(t_mp3codec_core *c, int hold);
+int mp3codec_core_busy(t_mp3codec_core *c);
+
+// What one core holds, in bytes (main thread)
+typedef struct _mp3codec_memory {
+    long core;             // The core structure itself (event and analysis rings, timing window)
+    long arena;            // Audio buffers
+    long queues;           // Threaded pipeline frames, once the worker has been started
+    long tap;              // Bitstream tap ring, once recording or streaming has been used
+    long states;           // LAME and hip for the active, warm pool and guard states (0 if unknown)
+    long ring;             // Samples per ring channel, and what the current latency needs
+    long ring_needed;
+} t_mp3codec_memory;
+
+void mp3codec_core_memory(const t_mp3codec_core *c, t_mp3codec_memory *out);
+
+// Monotonic high-resolution clock in nanoseconds
+uint64_t mp3codec_now_ns(void);
+
+#endif
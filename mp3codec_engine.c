@@ -0,0 +1,266 @@
+#include "mp3codec_engine.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef CLAMP
+#define CLAMP(a, lo, hi) ((a) < (lo) ? (lo) : ((a) > (hi) ? (hi) : (a)))
+#endif
+
+struct _mp3codec_engine {
+    t_mp3codec_core core;  // Large (timing window, event ring), hence the engine lives on the heap
+    long block;
+    double *scratch;       // Right output of a mono stream, block samples
+};
+
+// The core's process-wide parts (the config and delay caches, the stagger clock, kernel
+// selection) belong to the Max main thread in the external; here this lock stands in for it
+#ifdef _WIN32
+static SRWLOCK mp3codec_engine_mutex = SRWLOCK_INIT;
+#define ENGINE_LOCK() AcquireSRWLockExclusive(&mp3codec_engine_mutex)
+#define ENGINE_UNLOCK() ReleaseSRWLockExclusive(&mp3codec_engine_mutex)
+#else
+static pthread_mutex_t mp3codec_engine_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define ENGINE_LOCK() pthread_mutex_lock(&mp3codec_engine_mutex)
+#define ENGINE_UNLOCK() pthread_mutex_unlock(&mp3codec_engine_mutex)
+#endif
+
+static int mp3codec_engine_ready;  // mp3codec_core_setup has run (under the lock)
+
+void mp3codec_engine_config_init(t_mp3codec_engine_config *config)
+{
+    memset(config, 0, sizeof(*config));
+    config->sample_rate = 44100;
+    config->channels = 2;
+    config->quality = 5;
+    config->mode = MP3CODEC_MODE_CBR;
+    config->toggles = MP3CODEC_TOGGLES_ALL;
+    config->input_gain = 1.0;
+    config->output_gain = 1.0;
+    config->resample_quality = 1;
+    config->render = 1;
+    config->block = ENGINE_DEFAULT_BLOCK;
+}
+
+t_mp3codec_engine *mp3codec_engine_new(const t_mp3codec_engine_config *config)
+{
+    t_mp3codec_engine *e = (t_mp3codec_engine *)calloc(1, sizeof(t_mp3codec_engine));
+    if (!e) return NULL;
+    
+    e->block = config->block > 0 ? config->block : ENGINE_DEFAULT_BLOCK;
+    e->scratch = (double *)calloc(e->block, sizeof(double));
+    
+    ENGINE_LOCK();
+    if (!mp3codec_engine_ready) {
+        mp3codec_core_setup();
+        mp3codec_engine_ready = 1;
+    }
+    
+    t_mp3codec_core *c = &e->core;
+    int failed = !e->scratch || mp3codec_core_new(c, NULL, NULL, NULL) < 0;
+    if (!failed) {
+        // The ring the external uses for exact PDC, so the latency is the true delay
+        c->channels = config->channels == 1 ? 1 : 2;
+        c->quality = CLAMP(config->quality, 0, QUALITY_LEVELS - 1);
+        c->mode = CLAMP(config->mode, 0, MP3CODEC_MODES - 1);
+        c->input_gain = CLAMP(config->input_gain, 0.0, 4.0);
+        c->output_gain = CLAMP(config->output_gain, 0.0, 4.0);
+        c->pcm16 = config->pcm16 != 0;
+        c->reservoir = config->reservoir != 0;
+        c->resample_quality = CLAMP(config->resample_quality, 0, RESAMPLE_QUALITIES - 1);
+        c->low_latency = 1;
+        c->render = config->render != 0;
+        c->enable_lowpass = (config->toggles & MP3CODEC_TOGGLE_LOWPASS) != 0;
+        c->enable_highpass = (config->toggles & MP3CODEC_TOGGLE_HIGHPASS) != 0;
+        c->enable_ms_stereo = (config->toggles & MP3CODEC_TOGGLE_MS_STEREO) != 0;
+        c->enable_ath_only = (config->toggles & MP3CODEC_TOGGLE_ATH_ONLY) != 0;
+        c->enable_experimental = (config->toggles & MP3CODEC_TOGGLE_EXPERIMENTAL) != 0;
+        c->enable_emphasis = (config->toggles & MP3CODEC_TOGGLE_EMPHASIS) != 0;
+        mp3codec_core_set_host_rate(c, config->sample_rate > 0 ? config->sample_rate : 44100);
+        c->vector_size = e->block;
+        c->compact = config->compact != 0;
+        failed = mp3codec_init_processor(c) < 0 || mp3codec_core_fit(c) < 0;
+        if (failed) mp3codec_core_free(c);
+    }
+    ENGINE_UNLOCK();
+    
+    if (failed) {
+        free(e->scratch);
+        free(e);
+        return NULL;
+    }
+    return e;
+}
+
+void mp3codec_engine_free(t_mp3codec_engine *e)
+{
+    if (!e) return;
+    ENGINE_LOCK();
+    mp3codec_state_retire(&e->core);
+    mp3codec_core_free(&e->core);
+    ENGINE_UNLOCK();
+    free(e->scratch);
+    free(e);
+}
+
+void mp3codec_engine_process(t_mp3codec_engine *e, const double *in_left, const double *in_right,
+                             double *out_left, double *out_right, long nframes)
+{
+    int mono = e->core.channels == 1;
+    
+    for (long pos = 0; pos < nframes; pos += e->block) {
+        long n = MIN(e->block, nframes - pos);
+        mp3codec_core_process(&e->core, in_left + pos, mono ? in_left + pos : in_right + pos,
+                              out_left + pos, mono ? e->scratch : out_right + pos, n);
+    }
+    
+    // No host to drain the core's queues, so do its main-thread share here. Retiring only frees
+    // what this core swapped out (an engine never joins a share group), so it takes no lock.
+    // The events only matter to a host; dropping them keeps the ring from filling.
+    int type;
+    long value, frame;
+    mp3codec_state_retire(&e->core);
+    while (mp3codec_core_next_event(&e->core, &type, &value, &frame)) {
+    }
+}
+
+long mp3codec_engine_latency(const t_mp3codec_engine *e)
+{
+    return e->core.total_latency_samples;
+}
+
+// One job start to finish: the input, then latency samples of silence to flush the codec,
+// with the first latency samples of output dropped
+static int mp3codec_engine_run(t_mp3codec_engine_job *job)
+{
+    t_mp3codec_engine *e = mp3codec_engine_new(&job->config);
+    if (!e) return -1;
+    
+    int mono = e->core.channels == 1;
+    long block = e->block;
+    long latency = mp3codec_engine_latency(e);
+    double *buffer = (double *)calloc(4 * block, sizeof(double));  // Silence in, then output left/right
+    if (!buffer) {
+        mp3codec_engine_free(e);
+        return -1;
+    }
+    double *silence = buffer, *out_left = buffer + 2 * block, *out_right = buffer + 3 * block;
+    
+    for (long pos = 0; pos < job->length + latency; pos += block) {
+        long n = MIN(block, job->length + latency - pos);
+        long live = CLAMP(job->length - pos, 0, n);  // Input samples left in this block
+        const double *in_left = silence, *in_right = silence;
+        
+        if (live == n) {
+            in_left = job->in_left + pos;
+            in_right = mono ? in_left : job->in_right + pos;
+        } else if (live > 0) {
+            memcpy(silence, job->in_left + pos, live * sizeof(double));
+            memcpy(silence + block, mono ? job->in_left + pos : job->in_right + pos, live * sizeof(double));
+            in_right = silence + block;
+        }
+        mp3codec_engine_process(e, in_left, in_right, out_left, out_right, n);
+        if (live > 0 && live < n) {
+            memset(silence, 0, 2 * block * sizeof(double));
+        }
+        
+        // Output sample pos + i is input sample pos + i - latency
+        long skip = CLAMP(latency - pos, 0, n);
+        long to = pos + skip - latency;
+        memcpy(job->out_left + to, out_left + skip, (n - skip) * sizeof(double));
+        if (!mono && job->out_right) {
+            memcpy(job->out_right + to, out_right + skip, (n - skip) * sizeof(double));
+        }
+    }
+    
+    free(buffer);
+    mp3codec_engine_free(e);
+    return 0;
+}
+
+typedef struct _mp3codec_engine_batch_state {
+    t_mp3codec_engine_job *jobs;
+    long count;
+    atomic_long next;      // Next job to hand out
+    atomic_long failed;
+} t_mp3codec_engine_batch_state;
+
+// Batch thread: take jobs until none are left
+#ifdef _WIN32
+static DWORD WINAPI mp3codec_engine_worker(LPVOID arg)
+#else
+static void *mp3codec_engine_worker(void *arg)
+#endif
+{
+    t_mp3codec_engine_batch_state *b = (t_mp3codec_engine_batch_state *)arg;
+    long i;
+    
+    while ((i = atomic_fetch_add_explicit(&b->next, 1, memory_order_relaxed)) < b->count) {
+        b->jobs[i].result = mp3codec_engine_run(&b->jobs[i]);
+        if (b->jobs[i].result < 0) {
+            atomic_fetch_add_explicit(&b->failed, 1, memory_order_relaxed);
+        }
+    }
+    return 0;
+}
+
+static long mp3codec_engine_cpu_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (long)info.dwNumberOfProcessors;
+#else
+    return sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+}
+
+long mp3codec_engine_batch(t_mp3codec_engine_job *jobs, long count, long threads)
+{
+    t_mp3codec_engine_batch_state b;
+#ifdef _WIN32
+    HANDLE handles[ENGINE_MAX_THREADS];
+#else
+    pthread_t handles[ENGINE_MAX_THREADS];
+#endif
+    long started = 0;
+    
+    b.jobs = jobs;
+    b.count = count;
+    atomic_init(&b.next, 0);
+    atomic_init(&b.failed, 0);
+    
+    if (threads <= 0) threads = mp3codec_engine_cpu_count();
+    threads = CLAMP(MIN(threads, count), 1, ENGINE_MAX_THREADS);
+    
+    // The calling thread works too, so a batch that can't start any thread still finishes
+    for (long t = 1; t < threads; t++) {
+#ifdef _WIN32
+        handles[started] = CreateThread(NULL, 0, mp3codec_engine_worker, &b, 0, NULL);
+        if (!handles[started]) break;
+#else
+        if (pthread_create(&handles[started], NULL, mp3codec_engine_worker, &b) != 0) break;
+#endif
+        started++;
+    }
+    mp3codec_engine_worker(&b);
+    
+    for (long t = 0; t < started; t++) {
+#ifdef _WIN32
+        WaitForSingleObject(handles[t], INFINITE);
+        CloseHandle(handles[t]);
+#else
+        pthread_join(handles[t], NULL);
+#endif
+    }
+    return atomic_load(&b.failed);
+}
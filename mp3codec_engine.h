@@ -0,0 +1,71 @@
+#ifndef MP3CODEC_ENGINE_H
+#define MP3CODEC_ENGINE_H
+
+// The mp3codec~ sound without Max: one engine codes one stream through the same core the
+// external runs, at the same defaults, and mp3codec_engine_batch codes many independent
+// streams at once over a pool of threads. Everything here can be called from any thread;
+// one engine must only be used by one thread at a time.
+
+#include "mp3codec_core.h"
+
+#define ENGINE_DEFAULT_BLOCK 4096  // Samples per core call unless the config says otherwise
+#define ENGINE_MAX_THREADS 64      // Most threads mp3codec_engine_batch starts
+
+// Compression toggles, in the bit order of the benchmark's -m mask
+#define MP3CODEC_TOGGLE_LOWPASS 1
+#define MP3CODEC_TOGGLE_HIGHPASS 2
+#define MP3CODEC_TOGGLE_MS_STEREO 4
+#define MP3CODEC_TOGGLE_ATH_ONLY 8
+#define MP3CODEC_TOGGLE_EXPERIMENTAL 16
+#define MP3CODEC_TOGGLE_EMPHASIS 32
+#define MP3CODEC_TOGGLES_ALL 63
+
+typedef struct _mp3codec_engine_config {
+    long sample_rate;      // Of the signal; above 48 kHz it is resampled as in Max
+    long channels;         // 1 (in_right and out_right unused) or 2
+    long quality;          // 0-9
+    long mode;             // MP3CODEC_MODE_CBR/ABR/VBR
+    long toggles;          // MP3CODEC_TOGGLE_* bits
+    double input_gain;     // 0.0-4.0
+    double output_gain;    // 0.0-4.0
+    long pcm16;            // As the attributes of the same names
+    long reservoir;
+    long resample_quality;
+    long render;           // 1 = several frames per LAME call (same output, faster)
+    long compact;          // 1 = smallest buffers (@compact), for many engines at once
+    long block;            // Samples per core call, the host vector size it stands in for
+} t_mp3codec_engine_config;
+
+typedef struct _mp3codec_engine t_mp3codec_engine;
+
+// The external's defaults: quality 5 CBR, every toggle on, unity gain, 44.1 kHz stereo,
+// rendered in ENGINE_DEFAULT_BLOCK blocks
+void mp3codec_engine_config_init(t_mp3codec_engine_config *config);
+
+// NULL when the configuration can't be coded (LAME rejected it, out of memory)
+t_mp3codec_engine *mp3codec_engine_new(const t_mp3codec_engine_config *config);
+void mp3codec_engine_free(t_mp3codec_engine *e);
+
+// Code nframes of any length. The output runs mp3codec_engine_latency samples behind the
+// input, exactly (it is the external's low latency ring).
+void mp3codec_engine_process(t_mp3codec_engine *e, const double *in_left, const double *in_right,
+                             double *out_left, double *out_right, long nframes);
+long mp3codec_engine_latency(const t_mp3codec_engine *e);
+
+// One stream for mp3codec_engine_batch: length samples in, length samples out, with the
+// latency taken out so out[i] is the coded in[i]
+typedef struct _mp3codec_engine_job {
+    t_mp3codec_engine_config config;
+    const double *in_left;
+    const double *in_right;
+    double *out_left;
+    double *out_right;
+    long length;
+    int result;            // Set by the batch: 0, or -1 if the job couldn't be coded
+} t_mp3codec_engine_job;
+
+// Code every job, each as its own stream, over threads threads (0 = one per CPU). Returns
+// once all are done, with the number that failed.
+long mp3codec_engine_batch(t_mp3codec_engine_job *jobs, long count, long threads);
+
+#endif
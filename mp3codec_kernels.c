@@ -0,0 +1,407 @@
+#include "mp3codec_kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MP3CODEC_KERNELS_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define MP3CODEC_KERNELS_NEON 1
+#endif
+
+// Scalar reference versions; the SIMD ones below fall back to these for the tail
+
+static void gain_to_float_scalar(float *dst, const double *src, double gain, long n)
+{
+    for (long i = 0; i < n; i++) {
+        dst[i] = (float)(src[i] * gain);
+    }
+}
+
+static void gain_to_double_scalar(double *dst, const float *src, double gain, long n)
+{
+    for (long i = 0; i < n; i++) {
+        dst[i] = (double)src[i] * gain;
+    }
+}
+
+static void gain2_scalar(double *dst, const double *src, double gain_a, double gain_b, long n)
+{
+    for (long i = 0; i < n; i++) {
+        dst[i] = src[i] * gain_a * gain_b;
+    }
+}
+
+static void float_to_s16_scalar(short *dst, const float *src, long n)
+{
+    for (long i = 0; i < n; i++) {
+        float value = src[i] * 32767.0f;
+        // Clamp before truncating so out-of-range input can't overflow the int conversion
+        if (value > 32767.0f) value = 32767.0f;
+        if (value < -32768.0f) value = -32768.0f;
+        dst[i] = (short)(int)value;
+    }
+}
+
+static float dot_scalar(const float *a, const float *b, long n)
+{
+    float sum = 0.0f;
+    for (long i = 0; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+static float peak_scalar(const float *src, long n)
+{
+    float peak = 0.0f;
+    for (long i = 0; i < n; i++) {
+        float value = src[i] < 0.0f ? -src[i] : src[i];
+        if (value > peak) peak = value;
+    }
+    return peak;
+}
+
+static const t_mp3codec_kernels kernels_scalar = {
+    "scalar",
+    gain_to_float_scalar,
+    gain_to_double_scalar,
+    gain2_scalar,
+    float_to_s16_scalar,
+    dot_scalar,
+    peak_scalar
+};
+
+#ifdef MP3CODEC_KERNELS_X86
+
+// SSE2 is part of the x86_64 baseline, so these need no runtime check there
+
+__attribute__((target("sse2")))
+static void gain_to_float_sse2(float *dst, const double *src, double gain, long n)
+{
+    __m128d g = _mm_set1_pd(gain);
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 lo = _mm_cvtpd_ps(_mm_mul_pd(_mm_loadu_pd(src + i), g));
+        __m128 hi = _mm_cvtpd_ps(_mm_mul_pd(_mm_loadu_pd(src + i + 2), g));
+        _mm_storeu_ps(dst + i, _mm_movelh_ps(lo, hi));
+    }
+    gain_to_float_scalar(dst + i, src + i, gain, n - i);
+}
+
+__attribute__((target("sse2")))
+static void gain_to_double_sse2(double *dst, const float *src, double gain, long n)
+{
+    __m128d g = _mm_set1_pd(gain);
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 v = _mm_loadu_ps(src + i);
+        _mm_storeu_pd(dst + i, _mm_mul_pd(_mm_cvtps_pd(v), g));
+        _mm_storeu_pd(dst + i + 2, _mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(v, v)), g));
+    }
+    gain_to_double_scalar(dst + i, src + i, gain, n - i);
+}
+
+__attribute__((target("sse2")))
+static void gain2_sse2(double *dst, const double *src, double gain_a, double gain_b, long n)
+{
+    __m128d a = _mm_set1_pd(gain_a);
+    __m128d b = _mm_set1_pd(gain_b);
+    long i = 0;
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(dst + i, _mm_mul_pd(_mm_mul_pd(_mm_loadu_pd(src + i), a), b));
+    }
+    gain2_scalar(dst + i, src + i, gain_a, gain_b, n - i);
+}
+
+__attribute__((target("sse2")))
+static void float_to_s16_sse2(short *dst, const float *src, long n)
+{
+    __m128 scale = _mm_set1_ps(32767.0f);
+    __m128 hi_limit = _mm_set1_ps(32767.0f);
+    __m128 lo_limit = _mm_set1_ps(-32768.0f);
+    long i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128 a = _mm_mul_ps(_mm_loadu_ps(src + i), scale);
+        __m128 b = _mm_mul_ps(_mm_loadu_ps(src + i + 4), scale);
+        a = _mm_max_ps(_mm_min_ps(a, hi_limit), lo_limit);
+        b = _mm_max_ps(_mm_min_ps(b, hi_limit), lo_limit);
+        __m128i packed = _mm_packs_epi32(_mm_cvttps_epi32(a), _mm_cvttps_epi32(b));
+        _mm_storeu_si128((__m128i *)(dst + i), packed);
+    }
+    float_to_s16_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static float dot_sse2(const float *a, const float *b, long n)
+{
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    long i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    __m128 acc = _mm_add_ps(acc0, acc1);
+    acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+    acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+    return _mm_cvtss_f32(acc) + dot_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static float peak_sse2(const float *src, long n)
+{
+    __m128 magnitude = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    long i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm_max_ps(acc0, _mm_and_ps(_mm_loadu_ps(src + i), magnitude));
+        acc1 = _mm_max_ps(acc1, _mm_and_ps(_mm_loadu_ps(src + i + 4), magnitude));
+    }
+    __m128 acc = _mm_max_ps(acc0, acc1);
+    acc = _mm_max_ps(acc, _mm_movehl_ps(acc, acc));
+    acc = _mm_max_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+    float peak = _mm_cvtss_f32(acc);
+    float tail = peak_scalar(src + i, n - i);
+    return tail > peak ? tail : peak;
+}
+
+static const t_mp3codec_kernels kernels_sse2 = {
+    "sse2",
+    gain_to_float_sse2,
+    gain_to_double_sse2,
+    gain2_sse2,
+    float_to_s16_sse2,
+    dot_sse2,
+    peak_sse2
+};
+
+// AVX2 is only used when the CPU reports it (x86_64 slices also run on pre-Haswell Macs)
+
+__attribute__((target("avx2")))
+static void gain_to_float_avx2(float *dst, const double *src, double gain, long n)
+{
+    __m256d g = _mm256_set1_pd(gain);
+    long i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128 lo = _mm256_cvtpd_ps(_mm256_mul_pd(_mm256_loadu_pd(src + i), g));
+        __m128 hi = _mm256_cvtpd_ps(_mm256_mul_pd(_mm256_loadu_pd(src + i + 4), g));
+        _mm256_storeu_ps(dst + i, _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1));
+    }
+    gain_to_float_sse2(dst + i, src + i, gain, n - i);
+}
+
+__attribute__((target("avx2")))
+static void gain_to_double_avx2(double *dst, const float *src, double gain, long n)
+{
+    __m256d g = _mm256_set1_pd(gain);
+    long i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_loadu_ps(src + i);
+        _mm256_storeu_pd(dst + i, _mm256_mul_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(v)), g));
+        _mm256_storeu_pd(dst + i + 4, _mm256_mul_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)), g));
+    }
+    gain_to_double_sse2(dst + i, src + i, gain, n - i);
+}
+
+__attribute__((target("avx2")))
+static void gain2_avx2(double *dst, const double *src, double gain_a, double gain_b, long n)
+{
+    __m256d a = _mm256_set1_pd(gain_a);
+    __m256d b = _mm256_set1_pd(gain_b);
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(dst + i, _mm256_mul_pd(_mm256_mul_pd(_mm256_loadu_pd(src + i), a), b));
+    }
+    gain2_scalar(dst + i, src + i, gain_a, gain_b, n - i);
+}
+
+__attribute__((target("avx2")))
+static void float_to_s16_avx2(short *dst, const float *src, long n)
+{
+    __m256 scale = _mm256_set1_ps(32767.0f);
+    __m256 hi_limit = _mm256_set1_ps(32767.0f);
+    __m256 lo_limit = _mm256_set1_ps(-32768.0f);
+    long i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 a = _mm256_mul_ps(_mm256_loadu_ps(src + i), scale);
+        __m256 b = _mm256_mul_ps(_mm256_loadu_ps(src + i + 8), scale);
+        a = _mm256_max_ps(_mm256_min_ps(a, hi_limit), lo_limit);
+        b = _mm256_max_ps(_mm256_min_ps(b, hi_limit), lo_limit);
+        // packs works per 128-bit lane, so restore sample order afterwards
+        __m256i packed = _mm256_packs_epi32(_mm256_cvttps_epi32(a), _mm256_cvttps_epi32(b));
+        packed = _mm256_permute4x64_epi64(packed, 0xD8);
+        _mm256_storeu_si256((__m256i *)(dst + i), packed);
+    }
+    float_to_s16_sse2(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static float dot_avx2(const float *a, const float *b, long n)
+{
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    long i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+        acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8)));
+    }
+    __m256 acc = _mm256_add_ps(acc0, acc1);
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+    half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+    
+    // The tail stays in this function: dot runs per output sample, and handing over to
+    // non-VEX code with the upper halves dirty costs more than the whole sum
+    float sum = _mm_cvtss_f32(half);
+    for (; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+__attribute__((target("avx2")))
+static float peak_avx2(const float *src, long n)
+{
+    __m256 magnitude = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    long i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_max_ps(acc0, _mm256_and_ps(_mm256_loadu_ps(src + i), magnitude));
+        acc1 = _mm256_max_ps(acc1, _mm256_and_ps(_mm256_loadu_ps(src + i + 8), magnitude));
+    }
+    __m256 acc = _mm256_max_ps(acc0, acc1);
+    __m128 half = _mm_max_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    half = _mm_max_ps(half, _mm_movehl_ps(half, half));
+    half = _mm_max_ss(half, _mm_shuffle_ps(half, half, 1));
+    
+    // Tail in this function, as in dot_avx2
+    float peak = _mm_cvtss_f32(half);
+    for (; i < n; i++) {
+        float value = src[i] < 0.0f ? -src[i] : src[i];
+        if (value > peak) peak = value;
+    }
+    return peak;
+}
+
+static const t_mp3codec_kernels kernels_avx2 = {
+    "avx2",
+    gain_to_float_avx2,
+    gain_to_double_avx2,
+    gain2_avx2,
+    float_to_s16_avx2,
+    dot_avx2,
+    peak_avx2
+};
+
+#endif // MP3CODEC_KERNELS_X86
+
+#ifdef MP3CODEC_KERNELS_NEON
+
+// NEON (with double precision lanes) is always present on arm64
+
+static void gain_to_float_neon(float *dst, const double *src, double gain, long n)
+{
+    float64x2_t g = vdupq_n_f64(gain);
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        float32x2_t lo = vcvt_f32_f64(vmulq_f64(vld1q_f64(src + i), g));
+        float32x4_t v = vcvt_high_f32_f64(lo, vmulq_f64(vld1q_f64(src + i + 2), g));
+        vst1q_f32(dst + i, v);
+    }
+    gain_to_float_scalar(dst + i, src + i, gain, n - i);
+}
+
+static void gain_to_double_neon(double *dst, const float *src, double gain, long n)
+{
+    float64x2_t g = vdupq_n_f64(gain);
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t v = vld1q_f32(src + i);
+        vst1q_f64(dst + i, vmulq_f64(vcvt_f64_f32(vget_low_f32(v)), g));
+        vst1q_f64(dst + i + 2, vmulq_f64(vcvt_high_f64_f32(v), g));
+    }
+    gain_to_double_scalar(dst + i, src + i, gain, n - i);
+}
+
+static void gain2_neon(double *dst, const double *src, double gain_a, double gain_b, long n)
+{
+    float64x2_t a = vdupq_n_f64(gain_a);
+    float64x2_t b = vdupq_n_f64(gain_b);
+    long i = 0;
+    for (; i + 2 <= n; i += 2) {
+        vst1q_f64(dst + i, vmulq_f64(vmulq_f64(vld1q_f64(src + i), a), b));
+    }
+    gain2_scalar(dst + i, src + i, gain_a, gain_b, n - i);
+}
+
+static void float_to_s16_neon(short *dst, const float *src, long n)
+{
+    float32x4_t hi_limit = vdupq_n_f32(32767.0f);
+    float32x4_t lo_limit = vdupq_n_f32(-32768.0f);
+    long i = 0;
+    for (; i + 8 <= n; i += 8) {
+        float32x4_t a = vmulq_n_f32(vld1q_f32(src + i), 32767.0f);
+        float32x4_t b = vmulq_n_f32(vld1q_f32(src + i + 4), 32767.0f);
+        a = vmaxq_f32(vminq_f32(a, hi_limit), lo_limit);
+        b = vmaxq_f32(vminq_f32(b, hi_limit), lo_limit);
+        int16x8_t packed = vcombine_s16(vqmovn_s32(vcvtq_s32_f32(a)), vqmovn_s32(vcvtq_s32_f32(b)));
+        vst1q_s16(dst + i, packed);
+    }
+    float_to_s16_scalar(dst + i, src + i, n - i);
+}
+
+static float dot_neon(const float *a, const float *b, long n)
+{
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    long i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+        acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    return vaddvq_f32(vaddq_f32(acc0, acc1)) + dot_scalar(a + i, b + i, n - i);
+}
+
+static float peak_neon(const float *src, long n)
+{
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    long i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = vmaxq_f32(acc0, vabsq_f32(vld1q_f32(src + i)));
+        acc1 = vmaxq_f32(acc1, vabsq_f32(vld1q_f32(src + i + 4)));
+    }
+    float peak = vmaxvq_f32(vmaxq_f32(acc0, acc1));
+    float tail = peak_scalar(src + i, n - i);
+    return tail > peak ? tail : peak;
+}
+
+static const t_mp3codec_kernels kernels_neon = {
+    "neon",
+    gain_to_float_neon,
+    gain_to_double_neon,
+    gain2_neon,
+    float_to_s16_neon,
+    dot_neon,
+    peak_neon
+};
+
+#endif // MP3CODEC_KERNELS_NEON
+
+const t_mp3codec_kernels *mp3codec_kernels = &kernels_scalar;
+
+void mp3codec_kernels_init(void)
+{
+#if defined(MP3CODEC_KERNELS_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        mp3codec_kernels = &kernels_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        mp3codec_kernels = &kernels_sse2;
+    }
+#elif defined(MP3CODEC_KERNELS_NEON)
+    mp3codec_kernels = &kernels_neon;
+#endif
+}
@@ -0,0 +1,35 @@
+#ifndef MP3CODEC_KERNELS_H
+#define MP3CODEC_KERNELS_H
+
+// Per-sample loops of the perform routine, with scalar, SSE2, AVX2 and NEON versions.
+// mp3codec_kernels_init() picks the best set for the running CPU once, from ext_main;
+// every version produces the same results as the scalar one, except that dot sums in a
+// different order and so can differ in the last bits.
+
+typedef struct _mp3codec_kernels {
+    const char *name;
+    
+    // dst[i] = (float)(src[i] * gain) - input gain into the encode buffer
+    void (*gain_to_float)(float *dst, const double *src, double gain, long n);
+    
+    // dst[i] = (double)src[i] * gain - ring buffer to signal output
+    void (*gain_to_double)(double *dst, const float *src, double gain, long n);
+    
+    // dst[i] = src[i] * gain_a * gain_b - bypass
+    void (*gain2)(double *dst, const double *src, double gain_a, double gain_b, long n);
+    
+    // dst[i] = float_to_short(src[i]) - 16-bit encoder input, truncating and clamping
+    void (*float_to_s16)(short *dst, const float *src, long n);
+    
+    // sum of a[i] * b[i] - resampler filter taps
+    float (*dot)(const float *a, const float *b, long n);
+    
+    // largest |src[i]| - silence detection on the encode buffer
+    float (*peak)(const float *src, long n);
+} t_mp3codec_kernels;
+
+extern const t_mp3codec_kernels *mp3codec_kernels;
+
+void mp3codec_kernels_init(void);
+
+#endif
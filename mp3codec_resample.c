@@ -0,0 +1,148 @@
+#include <math.h>
+#include <string.h>
+#include "mp3codec_resample.h"
+#include "mp3codec_kernels.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// Per quality: taps per polyphase branch and stopband attenuation. The transition band ends at
+// the codec Nyquist, so nothing aliases; quality only moves the top of the passband (at 96 kHz
+// roughly 13, 16 and 19 kHz).
+static const long RESAMPLE_PHASE_TAPS[RESAMPLE_QUALITIES] = {16, 32, 64};
+static const double RESAMPLE_ATTENUATION_DB[RESAMPLE_QUALITIES] = {60.0, 80.0, 100.0};
+
+static double mp3codec_bessel_i0(double x)
+{
+    double sum = 1.0, term = 1.0;
+    
+    for (int k = 1; k < 64 && term > 1e-12 * sum; k++) {
+        double half = x / (2.0 * k);
+        term *= half * half;
+        sum += term;
+    }
+    return sum;
+}
+
+// Kaiser-windowed sinc, unity gain at DC. The interpolator branches are the prototype's
+// every factor-th tap, reversed so they run against the history in time order, and scaled
+// by factor to make up for the zeros between codec samples.
+static void mp3codec_resampler_design(t_mp3codec_resampler *r)
+{
+    long taps = r->taps;
+    double atten = RESAMPLE_ATTENUATION_DB[r->quality];
+    double beta = 0.1102 * (atten - 8.7);
+    double width = (atten - 7.95) / (14.36 * (double)(taps - 1));  // Cycles per host sample
+    double cutoff = 0.5 / (double)r->factor - width / 2.0;
+    double sum = 0.0;
+    
+    for (long i = 0; i < taps; i++) {
+        double t = (double)i - (double)(taps - 1) / 2.0;
+        double sinc = t == 0.0 ? 2.0 * cutoff : sin(2.0 * M_PI * cutoff * t) / (M_PI * t);
+        double x = 2.0 * (double)i / (double)(taps - 1) - 1.0;
+        double window = mp3codec_bessel_i0(beta * sqrt(1.0 - x * x)) / mp3codec_bessel_i0(beta);
+        r->coeffs[i] = (float)(sinc * window);
+        sum += sinc * window;
+    }
+    for (long i = 0; i < taps; i++) {
+        r->coeffs[i] = (float)(r->coeffs[i] / sum);
+    }
+    
+    for (long p = 0; p < r->factor; p++) {
+        for (long i = 0; i < r->phase_taps; i++) {
+            r->phase_coeffs[p * r->phase_taps + i] = r->coeffs[p + (r->phase_taps - 1 - i) * r->factor] *
+                                                     (float)r->factor;
+        }
+    }
+}
+
+void mp3codec_resampler_init(t_mp3codec_resampler *r, long factor, long quality)
+{
+    r->factor = factor < 1 ? 1 : (factor > RESAMPLE_MAX_FACTOR ? RESAMPLE_MAX_FACTOR : factor);
+    r->quality = quality < 0 ? 0 : (quality >= RESAMPLE_QUALITIES ? RESAMPLE_QUALITIES - 1 : quality);
+    r->phase_taps = RESAMPLE_PHASE_TAPS[r->quality];
+    r->taps = r->factor * r->phase_taps;
+    r->phase = 0;
+    if (r->factor == 1 || !r->coeffs) {
+        r->fifo_fill = 0;
+        return;
+    }
+    
+    mp3codec_resampler_design(r);
+    for (int ch = 0; ch < 2; ch++) {
+        memset(r->in_history[ch], 0, (RESAMPLE_MAX_TAPS - 1 + RESAMPLE_BLOCK) * sizeof(float));
+        memset(r->out_history[ch], 0, (RESAMPLE_MAX_PHASE_TAPS - 1 + RESAMPLE_BLOCK / 2) * sizeof(float));
+        memset(r->fifo[ch], 0, (RESAMPLE_BLOCK + 2 * RESAMPLE_MAX_FACTOR) * sizeof(float));
+    }
+    
+    // The first codec sample only completes after factor host samples, so start the output
+    // factor - 1 samples ahead; mp3codec_resample_up then always has n samples to hand out
+    r->fifo_fill = r->factor - 1;
+}
+
+// Group delay of both filters, taps - 1 in all, factor - 1 of it the head start above
+long mp3codec_resampler_latency(long factor, long quality)
+{
+    if (factor <= 1) return 0;
+    quality = quality < 0 ? 0 : (quality >= RESAMPLE_QUALITIES ? RESAMPLE_QUALITIES - 1 : quality);
+    return factor * RESAMPLE_PHASE_TAPS[quality] - 1;
+}
+
+long mp3codec_resample_down(t_mp3codec_resampler *r, const double *in_left, const double *in_right,
+                            long n, double *out_left, double *out_right)
+{
+    long taps = r->taps;
+    float *left = r->in_history[0];
+    float *right = r->in_history[1];
+    long m = 0;
+    
+    mp3codec_kernels->gain_to_float(left + taps - 1, in_left, 1.0, n);
+    mp3codec_kernels->gain_to_float(right + taps - 1, in_right, 1.0, n);
+    
+    // Host sample i sits at taps - 1 + i, so its window starts at i. The prototype is
+    // symmetric, which makes the time-order dot product the convolution.
+    for (long i = 0; i < n; i++) {
+        if (++r->phase < r->factor) continue;
+        r->phase = 0;
+        out_left[m] = mp3codec_kernels->dot(left + i, r->coeffs, taps);
+        out_right[m] = mp3codec_kernels->dot(right + i, r->coeffs, taps);
+        m++;
+    }
+    
+    memmove(left, left + n, (taps - 1) * sizeof(float));
+    memmove(right, right + n, (taps - 1) * sizeof(float));
+    return m;
+}
+
+void mp3codec_resample_up(t_mp3codec_resampler *r, const double *in_left, const double *in_right,
+                          long m, double *out_left, double *out_right, long n)
+{
+    long phase_taps = r->phase_taps;
+    float *left = r->out_history[0];
+    float *right = r->out_history[1];
+    float *fifo_left = r->fifo[0] + r->fifo_fill;
+    float *fifo_right = r->fifo[1] + r->fifo_fill;
+    
+    mp3codec_kernels->gain_to_float(left + phase_taps - 1, in_left, 1.0, m);
+    mp3codec_kernels->gain_to_float(right + phase_taps - 1, in_right, 1.0, m);
+    
+    // Each codec sample yields factor host samples, one per branch
+    for (long j = 0; j < m; j++) {
+        for (long p = 0; p < r->factor; p++) {
+            const float *branch = r->phase_coeffs + p * phase_taps;
+            *fifo_left++ = mp3codec_kernels->dot(left + j, branch, phase_taps);
+            *fifo_right++ = mp3codec_kernels->dot(right + j, branch, phase_taps);
+        }
+    }
+    r->fifo_fill += m * r->factor;
+    
+    memmove(left, left + m, (phase_taps - 1) * sizeof(float));
+    memmove(right, right + m, (phase_taps - 1) * sizeof(float));
+    
+    mp3codec_kernels->gain_to_double(out_left, r->fifo[0], 1.0, n);
+    mp3codec_kernels->gain_to_double(out_right, r->fifo[1], 1.0, n);
+    r->fifo_fill -= n;
+    memmove(r->fifo[0], r->fifo[0] + n, r->fifo_fill * sizeof(float));
+    memmove(r->fifo[1], r->fifo[1] + n, r->fifo_fill * sizeof(float));
+}
@@ -0,0 +1,44 @@
+#ifndef MP3CODEC_RESAMPLE_H
+#define MP3CODEC_RESAMPLE_H
+
+// Integer-ratio polyphase resampler for host rates MPEG1 layer III can't code (above 48 kHz).
+// Input is decimated to the codec rate and the decoded output interpolated back up, both with
+// the same linear-phase Kaiser-windowed sinc. Buffers live in the core's arena; nothing here
+// allocates, so the filters can be redesigned on the audio thread.
+
+#define RESAMPLE_MAX_FACTOR 4        // 176.4/192 kHz host -> 44.1/48 kHz codec
+#define RESAMPLE_QUALITIES 3         // 0 = cheapest, 2 = flattest passband
+#define RESAMPLE_MAX_PHASE_TAPS 64   // Taps per polyphase branch at the best quality
+#define RESAMPLE_MAX_TAPS (RESAMPLE_MAX_FACTOR * RESAMPLE_MAX_PHASE_TAPS)
+#define RESAMPLE_BLOCK 256           // Host samples resampled per pass
+
+typedef struct _mp3codec_resampler {
+    long factor;             // Host rate / codec rate, 1 = no resampling
+    long quality;            // Quality the filters were last designed for
+    long taps;               // Prototype length at the host rate (factor * phase_taps)
+    long phase_taps;
+    float *coeffs;           // taps: prototype lowpass, used as is by the decimator
+    float *phase_coeffs;     // factor x phase_taps: interpolator branches, reversed and scaled
+    float *in_history[2];    // taps - 1 + RESAMPLE_BLOCK host samples per channel
+    float *out_history[2];   // phase_taps - 1 + RESAMPLE_BLOCK / 2 codec samples per channel
+    float *fifo[2];          // Interpolated host samples not handed out yet
+    long phase;              // Host samples since the last codec sample
+    long fifo_fill;
+} t_mp3codec_resampler;
+
+// Set the factor and quality, design the filters and clear the history
+void mp3codec_resampler_init(t_mp3codec_resampler *r, long factor, long quality);
+
+// Host samples of delay the two filters add, for a factor and quality (0 when not resampling)
+long mp3codec_resampler_latency(long factor, long quality);
+
+// n host samples (at most RESAMPLE_BLOCK) in, the codec samples they complete out. Returns
+// how many that is, which varies by one from call to call when n isn't a multiple of factor.
+long mp3codec_resample_down(t_mp3codec_resampler *r, const double *in_left, const double *in_right,
+                            long n, double *out_left, double *out_right);
+
+// m codec samples (as returned by mp3codec_resample_down) in, exactly n host samples out
+void mp3codec_resample_up(t_mp3codec_resampler *r, const double *in_left, const double *in_right,
+                          long m, double *out_left, double *out_right, long n);
+
+#endif
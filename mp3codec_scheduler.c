@@ -0,0 +1,263 @@
+#include "ext.h"
+#include "ext_systhread.h"
+#include "mp3codec_scheduler.h"
+
+#ifdef __APPLE__
+#include <pthread.h>
+#include <mach/mach.h>
+#include <mach/thread_policy.h>
+#include <dispatch/dispatch.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#include <limits.h>
+#else
+#include <unistd.h>
+#endif
+#if !defined(__APPLE__) && !defined(_WIN32)
+#include <semaphore.h>
+#include <errno.h>
+#include <time.h>
+#endif
+
+#define SCHEDULER_IDLE_MS 20       // Longest sleep without a wake, so a lost post costs little
+
+// Counted wake-ups: the audio thread posts once per queued frame, idle workers wait on it.
+// Posting is a single call that never blocks on the workers.
+#if defined(__APPLE__)
+typedef dispatch_semaphore_t t_mp3codec_sched_sem;
+#elif defined(_WIN32)
+typedef HANDLE t_mp3codec_sched_sem;
+#else
+typedef sem_t t_mp3codec_sched_sem;
+#endif
+
+// One codec thread. busy and passes let mp3codec_scheduler_remove wait out a pass that
+// may still hold a pointer to the core being removed.
+typedef struct _mp3codec_sched_worker {
+    long index;
+    t_systhread thread;
+    atomic_long busy;        // Set while a pass over the slots is running
+    atomic_ulong passes;     // Completed passes
+} t_mp3codec_sched_worker;
+
+static struct {
+    _Atomic(t_mp3codec_core *) slots[SCHEDULER_SLOTS];
+    atomic_long slots_used;  // Highest slot ever taken + 1, so passes skip the empty tail
+    atomic_long registered;
+    t_mp3codec_sched_worker workers[SCHEDULER_WORKERS];
+    long worker_count;
+    atomic_long quit;
+    t_mp3codec_sched_sem wake;
+} mp3codec_sched;
+
+static int mp3codec_sched_sem_init(t_mp3codec_sched_sem *s)
+{
+#if defined(__APPLE__)
+    *s = dispatch_semaphore_create(0);
+    return *s ? 0 : -1;
+#elif defined(_WIN32)
+    *s = CreateSemaphore(NULL, 0, LONG_MAX, NULL);
+    return *s ? 0 : -1;
+#else
+    return sem_init(s, 0, 0);
+#endif
+}
+
+static void mp3codec_sched_sem_post(t_mp3codec_sched_sem *s)
+{
+#if defined(__APPLE__)
+    dispatch_semaphore_signal(*s);
+#elif defined(_WIN32)
+    ReleaseSemaphore(*s, 1, NULL);
+#else
+    sem_post(s);
+#endif
+}
+
+static void mp3codec_sched_sem_wait(t_mp3codec_sched_sem *s, long ms)
+{
+#if defined(__APPLE__)
+    dispatch_semaphore_wait(*s, dispatch_time(DISPATCH_TIME_NOW, ms * NSEC_PER_MSEC));
+#elif defined(_WIN32)
+    WaitForSingleObject(*s, (DWORD)ms);
+#else
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += (ms % 1000) * 1000000L;
+    until.tv_sec += ms / 1000 + until.tv_nsec / 1000000000L;
+    until.tv_nsec %= 1000000000L;
+    while (sem_timedwait(s, &until) != 0 && errno == EINTR) {
+    }
+#endif
+}
+
+static long mp3codec_cpu_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (long)info.dwNumberOfProcessors;
+#else
+    return sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+}
+
+// Keep each thread on its own core so frames don't migrate mid-encode. Worker n goes to
+// core n + 1, leaving core 0 to the audio thread. On macOS this is only an affinity hint
+// (and Apple Silicon ignores it).
+static void mp3codec_scheduler_pin(long index)
+{
+#if defined(__APPLE__)
+    thread_affinity_policy_data_t policy = { (integer_t)(index + 1) };
+    thread_policy_set(pthread_mach_thread_np(pthread_self()), THREAD_AFFINITY_POLICY,
+                      (thread_policy_t)&policy, THREAD_AFFINITY_POLICY_COUNT);
+#elif defined(_WIN32)
+    long cpus = mp3codec_cpu_count();
+    SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << ((index + 1) % cpus));
+#else
+    (void)index;
+#endif
+}
+
+// Codec thread: run the frame whose deadline is nearest, across every registered core
+static void *mp3codec_scheduler_proc(t_mp3codec_sched_worker *w)
+{
+    mp3codec_scheduler_pin(w->index);
+    
+    while (!atomic_load_explicit(&mp3codec_sched.quit, memory_order_acquire)) {
+        t_mp3codec_core *best = NULL;
+        uint64_t best_deadline = UINT64_MAX;
+        int worked = 0;
+        int lost = 0;
+        
+        atomic_store(&w->busy, 1);
+        long used = atomic_load_explicit(&mp3codec_sched.slots_used, memory_order_acquire);
+        for (long i = 0; i < used; i++) {
+            t_mp3codec_core *c = atomic_load(&mp3codec_sched.slots[i]);
+            if (!c || atomic_load_explicit(&c->worker_claim, memory_order_relaxed)) continue;
+            
+            uint64_t deadline = mp3codec_core_next_deadline(c);
+            if (deadline < best_deadline) {
+                best = c;
+                best_deadline = deadline;
+            }
+        }
+        if (best) {
+            worked = mp3codec_core_worker_step(best);
+            // Another worker claimed it between the scan and the step: scan again straight away,
+            // since the wake-up this worker took may have been for a frame on another core
+            lost = !worked && atomic_load_explicit(&best->worker_claim, memory_order_relaxed);
+        }
+        atomic_store(&w->busy, 0);
+        atomic_fetch_add(&w->passes, 1);
+        
+        // A pass that ran a frame goes round again, so frames queued meanwhile are picked up
+        // without a wake; otherwise sleep until the audio thread queues the next one
+        if (!worked && !lost) {
+            mp3codec_sched_sem_wait(&mp3codec_sched.wake, SCHEDULER_IDLE_MS);
+        }
+    }
+    
+    systhread_exit(0);
+    return NULL;
+}
+
+static void mp3codec_scheduler_stop(void)
+{
+    unsigned int ret;
+    
+    atomic_store_explicit(&mp3codec_sched.quit, 1, memory_order_release);
+    for (long i = 0; i < mp3codec_sched.worker_count; i++) {
+        mp3codec_sched_sem_post(&mp3codec_sched.wake);
+    }
+    for (long i = 0; i < mp3codec_sched.worker_count; i++) {
+        systhread_join(mp3codec_sched.workers[i].thread, &ret);
+    }
+    mp3codec_sched.worker_count = 0;
+}
+
+// ext_main: one thread per core, less the one the audio thread runs on
+void mp3codec_scheduler_start(void)
+{
+    long wanted = CLAMP(mp3codec_cpu_count() - 1, 1, SCHEDULER_WORKERS);
+    
+    for (long i = 0; i < SCHEDULER_SLOTS; i++) {
+        atomic_init(&mp3codec_sched.slots[i], NULL);
+    }
+    atomic_init(&mp3codec_sched.slots_used, 0);
+    atomic_init(&mp3codec_sched.registered, 0);
+    atomic_init(&mp3codec_sched.quit, 0);
+    if (mp3codec_sched_sem_init(&mp3codec_sched.wake) != 0) {
+        error("mp3codec~: Failed to create the codec thread semaphore");
+        return;
+    }
+    
+    for (long i = 0; i < wanted; i++) {
+        t_mp3codec_sched_worker *w = &mp3codec_sched.workers[i];
+        w->index = i;
+        atomic_init(&w->busy, 0);
+        atomic_init(&w->passes, 0);
+        if (systhread_create((method)mp3codec_scheduler_proc, w, 0, 0, 0, &w->thread) != 0) {
+            error("mp3codec~: Failed to start codec worker thread %ld", i + 1);
+            break;
+        }
+        mp3codec_sched.worker_count++;
+    }
+    
+    quittask_install((method)mp3codec_scheduler_stop, NULL);
+}
+
+int mp3codec_scheduler_add(t_mp3codec_core *c)
+{
+    if (!mp3codec_sched.worker_count) {
+        return -1;
+    }
+    
+    for (long i = 0; i < SCHEDULER_SLOTS; i++) {
+        if (atomic_load(&mp3codec_sched.slots[i])) continue;
+        
+        atomic_store(&mp3codec_sched.slots[i], c);
+        if (i >= atomic_load(&mp3codec_sched.slots_used)) {
+            atomic_store(&mp3codec_sched.slots_used, i + 1);
+        }
+        atomic_fetch_add(&mp3codec_sched.registered, 1);
+        return 0;
+    }
+    return -1;
+}
+
+void mp3codec_scheduler_remove(t_mp3codec_core *c)
+{
+    int found = 0;
+    
+    for (long i = 0; i < SCHEDULER_SLOTS; i++) {
+        if (atomic_load(&mp3codec_sched.slots[i]) == c) {
+            atomic_store(&mp3codec_sched.slots[i], NULL);
+            found = 1;
+        }
+    }
+    if (!found) return;
+    atomic_fetch_sub(&mp3codec_sched.registered, 1);
+    
+    // Any pass that starts from here on can't see the core; wait for the ones already running
+    for (long i = 0; i < mp3codec_sched.worker_count; i++) {
+        t_mp3codec_sched_worker *w = &mp3codec_sched.workers[i];
+        unsigned long seen = atomic_load(&w->passes);
+        while (atomic_load(&w->busy) && atomic_load(&w->passes) == seen) {
+            systhread_sleep(1);
+        }
+    }
+}
+
+void mp3codec_scheduler_wake(void)
+{
+    if (mp3codec_sched.worker_count) {
+        mp3codec_sched_sem_post(&mp3codec_sched.wake);
+    }
+}
+
+long mp3codec_scheduler_workers(void)
+{
+    return mp3codec_sched.worker_count;
+}
@@ -0,0 +1,24 @@
+#ifndef MP3CODEC_SCHEDULER_H
+#define MP3CODEC_SCHEDULER_H
+
+// Process-wide codec threads shared by every mp3codec~ object. ext_main starts them once;
+// threaded cores register here and their queued frames are run earliest deadline first.
+
+#include "mp3codec_core.h"
+
+#define SCHEDULER_WORKERS 16       // Most codec threads, whatever the core count
+#define SCHEDULER_SLOTS 256        // Most cores (channel pairs) registered at once
+
+void mp3codec_scheduler_start(void);
+
+// Main thread. add returns -1 when every slot is taken; remove returns once no worker
+// is running or looking at the core, so it can be freed straight afterwards.
+int mp3codec_scheduler_add(t_mp3codec_core *c);
+void mp3codec_scheduler_remove(t_mp3codec_core *c);
+
+// Audio thread: a registered core queued a frame. One semaphore post, never blocks.
+void mp3codec_scheduler_wake(void);
+
+long mp3codec_scheduler_workers(void);
+
+#endif
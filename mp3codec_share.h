@@ -0,0 +1,48 @@
+#ifndef MP3CODEC_SHARE_H
+#define MP3CODEC_SHARE_H
+
+// Output sharing (@share): cores that code the same input with the same settings file each
+// decoded frame in their group's cache, and a core that finds its next frame there copies it
+// instead of running LAME. Groups are found by name and reference counted on the main thread;
+// the slots are seqlocked, so codec owners on different threads never wait on each other.
+
+#include "mp3codec_core.h"
+
+#define SHARE_SLOTS 4              // Frames a group keeps (threaded cores can be a frame or two apart)
+#define SHARE_NAME_CHARS 64
+
+typedef struct _mp3codec_share_slot {
+    atomic_ulong seq;              // Odd while a writer fills the slot, 0 = never filled
+    t_mp3codec_share_tag tag;
+    long count;                    // Samples in left/right
+    float left[PCM_BUFFER_SIZE];
+    float right[PCM_BUFFER_SIZE];
+} t_mp3codec_share_slot;
+
+struct _mp3codec_share {
+    char name[SHARE_NAME_CHARS];
+    long refs;                     // Cores holding the group (main thread only)
+    atomic_uint next;              // Slot the next frame is filed in
+    t_mp3codec_share_slot slots[SHARE_SLOTS];
+    struct _mp3codec_share *next_group;
+};
+
+// Main thread: a reference to the group called name, created on first use (NULL when out of
+// memory). leave drops one and frees the group with the last.
+t_mp3codec_share *mp3codec_share_join(const char *name);
+void mp3codec_share_leave(t_mp3codec_share *g);
+
+// Fold n samples into hash (start from SHARE_HASH_SEED)
+#define SHARE_HASH_SEED 0xcbf29ce484222325ull
+uint64_t mp3codec_share_hash(uint64_t hash, const float *src, long n);
+
+// Codec owner: copy the frame filed under tag into left/right and return its length, or -1
+// when no slot holds it (or a writer is replacing it right now)
+long mp3codec_share_find(t_mp3codec_share *g, const t_mp3codec_share_tag *tag, float *left, float *right);
+
+// Codec owner: file count samples under tag, over the oldest slot. Skipped if another core
+// is writing that slot.
+void mp3codec_share_store(t_mp3codec_share *g, const t_mp3codec_share_tag *tag, const float *left,
+                          const float *right, long count);
+
+#endif
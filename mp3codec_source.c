@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mp3codec_source.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+long mp3codec_mpeg_frame(const unsigned char *p, long avail, long *samples, long *rate)
+{
+    static const int bitrates[2][16] = {
+        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},       // MPEG2/2.5
+        {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0}   // MPEG1
+    };
+    static const int rates[4][3] = {
+        {11025, 12000, 8000}, {0, 0, 0}, {22050, 24000, 16000}, {44100, 48000, 32000}
+    };
+    
+    if (avail < 4 || p[0] != 0xFF || (p[1] & 0xE0) != 0xE0 || ((p[1] >> 1) & 3) != 1) {
+        return 0;  // No sync, or not layer III
+    }
+    int version = (p[1] >> 3) & 3;
+    int kbps = bitrates[version == 3][p[2] >> 4];
+    int hz = ((p[2] >> 2) & 3) < 3 ? rates[version][(p[2] >> 2) & 3] : 0;
+    if (!kbps || !hz) {
+        return 0;
+    }
+    
+    long length = (version == 3 ? 144000L : 72000L) * kbps / hz + ((p[2] >> 1) & 1);
+    *samples = version == 3 ? 1152 : 576;
+    if (rate) *rate = hz;
+    return length <= avail ? length : 0;
+}
+
+// Bytes an ID3v2 tag at the start of the file takes, header and footer included
+static long mp3codec_id3_size(const unsigned char *p, long size)
+{
+    if (size < 10 || memcmp(p, "ID3", 3) != 0) {
+        return 0;
+    }
+    long body = ((long)(p[6] & 0x7F) << 21) | ((long)(p[7] & 0x7F) << 14) | ((p[8] & 0x7F) << 7) | (p[9] & 0x7F);
+    return 10 + body + ((p[5] & 0x10) ? 10 : 0);
+}
+
+// The Xing/Info frame LAME writes first holds the stream's length, not audio
+static int mp3codec_is_info_frame(const unsigned char *p, long length)
+{
+    for (long i = 4; i + 4 <= length && i < 64; i++) {
+        if (!memcmp(p + i, "Xing", 4) || !memcmp(p + i, "Info", 4)) return 1;
+    }
+    return 0;
+}
+
+// Walk the frames from start, resyncing over junk, and note where each one begins. With
+// offsets NULL this only counts them.
+static long mp3codec_source_scan(t_mp3codec_source *s, long start, long *offsets)
+{
+    long count = 0, pos = start, end = start, samples, rate;
+    
+    while (pos < s->size) {
+        long length = mp3codec_mpeg_frame(s->data + pos, s->size - pos, &samples, &rate);
+        // Only frames in the first one's format count; anything else is junk to skip
+        if (!length || (count && (samples != s->frame_samples || rate != s->sample_rate))) {
+            pos++;
+            continue;
+        }
+        if (!count && !offsets) {
+            s->frame_samples = samples;
+            s->sample_rate = rate;
+            s->channels = ((s->data[pos + 3] >> 6) == 3) ? 1 : 2;
+        }
+        if (offsets) offsets[count] = pos;
+        count++;
+        pos += length;
+        end = pos;
+    }
+    if (offsets) offsets[count] = end;  // Trailing junk (an ID3v1 tag) never reaches hip
+    return count;
+}
+
+static int mp3codec_source_map(t_mp3codec_source *s, const char *path)
+{
+#ifdef _WIN32
+    s->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (s->file == INVALID_HANDLE_VALUE) {
+        s->file = NULL;
+        return -1;
+    }
+    LARGE_INTEGER size;
+    GetFileSizeEx(s->file, &size);
+    s->size = (long)size.QuadPart;
+    s->mapping = s->size ? CreateFileMappingA(s->file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+    s->data = s->mapping ? (const unsigned char *)MapViewOfFile(s->mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    return s->data ? 0 : -1;
+#else
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    s->size = (long)info.st_size;
+    void *data = mmap(NULL, (size_t)s->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);  // The mapping keeps the file open
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+    s->data = (const unsigned char *)data;
+    madvise(data, (size_t)s->size, MADV_WILLNEED);
+    return 0;
+#endif
+}
+
+static void mp3codec_source_unmap(t_mp3codec_source *s)
+{
+#ifdef _WIN32
+    if (s->data) UnmapViewOfFile(s->data);
+    if (s->mapping) CloseHandle(s->mapping);
+    if (s->file) CloseHandle(s->file);
+#else
+    if (s->data) munmap((void *)s->data, (size_t)s->size);
+#endif
+    s->data = NULL;
+}
+
+t_mp3codec_source *mp3codec_source_open(const char *path, char *error, size_t error_size)
+{
+    t_mp3codec_source *s = (t_mp3codec_source *)calloc(1, sizeof(t_mp3codec_source));
+    if (!s) {
+        snprintf(error, error_size, "out of memory");
+        return NULL;
+    }
+    
+    if (mp3codec_source_map(s, path) < 0) {
+        snprintf(error, error_size, "can't open or map the file");
+        mp3codec_source_close(s);
+        return NULL;
+    }
+    
+    // Indexing reads every page, so the audio thread doesn't fault them in later
+    long start = mp3codec_id3_size(s->data, s->size);
+    long count = mp3codec_source_scan(s, start, NULL);
+    s->frame_offsets = count ? (long *)malloc((count + 1) * sizeof(long)) : NULL;
+    if (!s->frame_offsets) {
+        snprintf(error, error_size, "no MPEG layer III frames found");
+        mp3codec_source_close(s);
+        return NULL;
+    }
+    s->frame_count = mp3codec_source_scan(s, start, s->frame_offsets);
+    if (s->frame_count > 1 && mp3codec_is_info_frame(s->data + s->frame_offsets[0],
+                                                     s->frame_offsets[1] - s->frame_offsets[0])) {
+        memmove(s->frame_offsets, s->frame_offsets + 1, s->frame_count * sizeof(long));
+        s->frame_count--;
+    }
+    
+    s->hip = hip_decode_init();
+    s->pcm_left = (short *)calloc(s->frame_samples, sizeof(short));
+    s->pcm_right = (short *)calloc(s->frame_samples, sizeof(short));
+    if (!s->hip || !s->pcm_left || !s->pcm_right) {
+        snprintf(error, error_size, "failed to set up the decoder");
+        mp3codec_source_close(s);
+        return NULL;
+    }
+    return s;
+}
+
+void mp3codec_source_close(t_mp3codec_source *s)
+{
+    if (!s) return;
+    if (s->hip) hip_decode_exit(s->hip);
+    free(s->frame_offsets);
+    free(s->pcm_left);
+    free(s->pcm_right);
+    mp3codec_source_unmap(s);
+    free(s);
+}
+
+void mp3codec_source_seek(t_mp3codec_source *s, long sample)
+{
+    long frame = sample / s->frame_samples;
+    long start = frame > SOURCE_SEEK_PREROLL ? frame - SOURCE_SEEK_PREROLL : 0;
+    
+    s->next_frame = start;
+    s->discard_samples = sample - start * s->frame_samples;
+}
+
+long mp3codec_source_decode(t_mp3codec_source *s)
+{
+    if (s->next_frame >= s->frame_count) {
+        return -1;
+    }
+    
+    const unsigned char *frame = s->data + s->frame_offsets[s->next_frame];
+    long length = s->frame_offsets[s->next_frame + 1] - s->frame_offsets[s->next_frame];
+    s->next_frame++;
+    
+    // hip copies what it needs, so it can read the mapped pages directly
+    long n = hip_decode1(s->hip, (unsigned char *)frame, (size_t)length, s->pcm_left, s->pcm_right);
+    if (n < 0 || n > s->frame_samples) {
+        // A frame that lost its bit reservoir (just after a seek) plays as silence, keeping time
+        n = s->frame_samples;
+        memset(s->pcm_left, 0, n * sizeof(short));
+        memset(s->pcm_right, 0, n * sizeof(short));
+    } else if (s->channels == 1) {
+        memcpy(s->pcm_right, s->pcm_left, n * sizeof(short));
+    }
+    
+    if (s->discard_samples > 0) {
+        long skip = s->discard_samples < n ? s->discard_samples : n;
+        memmove(s->pcm_left, s->pcm_left + skip, (n - skip) * sizeof(short));
+        memmove(s->pcm_right, s->pcm_right + skip, (n - skip) * sizeof(short));
+        s->discard_samples -= skip;
+        n -= skip;
+    }
+    return n;
+}
+
+long mp3codec_source_length(const t_mp3codec_source *s)
+{
+    return s->frame_count * s->frame_samples;
+}
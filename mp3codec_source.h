@@ -0,0 +1,50 @@
+#ifndef MP3CODEC_SOURCE_H
+#define MP3CODEC_SOURCE_H
+
+// Decode-only playback (@source): a pre-encoded MP3 file, memory-mapped and indexed by frame on
+// the main thread, fed to its own hip decoder straight from the mapped pages. The audio thread
+// only decodes; opening, mapping, indexing and freeing all happen on the main thread.
+
+#include <lame/lame.h>
+
+#define SOURCE_SEEK_PREROLL 8      // Frames decoded and dropped before a seek target (refills the bit reservoir)
+
+typedef struct _mp3codec_source {
+    const unsigned char *data;     // The whole file, mapped read-only
+    long size;
+    long *frame_offsets;           // Byte offset of every audio frame, in order (frame_count + 1, last = end)
+    long frame_count;
+    long frame_samples;            // Samples per frame: 1152, or 576 for MPEG2/2.5
+    long sample_rate;
+    int channels;
+    hip_t hip;
+    short *pcm_left;               // One decoded frame
+    short *pcm_right;
+    long next_frame;               // Next frame to decode (audio thread only)
+    long discard_samples;          // Seek preroll output still to drop (audio thread only)
+#ifdef _WIN32
+    void *file;
+    void *mapping;
+#endif
+} t_mp3codec_source;
+
+// Byte length of the MPEG audio layer III frame at p, with the samples it codes and its sample
+// rate (rate may be NULL), or 0 if p doesn't start a whole one
+long mp3codec_mpeg_frame(const unsigned char *p, long avail, long *samples, long *rate);
+
+// Main thread: map and index path. Returns NULL with the reason in error when it can't be
+// played (no such file, no layer III frames).
+t_mp3codec_source *mp3codec_source_open(const char *path, char *error, size_t error_size);
+void mp3codec_source_close(t_mp3codec_source *s);
+
+// Audio thread: continue from sample (at the file's rate), decoding a few frames ahead of it
+void mp3codec_source_seek(t_mp3codec_source *s, long sample);
+
+// Audio thread: decode the next frame into pcm_left/pcm_right. Returns the samples that survive
+// the seek preroll (possibly 0), or -1 once the file has run out.
+long mp3codec_source_decode(t_mp3codec_source *s);
+
+// Length of the file in samples
+long mp3codec_source_length(const t_mp3codec_source *s);
+
+#endif
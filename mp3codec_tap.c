@@ -0,0 +1,349 @@
+#include "mp3codec_tap.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <netdb.h>
+#endif
+
+#define TAP_CONNECT_POLL_MS 50     // How often a pending connect looks at quit
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0             // macOS: SO_NOSIGPIPE is set on the socket instead
+#endif
+
+static void mp3codec_tap_close(int fd, long streaming)
+{
+    if (fd < 0) return;
+#ifdef _WIN32
+    if (streaming) closesocket(fd);
+    else _close(fd);
+#else
+    (void)streaming;
+    close(fd);
+#endif
+}
+
+// Writer thread: wait for a non-blocking connect to finish, looking at quit every
+// TAP_CONNECT_POLL_MS and giving up after TAP_TIMEOUT_S. 0 once connected, -1 otherwise.
+static int mp3codec_tap_connect_wait(t_mp3codec_tap *tap, int fd)
+{
+    for (long waited = 0; waited < TAP_TIMEOUT_S * 1000; waited += TAP_CONNECT_POLL_MS) {
+        if (atomic_load_explicit(&tap->quit, memory_order_acquire)) {
+            return -1;
+        }
+        
+        fd_set writable, failed;
+        FD_ZERO(&writable);
+        FD_ZERO(&failed);
+        FD_SET(fd, &writable);
+        FD_SET(fd, &failed);
+        struct timeval poll = {0, TAP_CONNECT_POLL_MS * 1000};
+        int ready = select(fd + 1, NULL, &writable, &failed, &poll);
+        if (ready < 0 && errno != EINTR) {
+            return -1;
+        }
+        if (ready > 0) {
+            int reason = 0;
+            socklen_t len = sizeof(reason);
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, (char *)&reason, &len);
+            errno = reason;
+            return reason ? -1 : 0;
+        }
+    }
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+// Writer thread: connect without blocking, so a stop never waits out a TCP timeout; sends then
+// block again, each bounded by TAP_TIMEOUT_S
+static int mp3codec_tap_connect(t_mp3codec_tap *tap)
+{
+    struct addrinfo hints, *list = NULL;
+    int fd = -1;
+#ifdef _WIN32
+    WSADATA wsa;
+    WSAStartup(MAKEWORD(2, 2), &wsa);
+#endif
+    
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int status = getaddrinfo(tap->host, tap->port, &hints, &list);
+    if (status != 0) {
+        return -1;
+    }
+    
+    for (struct addrinfo *ai = list; ai && fd < 0; ai = ai->ai_next) {
+        fd = (int)socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+#ifdef _WIN32
+        DWORD timeout = TAP_TIMEOUT_S * 1000;
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (const char *)&timeout, sizeof(timeout));
+#else
+        struct timeval timeout = {TAP_TIMEOUT_S, 0};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+#ifdef SO_NOSIGPIPE
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+#endif
+    
+#ifdef _WIN32
+        u_long nonblocking = 1;
+        ioctlsocket(fd, FIONBIO, &nonblocking);
+        int result = connect(fd, ai->ai_addr, (int)ai->ai_addrlen);
+        int pending = result != 0 && WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+        int flags = fcntl(fd, F_GETFL, 0);
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        int result = connect(fd, ai->ai_addr, ai->ai_addrlen);
+        int pending = result != 0 && errno == EINPROGRESS;
+#endif
+        int connected = result == 0 || (pending && mp3codec_tap_connect_wait(tap, fd) == 0);
+#ifdef _WIN32
+        nonblocking = 0;
+        ioctlsocket(fd, FIONBIO, &nonblocking);
+#else
+        fcntl(fd, F_SETFL, flags);
+#endif
+        if (!connected) {
+            int reason = errno;
+            mp3codec_tap_close(fd, 1);
+            fd = -1;
+            errno = reason;
+            if (atomic_load_explicit(&tap->quit, memory_order_acquire)) break;
+        }
+    }
+    freeaddrinfo(list);
+    return fd;
+}
+
+// Writer thread: hand both spans to the kernel in one call. Returns bytes written, -1 on error.
+static long mp3codec_tap_write(t_mp3codec_tap *tap, int fd, const unsigned char *first, long first_len,
+                               const unsigned char *second, long second_len)
+{
+#ifdef _WIN32
+    long done = tap->streaming ? send(fd, (const char *)first, (int)first_len, 0) :
+                                 _write(fd, first, (unsigned int)first_len);
+    if (done == first_len && second_len) {
+        long more = tap->streaming ? send(fd, (const char *)second, (int)second_len, 0) :
+                                     _write(fd, second, (unsigned int)second_len);
+        done = more < 0 ? done : done + more;
+    }
+    return done;
+#else
+    struct iovec iov[2] = {
+        {(void *)first, (size_t)first_len},
+        {(void *)second, (size_t)second_len}
+    };
+    int spans = second_len ? 2 : 1;
+    
+    if (tap->streaming) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = spans;
+        return (long)sendmsg(fd, &msg, MSG_NOSIGNAL);
+    }
+    return (long)writev(fd, iov, spans);
+#endif
+}
+
+static void *mp3codec_tap_proc(t_mp3codec_tap *tap)
+{
+    if (tap->streaming) {
+        errno = 0;
+        tap->sinks[0].fd = mp3codec_tap_connect(tap);
+        if (tap->sinks[0].fd < 0) {
+            // A stop while connecting isn't a failure to report
+            if (!atomic_load_explicit(&tap->quit, memory_order_acquire)) {
+                atomic_store(&tap->failed, errno ? errno : ECONNREFUSED);
+                if (tap->fail_qelem) qelem_set(tap->fail_qelem);
+            }
+            systhread_exit(0);
+            return NULL;
+        }
+    }
+    
+    // Start each ring empty (a previous session may have left a frame behind), then let the
+    // codec owner fill it. Not once a stop has begun: it may have cleared tap_enabled already.
+    for (long i = 0; i < tap->sink_count && !atomic_load_explicit(&tap->quit, memory_order_acquire); i++) {
+        t_mp3codec_core *c = tap->sinks[i].core;
+        atomic_store(&c->tap_tail, atomic_load_explicit(&c->tap_head, memory_order_acquire));
+        atomic_store_explicit(&c->tap_enabled, 1, memory_order_release);
+    }
+    
+    uint64_t last_write = mp3codec_now_ns();
+    for (;;) {
+        // Read quit first: once it is set the cores have stopped feeding, so this pass is the last
+        long quit = atomic_load_explicit(&tap->quit, memory_order_acquire);
+        int flush = quit || mp3codec_now_ns() - last_write >= (uint64_t)TAP_FLUSH_MS * 1000000ull;
+        
+        for (long i = 0; i < tap->sink_count && !atomic_load(&tap->failed); i++) {
+            t_mp3codec_tap_sink *sink = &tap->sinks[i];
+            const unsigned char *first, *second;
+            long first_len, second_len;
+            long waiting = mp3codec_tap_peek(sink->core, &first, &first_len, &second, &second_len);
+            if (!waiting || (waiting < TAP_BATCH_BYTES && !flush)) continue;
+            
+            long done = mp3codec_tap_write(tap, sink->fd, first, first_len, second, second_len);
+            if (done < 0) {
+                atomic_store(&tap->failed, errno ? errno : EIO);
+                break;
+            }
+            mp3codec_tap_release(sink->core, done);  // A short write leaves the rest for the next pass
+            atomic_fetch_add_explicit(&sink->bytes, done, memory_order_relaxed);
+            last_write = mp3codec_now_ns();
+        }
+        
+        if (atomic_load(&tap->failed)) {
+            if (tap->fail_qelem) qelem_set(tap->fail_qelem);
+            break;
+        }
+        if (quit) break;
+        systhread_sleep(20);
+    }
+    
+    systhread_exit(0);
+    return NULL;
+}
+
+static t_mp3codec_tap *mp3codec_tap_start(t_mp3codec_tap *tap, void *fail_qelem)
+{
+    tap->fail_qelem = fail_qelem;
+    atomic_init(&tap->quit, 0);
+    atomic_init(&tap->failed, 0);
+    if (systhread_create((method)mp3codec_tap_proc, tap, 0, 0, 0, &tap->thread) != 0) {
+        error("mp3codec~: Failed to start the bitstream writer thread");
+        for (long i = 0; i < tap->sink_count; i++) {
+            mp3codec_tap_close(tap->sinks[i].fd, tap->streaming);
+        }
+        free(tap);
+        return NULL;
+    }
+    return tap;
+}
+
+t_mp3codec_tap *mp3codec_tap_record(t_mp3codec_core **cores, long count, const char *path, void *fail_qelem)
+{
+    t_mp3codec_tap *tap = (t_mp3codec_tap *)calloc(1, sizeof(t_mp3codec_tap));
+    if (!tap) return NULL;
+    
+    snprintf(tap->path, sizeof(tap->path), "%s", path);
+    const char *dot = strrchr(path, '.');
+    const char *slash = strrchr(path, '/');
+    size_t stem = (dot && (!slash || dot > slash)) ? (size_t)(dot - path) : strlen(path);
+    
+    if (count > TAP_MAX_SINKS) {
+        error("mp3codec~: Only the first %d of %ld cores can be recorded", TAP_MAX_SINKS, count);
+    }
+    for (long i = 0; i < MIN(count, TAP_MAX_SINKS); i++) {
+        char name[MAX_PATH_CHARS];
+        if (i == 0) {
+            snprintf(name, sizeof(name), "%s", path);
+        } else {
+            snprintf(name, sizeof(name), "%.*s-%ld%s", (int)stem, path, i + 1, path + stem);
+        }
+        
+        t_mp3codec_tap_sink *sink = &tap->sinks[tap->sink_count];
+        sink->core = cores[i];
+        if (!cores[i] || mp3codec_tap_alloc(cores[i]) < 0) continue;
+#ifdef _WIN32
+        sink->fd = _open(name, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, 0644);
+#else
+        sink->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+        if (sink->fd < 0) {
+            error("mp3codec~: Can't open %s for recording (%s)", name, strerror(errno));
+            continue;
+        }
+        tap->sink_count++;
+    }
+    
+    if (!tap->sink_count) {
+        free(tap);
+        return NULL;
+    }
+    return mp3codec_tap_start(tap, fail_qelem);
+}
+
+t_mp3codec_tap *mp3codec_tap_stream(t_mp3codec_core *core, const char *address, void *fail_qelem)
+{
+    const char *colon = strrchr(address, ':');
+    if (!colon || colon == address || !colon[1] || (size_t)(colon - address) >= sizeof(((t_mp3codec_tap *)0)->host)) {
+        error("mp3codec~: stream needs host:port, got %s", address);
+        return NULL;
+    }
+    if (mp3codec_tap_alloc(core) < 0) {
+        error("mp3codec~: Failed to allocate the bitstream ring");
+        return NULL;
+    }
+    
+    t_mp3codec_tap *tap = (t_mp3codec_tap *)calloc(1, sizeof(t_mp3codec_tap));
+    if (!tap) return NULL;
+    
+    tap->streaming = 1;
+    snprintf(tap->path, sizeof(tap->path), "%s", address);
+    snprintf(tap->host, sizeof(tap->host), "%.*s", (int)(colon - address), address);
+    snprintf(tap->port, sizeof(tap->port), "%s", colon + 1);
+    tap->sinks[0].core = core;
+    tap->sinks[0].fd = -1;
+    tap->sink_count = 1;
+    return mp3codec_tap_start(tap, fail_qelem);
+}
+
+void mp3codec_tap_stop(t_mp3codec_tap *tap)
+{
+    unsigned int ret;
+    
+    if (!tap) return;
+    for (long i = 0; i < tap->sink_count; i++) {
+        atomic_store_explicit(&tap->sinks[i].core->tap_enabled, 0, memory_order_release);
+    }
+    atomic_store_explicit(&tap->quit, 1, memory_order_release);
+    systhread_join(tap->thread, &ret);
+    
+    // The writer may have enabled a core between the first clear and seeing quit
+    for (long i = 0; i < tap->sink_count; i++) {
+        atomic_store_explicit(&tap->sinks[i].core->tap_enabled, 0, memory_order_release);
+    }
+    
+    long failed = atomic_load(&tap->failed);
+    long long bytes = mp3codec_tap_bytes(tap);
+    if (failed) {
+        error("mp3codec~: %s to %s stopped: %s (%lld bytes written)", tap->streaming ? "Stream" : "Recording",
+              tap->path, strerror((int)failed), bytes);
+    } else {
+        post("mp3codec~: %s %lld MP3 bytes to %s%s", tap->streaming ? "Streamed" : "Recorded", bytes, tap->path,
+             tap->sink_count < 2 ? "" : tap->sinks[0].core->channels == 1 ? " (one file per channel)" :
+             " (one file per channel pair)");
+    }
+    
+    for (long i = 0; i < tap->sink_count; i++) {
+        mp3codec_tap_close(tap->sinks[i].fd, tap->streaming);
+    }
+    free(tap);
+}
+
+long long mp3codec_tap_bytes(t_mp3codec_tap *tap)
+{
+    long long bytes = 0;
+    
+    for (long i = 0; tap && i < tap->sink_count; i++) {
+        bytes += atomic_load_explicit(&tap->sinks[i].bytes, memory_order_relaxed);
+    }
+    return bytes;
+}
@@ -0,0 +1,49 @@
+#ifndef MP3CODEC_TAP_H
+#define MP3CODEC_TAP_H
+
+// Writer thread for the bitstream tap: drains the tap ring of every core it serves into one
+// file per core, or one TCP connection, in large batched writes straight out of the rings.
+// Opening, connecting and writing all happen here or on the main thread; the audio path only
+// copies finished MP3 frames into the ring (mp3codec_core.c).
+
+#include "ext.h"
+#include "ext_systhread.h"
+#include "mp3codec_core.h"
+
+#define TAP_MAX_SINKS 32           // Cores one writer can serve (MAX_CHANNELS mono cores with @stereo 0)
+#define TAP_BATCH_BYTES 65536      // Write once this much is waiting...
+#define TAP_FLUSH_MS 250           // ...or this long after the last write
+#define TAP_TIMEOUT_S 2            // Longest a connect or send may block the writer
+
+typedef struct _mp3codec_tap_sink {
+    t_mp3codec_core *core;
+    int fd;                        // File or socket, -1 until open
+    atomic_llong bytes;            // Written so far (writer thread only writes)
+} t_mp3codec_tap_sink;
+
+typedef struct _mp3codec_tap {
+    t_systhread thread;
+    atomic_long quit;
+    atomic_long failed;            // errno of the connect or write that stopped the writer
+    long streaming;                // 1 = one TCP connection to host:port, 0 = files
+    char host[256];
+    char port[16];
+    char path[MAX_PATH_CHARS];     // First file, or host:port
+    long sink_count;
+    t_mp3codec_tap_sink sinks[TAP_MAX_SINKS];
+    void *fail_qelem;              // Set from the writer when it stops on an error (optional)
+} t_mp3codec_tap;
+
+// Main thread. record opens path for the first core and <name>-2<ext>, <name>-3<ext>... for
+// the others; stream connects on the writer thread, so the main thread never waits on the
+// network. Both return NULL (having reported why) when nothing could be started.
+t_mp3codec_tap *mp3codec_tap_record(t_mp3codec_core **cores, long count, const char *path, void *fail_qelem);
+t_mp3codec_tap *mp3codec_tap_stream(t_mp3codec_core *core, const char *address, void *fail_qelem);
+
+// Main thread: stop the cores feeding the writer, let it write what is queued, close and free
+void mp3codec_tap_stop(t_mp3codec_tap *tap);
+
+// Main thread: bytes written so far over all sinks
+long long mp3codec_tap_bytes(t_mp3codec_tap *tap);
+
+#endif
@@ -2,71 +2,71 @@
 #include "ext_obex.h"
 #include "z_dsp.h"
 #include "ext_systhread.h"
-#include <lame/lame.h>
+#include "mp3codec_core.h"
+#include "mp3codec_scheduler.h"
+#include "mp3codec_tap.h"
+#include "mp3codec_share.h"
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
 
-#define MP3_FRAME_SIZE 1152        // MPEG1 frame size in samples
-#define MP3_BUFFER_SIZE 8192       // MP3 output buffer size
-#define PCM_BUFFER_SIZE (MP3_FRAME_SIZE * 4)  // PCM buffer with headroom
-#define DECODE_BUFFER_SIZE 16384   // Larger decode buffer for accumulation
+#define MAX_CHANNELS 32            // Signal inlets/outlets with @chans
 
-// Quality to bitrate mapping (0=best, 9=worst) - More aggressive for low quality
-// Note: LAME minimum CBR is 32 kbps - lower values get clamped to 32 kbps
-static const int QUALITY_BITRATES[10] = {320, 256, 192, 160, 128, 112, 96, 64, 40, 32};
+// A preset: quality, input gain, output gain, then the compression toggles in this order
+#define PRESET_TOGGLES 6
+#define PRESET_VALUES (3 + PRESET_TOGGLES)
 
+static const struct {
+    const char *name;
+    const char *label;
+} MP3CODEC_TOGGLES[PRESET_TOGGLES] = {
+    {"lowpass", "Low-pass filter"},
+    {"highpass", "High-pass filter"},
+    {"msstereo", "Forced mid/side stereo"},
+    {"athonly", "ATH-only psychoacoustic model"},
+    {"experimental", "Experimental compression modes"},
+    {"emphasis", "Pre-emphasis"}
+};
+
+// The codec itself lives in mp3codec_core.c; this object owns one core per channel pair, points
+// its attributes at the first one's parameters, and supplies the main-thread side (qelems,
+// console). Threaded cores run on the shared threads in mp3codec_scheduler.c.
 typedef struct _mp3codec {
     t_pxobject ob;
     
-    // LAME encoder/decoder
-    lame_global_flags *gfp;
-    hip_t hip;
-    
-    // Parameters
-    long quality;          // 0-9 LAME quality scale
-    double input_gain;     // 0.0-4.0
-    double output_gain;    // 0.0-4.0
-    long bypass;           // 0/1
-    
-    // Individual aggressive compression toggles
-    long enable_lowpass;   // 0/1 - 4kHz low-pass filter
-    long enable_highpass;  // 0/1 - 100Hz high-pass filter
-    long enable_ms_stereo; // 0/1 - Force mid/side stereo
-    long enable_ath_only;  // 0/1 - ATH-only psychoacoustic model
-    long enable_experimental; // 0/1 - Experimental compression modes
-    long enable_emphasis;  // 0/1 - Pre-emphasis
-    
-    // Audio processing state
-    long sample_rate;
-    long channels;
-    long initialized;
-    
-    // Buffers for encoding
-    float *encode_buffer_left;
-    float *encode_buffer_right;
-    int encode_buffer_fill;
-    
-    // Buffers for decoding
-    unsigned char *mp3_accumulator;
-    int mp3_accumulator_fill;
-    short *decode_pcm_left;
-    short *decode_pcm_right;
-    
-    // Ring buffer for output smoothing
-    float *output_ring_left;
-    float *output_ring_right;
-    int ring_write_pos;
-    int ring_read_pos;
-    int ring_size;
-    
-    // Latency tracking and compensation
-    int total_latency_samples;
-    double total_latency_ms;
-    int lame_encoder_delay;
-    int lame_decoder_delay;
-    int buffer_latency_samples;
-    int decode_delay_compensation;
+    t_mp3codec_core core;
+    
+    // Channel layout, fixed at creation - pair[0] is &core, the rest follow its parameters
+    long chans;             // Signal inlets and outlets (1-MAX_CHANNELS)
+    long stereo;            // 1 = adjacent channels share a stereo encoder, 0 = one mono encoder each
+    long pair_count;
+    t_mp3codec_core *pair[MAX_CHANNELS];
+    double *scratch;        // Discarded right output of mono cores
+    long scratch_size;
+    
+    // Main-thread work the core asks for through mp3codec_host_notify
+    void *retire_qelem;     // Free states the codec owner swapped out
+    void *event_qelem;      // Report audio-path events
+    void *cache_qelem;      // Refill the config cache once the change has gone through
+    void *analysis_qelem;   // Send out the frame analysis records waiting in the cores
+    void *config_qelem;     // Rebuild once for however many toggles changed since the last one
+    long config_dirty;      // A toggle changed and no rebuild has picked it up yet
+    long preset_quality;    // Quality a recalled preset asked for, -1 = none waiting for config_qelem
+    long reported_latency;  // Last figure sent out the status outlet
+    
+    // Threaded pipeline - 1 while the cores are registered with the scheduler
+    long scheduled;
+    
+    // Decode-only playback - the first pair plays this file instead of coding its input
+    t_symbol *source;       // @source, empty when off
+    long source_rate;       // Sample rate of the file handed to the core, 0 = none
+    
+    // Output sharing group, empty when off
+    t_symbol *share;
+    
+    // Bitstream recorder or streamer, NULL when off
+    t_mp3codec_tap *tap;
+    void *tap_qelem;        // The writer stopped on an error
     
     // Outlets
     void *analysis_outlet;
@@ -79,6 +79,8 @@ void *mp3codec_new(t_symbol *s, long argc, t_atom *argv);
 void mp3codec_free(t_mp3codec *x);
 void mp3codec_dsp64(t_mp3codec *x, t_object *dsp64, short *count, double samplerate, long maxvectorsize, long flags);
 void mp3codec_perform64(t_mp3codec *x, t_object *dsp64, double **ins, long numins, double **outs, long numouts, long sampleframes, long flags, void *userparam);
+void mp3codec_perform64_stereo(t_mp3codec *x, t_object *dsp64, double **ins, long numins, double **outs, long numouts, long sampleframes, long flags, void *userparam);
+void mp3codec_perform64_mono(t_mp3codec *x, t_object *dsp64, double **ins, long numins, double **outs, long numouts, long sampleframes, long flags, void *userparam);
 void mp3codec_assist(t_mp3codec *x, void *b, long m, long a, char *s);
 
 // Parameter control
@@ -87,31 +89,81 @@ void mp3codec_bypass(t_mp3codec *x, long n);
 void mp3codec_reset(t_mp3codec *x);
 
 // Individual compression toggles
-void mp3codec_lowpass(t_mp3codec *x, long n);
-void mp3codec_highpass(t_mp3codec *x, long n);
-void mp3codec_msstereo(t_mp3codec *x, long n);
-void mp3codec_athonly(t_mp3codec *x, long n);
-void mp3codec_experimental(t_mp3codec *x, long n);
-void mp3codec_emphasis(t_mp3codec *x, long n);
+t_max_err mp3codec_toggle_set(t_mp3codec *x, void *attr, long argc, t_atom *argv);
+void mp3codec_config_drain(t_mp3codec *x);
+
+// Presets (and pattr)
+void mp3codec_preset(t_mp3codec *x, t_symbol *s, long argc, t_atom *argv);
+t_max_err mp3codec_getvalueof(t_mp3codec *x, long *ac, t_atom **av);
+t_max_err mp3codec_setvalueof(t_mp3codec *x, long ac, t_atom *av);
 
 // Latency reporting
 void mp3codec_latency(t_mp3codec *x);
 
-// Internal functions
-int mp3codec_init_processor(t_mp3codec *x);
-void mp3codec_cleanup_processor(t_mp3codec *x);
+// Telemetry
+void mp3codec_stats(t_mp3codec *x);
+void mp3codec_event_drain(t_mp3codec *x);
+void mp3codec_analysis_drain(t_mp3codec *x);
+t_max_err mp3codec_analysis_set(t_mp3codec *x, void *attr, long argc, t_atom *argv);
+void mp3codec_cpu(t_mp3codec *x);
 
-// Helper functions
-static inline short float_to_short(float sample) {
-    int value = (int)(sample * 32767.0f);
-    if (value > 32767) value = 32767;
-    if (value < -32768) value = -32768;
-    return (short)value;
-}
+// Quality morphing
+t_max_err mp3codec_morph_set(t_mp3codec *x, void *attr, long argc, t_atom *argv);
+t_max_err mp3codec_morph_pool_set(t_mp3codec *x, void *attr, long argc, t_atom *argv);
+void mp3codec_pool(t_mp3codec *x);
 
-static inline float short_to_float(short sample) {
-    return sample / 32767.0f;
-}
+// Memory footprint
+t_max_err mp3codec_compact_set(t_mp3codec *x, void *attr, long argc, t_atom *argv);
+void mp3codec_fit_pairs(t_mp3codec *x);
+void mp3codec_relatch_pairs(t_mp3codec *x, int remeasure);
+void mp3codec_memory(t_mp3codec *x);
+
+// Low latency mode
+t_max_err mp3codec_lowlatency_set(t_mp3codec *x, void *attr, long argc, t_atom *argv);
+t_max_err mp3codec_render_set(t_mp3codec *x, void *attr, long argc, t_atom *argv);
+t_max_err mp3codec_resample_set(t_mp3codec *x, void *attr, long argc, t_atom *argv);
+
+// Bitrate mode and deadline guard
+t_max_err mp3codec_mode_set(t_mp3codec *x, void *attr, long argc, t_atom *argv);
+t_max_err mp3codec_guard_set(t_mp3codec *x, void *attr, long argc, t_atom *argv);
+t_max_err mp3codec_idle_set(t_mp3codec *x, void *attr, long argc, t_atom *argv);
+t_max_err mp3codec_reservoir_set(t_mp3codec *x, void *attr, long argc, t_atom *argv);
+t_max_err mp3codec_stagger_set(t_mp3codec *x, void *attr, long argc, t_atom *argv);
+void mp3codec_quality_post(t_mp3codec *x, const char *what);
+
+// Decode-only playback
+t_max_err mp3codec_source_set(t_mp3codec *x, void *attr, long argc, t_atom *argv);
+t_max_err mp3codec_share_set(t_mp3codec *x, void *attr, long argc, t_atom *argv);
+void mp3codec_seek(t_mp3codec *x, double ms);
+void mp3codec_source_check_rate(t_mp3codec *x);
+
+// Bitstream recording and streaming
+void mp3codec_record(t_mp3codec *x, t_symbol *s, long argc, t_atom *argv);
+void mp3codec_stream(t_mp3codec *x, t_symbol *s, long argc, t_atom *argv);
+int mp3codec_tap_stop_requested(t_mp3codec *x, long argc, t_atom *argv);
+void mp3codec_tap_failed(t_mp3codec *x);
+
+// Multichannel
+t_max_err mp3codec_layout_set(t_mp3codec *x, void *attr, long argc, t_atom *argv);
+void mp3codec_sync_pairs(t_mp3codec *x);
+void mp3codec_rebuild(t_mp3codec *x);
+void mp3codec_pool_update_all(t_mp3codec *x);
+int mp3codec_defer_message(t_mp3codec *x, t_symbol *s, long argc, t_atom *argv);
+int mp3codec_defer_attr(t_mp3codec *x, void *attr, long argc, t_atom *argv);
+void mp3codec_message_main(t_mp3codec *x, t_symbol *s, long argc, t_atom *argv);
+void mp3codec_attr_main(t_mp3codec *x, t_symbol *s, long argc, t_atom *argv);
+
+// Threaded pipeline
+t_max_err mp3codec_threaded_set(t_mp3codec *x, void *attr, long argc, t_atom *argv);
+void mp3codec_worker_start(t_mp3codec *x);
+void mp3codec_worker_stop(t_mp3codec *x);
+
+// Core host hooks
+void mp3codec_host_notify(t_mp3codec *x, int what);
+void mp3codec_host_log(t_mp3codec *x, int is_error, const char *message);
+void mp3codec_host_log_errors(t_mp3codec *x, int is_error, const char *message);
+void mp3codec_retire_drain(t_mp3codec *x);
+void mp3codec_cache_drain(t_mp3codec *x);
 
 static t_class *mp3codec_class;
 
@@ -119,6 +171,10 @@ void ext_main(void *r)
 {
     t_class *c;
     
+    mp3codec_core_setup();
+    mp3codec_scheduler_start();
+    quittask_install((method)mp3codec_cache_clear, NULL);
+    
     c = class_new("mp3codec~", (method)mp3codec_new, (method)mp3codec_free,
                   sizeof(t_mp3codec), NULL, A_GIMME, 0);
     
@@ -128,32 +184,150 @@ void ext_main(void *r)
     class_addmethod(c, (method)mp3codec_bypass, "bypass", A_LONG, 0);
     class_addmethod(c, (method)mp3codec_reset, "reset", 0);
     class_addmethod(c, (method)mp3codec_latency, "latency", 0);
-    
-    // Individual compression toggle methods
-    class_addmethod(c, (method)mp3codec_lowpass, "lowpass", A_LONG, 0);
-    class_addmethod(c, (method)mp3codec_highpass, "highpass", A_LONG, 0);
-    class_addmethod(c, (method)mp3codec_msstereo, "msstereo", A_LONG, 0);
-    class_addmethod(c, (method)mp3codec_athonly, "athonly", A_LONG, 0);
-    class_addmethod(c, (method)mp3codec_experimental, "experimental", A_LONG, 0);
-    class_addmethod(c, (method)mp3codec_emphasis, "emphasis", A_LONG, 0);
+    class_addmethod(c, (method)mp3codec_pool, "pool", 0);
+    class_addmethod(c, (method)mp3codec_memory, "memory", 0);
+    class_addmethod(c, (method)mp3codec_stats, "stats", 0);
+    class_addmethod(c, (method)mp3codec_cpu, "cpu", 0);
+    class_addmethod(c, (method)mp3codec_seek, "seek", A_FLOAT, 0);
+    class_addmethod(c, (method)mp3codec_record, "record", A_GIMME, 0);
+    class_addmethod(c, (method)mp3codec_stream, "stream", A_GIMME, 0);
+    
+    // Quality, gains and the compression toggles in one message, and the same list for pattr
+    class_addmethod(c, (method)mp3codec_preset, "preset", A_GIMME, 0);
+    class_addmethod(c, (method)mp3codec_getvalueof, "getvalueof", A_CANT, 0);
+    class_addmethod(c, (method)mp3codec_setvalueof, "setvalueof", A_CANT, 0);
     
     // Attributes
-    CLASS_ATTR_LONG(c, "quality", 0, t_mp3codec, quality);
+    CLASS_ATTR_LONG(c, "quality", 0, t_mp3codec, core.quality);
     CLASS_ATTR_FILTER_MIN(c, "quality", 0);
     CLASS_ATTR_FILTER_MAX(c, "quality", 9);
     
-    CLASS_ATTR_DOUBLE(c, "input_gain", 0, t_mp3codec, input_gain);
+    CLASS_ATTR_DOUBLE(c, "input_gain", 0, t_mp3codec, core.input_gain);
     CLASS_ATTR_FILTER_MIN(c, "input_gain", 0.0);
     CLASS_ATTR_FILTER_MAX(c, "input_gain", 4.0);
     
-    CLASS_ATTR_DOUBLE(c, "output_gain", 0, t_mp3codec, output_gain);
+    CLASS_ATTR_DOUBLE(c, "output_gain", 0, t_mp3codec, core.output_gain);
     CLASS_ATTR_FILTER_MIN(c, "output_gain", 0.0);
     CLASS_ATTR_FILTER_MAX(c, "output_gain", 4.0);
     
-    CLASS_ATTR_LONG(c, "bypass", 0, t_mp3codec, bypass);
+    CLASS_ATTR_LONG(c, "bypass", 0, t_mp3codec, core.bypass);
     CLASS_ATTR_FILTER_MIN(c, "bypass", 0);
     CLASS_ATTR_FILTER_MAX(c, "bypass", 1);
     
+    // Clip to 16-bit PCM before encoding (the original sound) instead of feeding float
+    CLASS_ATTR_LONG(c, "pcm16", 0, t_mp3codec, core.pcm16);
+    CLASS_ATTR_FILTER_MIN(c, "pcm16", 0);
+    CLASS_ATTR_FILTER_MAX(c, "pcm16", 1);
+    
+    // Individual compression toggles. A change only marks the configuration dirty; one rebuild
+    // on the main thread picks up every toggle changed before it runs.
+    CLASS_ATTR_LONG(c, "lowpass", 0, t_mp3codec, core.enable_lowpass);
+    CLASS_ATTR_LONG(c, "highpass", 0, t_mp3codec, core.enable_highpass);
+    CLASS_ATTR_LONG(c, "msstereo", 0, t_mp3codec, core.enable_ms_stereo);
+    CLASS_ATTR_LONG(c, "athonly", 0, t_mp3codec, core.enable_ath_only);
+    CLASS_ATTR_LONG(c, "experimental", 0, t_mp3codec, core.enable_experimental);
+    CLASS_ATTR_LONG(c, "emphasis", 0, t_mp3codec, core.enable_emphasis);
+    for (int i = 0; i < PRESET_TOGGLES; i++) {
+        CLASS_ATTR_FILTER_MIN(c, MP3CODEC_TOGGLES[i].name, 0);
+        CLASS_ATTR_FILTER_MAX(c, MP3CODEC_TOGGLES[i].name, 1);
+        CLASS_ATTR_ACCESSORS(c, MP3CODEC_TOGGLES[i].name, NULL, mp3codec_toggle_set);
+    }
+    
+    // Measured codec delay and the minimum ring depth, reported exactly for PDC
+    CLASS_ATTR_LONG(c, "lowlatency", 0, t_mp3codec, core.low_latency);
+    CLASS_ATTR_FILTER_MIN(c, "lowlatency", 0);
+    CLASS_ATTR_FILTER_MAX(c, "lowlatency", 1);
+    CLASS_ATTR_ACCESSORS(c, "lowlatency", NULL, mp3codec_lowlatency_set);
+    
+    // Offline bounces: several frames per LAME call (adds two frames of latency)
+    CLASS_ATTR_LONG(c, "render", 0, t_mp3codec, core.render);
+    CLASS_ATTR_FILTER_MIN(c, "render", 0);
+    CLASS_ATTR_FILTER_MAX(c, "render", 1);
+    CLASS_ATTR_ACCESSORS(c, "render", NULL, mp3codec_render_set);
+    
+    // Resampler filter length for host rates above 48 kHz (0 = shortest, 2 = flattest)
+    CLASS_ATTR_LONG(c, "resample", 0, t_mp3codec, core.resample_quality);
+    CLASS_ATTR_FILTER_MIN(c, "resample", 0);
+    CLASS_ATTR_FILTER_MAX(c, "resample", RESAMPLE_QUALITIES - 1);
+    CLASS_ATTR_ACCESSORS(c, "resample", NULL, mp3codec_resample_set);
+    
+    // Bitrate mode: cbr, abr (aims at the quality's bitrate) or vbr (quality q codes as -V q)
+    CLASS_ATTR_LONG(c, "mode", 0, t_mp3codec, core.mode);
+    CLASS_ATTR_ENUMINDEX(c, "mode", 0, "cbr abr vbr");
+    CLASS_ATTR_ACCESSORS(c, "mode", NULL, mp3codec_mode_set);
+    
+    // ABR/VBR frames that would miss the callback deadline fall back to a cheap CBR state
+    CLASS_ATTR_LONG(c, "guard", 0, t_mp3codec, core.guard);
+    CLASS_ATTR_FILTER_MIN(c, "guard", 0);
+    CLASS_ATTR_FILTER_MAX(c, "guard", 1);
+    CLASS_ATTR_ACCESSORS(c, "guard", NULL, mp3codec_guard_set);
+    
+    // Skip encode/decode while the input is digitally silent; the output is the same
+    CLASS_ATTR_LONG(c, "idle", 0, t_mp3codec, core.idle);
+    CLASS_ATTR_FILTER_MIN(c, "idle", 0);
+    CLASS_ATTR_FILTER_MAX(c, "idle", 1);
+    CLASS_ATTR_ACCESSORS(c, "idle", NULL, mp3codec_idle_set);
+    
+    // Let LAME use the bit reservoir: better transients at low bitrates, a frame more latency
+    CLASS_ATTR_LONG(c, "reservoir", 0, t_mp3codec, core.reservoir);
+    CLASS_ATTR_FILTER_MIN(c, "reservoir", 0);
+    CLASS_ATTR_FILTER_MAX(c, "reservoir", 1);
+    CLASS_ATTR_ACCESSORS(c, "reservoir", NULL, mp3codec_reservoir_set);
+    
+    // Give each core its own frame phase, so objects and pairs don't all code in one callback
+    CLASS_ATTR_LONG(c, "stagger", 0, t_mp3codec, core.stagger);
+    CLASS_ATTR_FILTER_MIN(c, "stagger", 0);
+    CLASS_ATTR_FILTER_MAX(c, "stagger", 1);
+    CLASS_ATTR_ACCESSORS(c, "stagger", NULL, mp3codec_stagger_set);
+    
+    // Smallest buffers for large instance counts: rings fit to the latency at each DSP start
+    CLASS_ATTR_LONG(c, "compact", 0, t_mp3codec, core.compact);
+    CLASS_ATTR_FILTER_MIN(c, "compact", 0);
+    CLASS_ATTR_FILTER_MAX(c, "compact", 1);
+    CLASS_ATTR_ACCESSORS(c, "compact", NULL, mp3codec_compact_set);
+    
+    // Run LAME encode/hip decode on a worker thread (adds one frame of latency)
+    CLASS_ATTR_LONG(c, "threaded", 0, t_mp3codec, core.threaded);
+    CLASS_ATTR_FILTER_MIN(c, "threaded", 0);
+    CLASS_ATTR_FILTER_MAX(c, "threaded", 1);
+    CLASS_ATTR_ACCESSORS(c, "threaded", NULL, mp3codec_threaded_set);
+    
+    // Crossfade between adjacent quality levels (-1 = off)
+    CLASS_ATTR_DOUBLE(c, "morph", 0, t_mp3codec, core.morph);
+    CLASS_ATTR_FILTER_MIN(c, "morph", -1.0);
+    CLASS_ATTR_FILTER_MAX(c, "morph", 9.0);
+    CLASS_ATTR_ACCESSORS(c, "morph", NULL, mp3codec_morph_set);
+    
+    CLASS_ATTR_LONG(c, "morphpool", 0, t_mp3codec, core.morph_pool);
+    CLASS_ATTR_FILTER_MIN(c, "morphpool", 2);
+    CLASS_ATTR_FILTER_MAX(c, "morphpool", QUALITY_LEVELS);
+    CLASS_ATTR_ACCESSORS(c, "morphpool", NULL, mp3codec_morph_pool_set);
+    
+    // One "frame" list per coded MP3 frame out the analysis outlet, read from the bitstream
+    CLASS_ATTR_LONG(c, "analysis", 0, t_mp3codec, core.analysis);
+    CLASS_ATTR_FILTER_MIN(c, "analysis", 0);
+    CLASS_ATTR_FILTER_MAX(c, "analysis", 1);
+    CLASS_ATTR_ACCESSORS(c, "analysis", NULL, mp3codec_analysis_set);
+    
+    // Play a pre-encoded MP3 file through the decoder instead of coding the input (none = off)
+    CLASS_ATTR_SYM(c, "source", 0, t_mp3codec, source);
+    CLASS_ATTR_ACCESSORS(c, "source", NULL, mp3codec_source_set);
+    
+    // Objects in one group that code the same input with the same settings code it once (none = off)
+    CLASS_ATTR_SYM(c, "share", 0, t_mp3codec, share);
+    CLASS_ATTR_ACCESSORS(c, "share", NULL, mp3codec_share_set);
+    
+    // Channel layout - read from the arguments before the inlets exist, fixed afterwards
+    CLASS_ATTR_LONG(c, "chans", 0, t_mp3codec, chans);
+    CLASS_ATTR_FILTER_MIN(c, "chans", 1);
+    CLASS_ATTR_FILTER_MAX(c, "chans", MAX_CHANNELS);
+    CLASS_ATTR_ACCESSORS(c, "chans", NULL, mp3codec_layout_set);
+    
+    CLASS_ATTR_LONG(c, "stereo", 0, t_mp3codec, stereo);
+    CLASS_ATTR_FILTER_MIN(c, "stereo", 0);
+    CLASS_ATTR_FILTER_MAX(c, "stereo", 1);
+    CLASS_ATTR_ACCESSORS(c, "stereo", NULL, mp3codec_layout_set);
+    
     class_dspinit(c);
     class_register(CLASS_BOX, c);
     mp3codec_class = c;
@@ -164,60 +338,90 @@ void *mp3codec_new(t_symbol *s, long argc, t_atom *argv)
     t_mp3codec *x = (t_mp3codec *)object_alloc(mp3codec_class);
     
     if (x) {
-        dsp_setup((t_pxobject *)x, 2);  // Stereo input
+        // The channel layout decides the inlets, so read it before attr_args_process
+        x->chans = 2;
+        x->stereo = 1;
+        for (long i = attr_args_offset(argc, argv); i + 1 < argc; i++) {
+            t_symbol *name = atom_getsym(argv + i);
+            if (name == gensym("@chans")) x->chans = CLAMP(atom_getlong(argv + i + 1), 1, MAX_CHANNELS);
+            if (name == gensym("@stereo")) x->stereo = (atom_getlong(argv + i + 1) != 0);
+        }
+        
+        // One inlet per channel, then the signal-rate quality inlet
+        dsp_setup((t_pxobject *)x, x->chans + 1);
         
         // Create outlets (in reverse order)
         x->status_outlet = outlet_new((t_object *)x, NULL);
         x->analysis_outlet = outlet_new((t_object *)x, NULL);
-        outlet_new((t_object *)x, "signal");  // Right output
-        outlet_new((t_object *)x, "signal");  // Left output
-        
-        // Initialize parameters
-        x->quality = 5;         // Default: 128 kbps
-        x->input_gain = 1.0;
-        x->output_gain = 1.0;
-        x->bypass = 0;
+        for (long i = 0; i < x->chans; i++) {
+            outlet_new((t_object *)x, "signal");
+        }
         
-        // Initialize compression toggles (all aggressive settings enabled by default)
-        x->enable_lowpass = 1;
-        x->enable_highpass = 1;
-        x->enable_ms_stereo = 1;
-        x->enable_ath_only = 1;
-        x->enable_experimental = 1;
-        x->enable_emphasis = 1;
+        // Threaded pipeline starts inline; the threaded attribute hands the cores to the scheduler
+        x->scheduled = 0;
+        x->retire_qelem = qelem_new(x, (method)mp3codec_retire_drain);
+        x->event_qelem = qelem_new(x, (method)mp3codec_event_drain);
+        x->cache_qelem = qelem_new(x, (method)mp3codec_cache_drain);
+        x->analysis_qelem = qelem_new(x, (method)mp3codec_analysis_drain);
+        x->config_qelem = qelem_new(x, (method)mp3codec_config_drain);
+        x->config_dirty = 0;
+        x->preset_quality = -1;
+        x->tap = NULL;
+        x->source = gensym("");
+        x->source_rate = 0;
+        x->share = gensym("");
+        x->tap_qelem = qelem_new(x, (method)mp3codec_tap_failed);
+        x->reported_latency = -1;
+        x->scratch = NULL;
+        x->scratch_size = 0;
         
-        x->sample_rate = 44100;
-        x->channels = 2;
-        x->initialized = 0;
+        // Default parameters and the buffer arena, one core per pair (or per channel).
+        // Only the first pair logs progress; all of them report errors.
+        x->pair_count = x->stereo ? (x->chans + 1) / 2 : x->chans;
+        x->pair[0] = &x->core;
+        for (long p = 1; p < x->pair_count; p++) {
+            x->pair[p] = (t_mp3codec_core *)sysmem_newptrclear(sizeof(t_mp3codec_core));
+        }
+        for (long p = 0; p < x->pair_count; p++) {
+            if (!x->pair[p] || mp3codec_core_new(x->pair[p], x, (t_mp3codec_notify)mp3codec_host_notify,
+                                                 (t_mp3codec_log)(p ? mp3codec_host_log_errors : mp3codec_host_log)) < 0) {
+                error("mp3codec~: Failed to allocate buffers");
+                continue;
+            }
+            // A stereo layout with an odd channel count ends in a mono pair
+            x->pair[p]->channels = (x->stereo && 2 * p + 1 < x->chans) ? 2 : 1;
+        }
         
         // Process constructor arguments
-        if (argc >= 1) x->quality = CLAMP((long)atom_getfloat(argv), 0, 9);
-        if (argc >= 2) x->input_gain = CLAMP(atom_getfloat(argv+1), 0.0, 4.0);
-        if (argc >= 3) x->output_gain = CLAMP(atom_getfloat(argv+2), 0.0, 4.0);
-        if (argc >= 4) x->bypass = (atom_getlong(argv+3) != 0);
+        if (argc >= 1) x->core.quality = CLAMP((long)atom_getfloat(argv), 0, 9);
+        if (argc >= 2) x->core.input_gain = CLAMP(atom_getfloat(argv+1), 0.0, 4.0);
+        if (argc >= 3) x->core.output_gain = CLAMP(atom_getfloat(argv+2), 0.0, 4.0);
+        if (argc >= 4) x->core.bypass = (atom_getlong(argv+3) != 0);
         
         // Process attributes
         attr_args_process(x, argc, argv);
         
-        // Initialize all pointers to NULL
-        x->gfp = NULL;
-        x->hip = NULL;
-        x->encode_buffer_left = NULL;
-        x->encode_buffer_right = NULL;
-        x->mp3_accumulator = NULL;
-        x->decode_pcm_left = NULL;
-        x->decode_pcm_right = NULL;
-        x->output_ring_left = NULL;
-        x->output_ring_right = NULL;
-        
-        // Initialize processor
-        if (mp3codec_init_processor(x) < 0) {
-            error("mp3codec~: Failed to initialize MP3 processor");
-            mp3codec_cleanup_processor(x);
+        // Initialize processors - with any toggles from the arguments, so no rebuild is due
+        x->config_dirty = 0;
+        mp3codec_sync_pairs(x);
+        for (long p = 0; p < x->pair_count; p++) {
+            if (x->pair[p] && mp3codec_init_processor(x->pair[p]) < 0) {
+                error("mp3codec~: Failed to initialize MP3 processor");
+                mp3codec_cleanup_processor(x->pair[p]);
+            }
+        }
+        if (x->core.compact) {
+            mp3codec_fit_pairs(x);
         }
         
-        post("mp3codec~: Initialized - Quality %ld (%d kbps CBR)", 
-             x->quality, QUALITY_BITRATES[x->quality]);
+        if (x->chans == 2 && x->stereo) {
+            post("mp3codec~: Initialized - Quality %ld (%d kbps CBR)",
+                 x->core.quality, QUALITY_BITRATES[x->core.quality]);
+        } else {
+            post("mp3codec~: Initialized - Quality %ld (%d kbps CBR), %ld channels as %ld %s encoders",
+                 x->core.quality, QUALITY_BITRATES[x->core.quality], x->chans, x->pair_count,
+                 x->stereo ? "stereo" : "mono");
+        }
     }
     
     return x;
@@ -225,617 +429,1254 @@ void *mp3codec_new(t_symbol *s, long argc, t_atom *argv)
 
 void mp3codec_free(t_mp3codec *x)
 {
-    mp3codec_cleanup_processor(x);
+    mp3codec_tap_stop(x->tap);
+    mp3codec_worker_stop(x);
     dsp_free((t_pxobject *)x);
+    for (long p = 0; p < x->pair_count; p++) {
+        if (!x->pair[p]) continue;
+        mp3codec_core_free(x->pair[p]);
+        if (p) sysmem_freeptr(x->pair[p]);
+    }
+    if (x->scratch) {
+        sysmem_freeptr(x->scratch);
+    }
+    if (x->retire_qelem) {
+        qelem_free(x->retire_qelem);
+    }
+    if (x->event_qelem) {
+        qelem_free(x->event_qelem);
+    }
+    if (x->cache_qelem) {
+        qelem_free(x->cache_qelem);
+    }
+    if (x->analysis_qelem) {
+        qelem_free(x->analysis_qelem);
+    }
+    if (x->config_qelem) {
+        qelem_free(x->config_qelem);
+    }
+    if (x->tap_qelem) {
+        qelem_free(x->tap_qelem);
+    }
 }
 
-int mp3codec_init_processor(t_mp3codec *x)
+// Called by the core from any thread; qelem_set is safe from the audio thread
+void mp3codec_host_notify(t_mp3codec *x, int what)
 {
-    mp3codec_cleanup_processor(x);
-    
-    // Initialize encoder
-    x->gfp = lame_init();
-    if (!x->gfp) {
-        error("mp3codec~: Failed to initialize LAME encoder");
-        return -1;
+    if (what == MP3CODEC_NOTIFY_LATENCY) {
+        // Main thread: tell the patch the new delay so it can compensate. Every pair has the
+        // same delay, so only report it once.
+        if (x->status_outlet && x->core.total_latency_samples != x->reported_latency) {
+            x->reported_latency = x->core.total_latency_samples;
+            t_atom latency;
+            atom_setlong(&latency, x->core.total_latency_samples);
+            outlet_anything(x->status_outlet, gensym("latency"), 1, &latency);
+        }
+        return;
     }
-    
-    // Basic audio parameters
-    lame_set_num_channels(x->gfp, x->channels);
-    lame_set_in_samplerate(x->gfp, x->sample_rate);
-    lame_set_out_samplerate(x->gfp, x->sample_rate);
-    
-    // CRITICAL: Use CBR mode and set bitrate FIRST
-    lame_set_VBR(x->gfp, vbr_off);
-    lame_set_brate(x->gfp, QUALITY_BITRATES[x->quality]);
-    
-    // Set quality parameter (affects psychoacoustic model)
-    lame_set_quality(x->gfp, x->quality);
-    
-    // Apply user-controlled aggressive compression settings
-    
-    // Always use joint stereo for low bitrates, unless overridden
-    if (QUALITY_BITRATES[x->quality] <= 128) {
-        lame_set_mode(x->gfp, JOINT_STEREO);
+    if (what == MP3CODEC_NOTIFY_CACHE) {
+        qelem_set(x->cache_qelem);
+        return;
+    }
+    if (what == MP3CODEC_NOTIFY_ANALYSIS) {
+        qelem_set(x->analysis_qelem);
+        return;
+    }
+    if (what == MP3CODEC_NOTIFY_FRAME) {
+        mp3codec_scheduler_wake();
+        return;
+    }
+    qelem_set(what == MP3CODEC_NOTIFY_RETIRE ? x->retire_qelem : x->event_qelem);
+}
+
+// Called by the core on the main thread only (state builds, processor init)
+void mp3codec_host_log(t_mp3codec *x, int is_error, const char *message)
+{
+    if (is_error) {
+        error("%s", message);
     } else {
-        lame_set_mode(x->gfp, x->channels == 2 ? STEREO : MONO);
+        post("%s", message);
     }
-    
-    // Apply individual toggles
-    if (x->enable_ms_stereo) {
-        lame_set_force_ms(x->gfp, 1);           // Force mid/side stereo
-        post("mp3codec~: Enabled forced mid/side stereo");
+}
+
+// Pairs after the first only report errors, so N pairs don't repeat the same progress messages
+void mp3codec_host_log_errors(t_mp3codec *x, int is_error, const char *message)
+{
+    if (is_error) {
+        error("%s", message);
     }
-    
-    if (x->enable_ath_only) {
-        lame_set_ATHonly(x->gfp, 1);            // Use ATH only (more aggressive)
-        lame_set_ATHshort(x->gfp, 1);           // Use ATH for short blocks
-        lame_set_no_short_blocks(x->gfp, 0);    // Allow short blocks
-        post("mp3codec~: Enabled ATH-only psychoacoustic model");
+}
+
+// qelem: free the states the codec owners swapped out
+void mp3codec_retire_drain(t_mp3codec *x)
+{
+    for (long p = 0; p < x->pair_count; p++) {
+        if (x->pair[p]) mp3codec_state_retire(x->pair[p]);
     }
-    
-    if (x->enable_emphasis) {
-        lame_set_emphasis(x->gfp, 1);           // Add emphasis
-        post("mp3codec~: Enabled pre-emphasis");
+}
+
+// qelem: replace the cached spares the last parameter change used up
+void mp3codec_cache_drain(t_mp3codec *x)
+{
+    for (long p = 0; p < x->pair_count; p++) {
+        if (x->pair[p]) mp3codec_cache_refill(x->pair[p]);
     }
-    
-    if (x->enable_experimental) {
-        lame_set_experimentalX(x->gfp, 9);      // Most aggressive experimental settings
-        lame_set_experimentalY(x->gfp, 1);      // Additional experimental compression
-        post("mp3codec~: Enabled experimental compression modes");
+}
+
+// Bring every pair's parameters in line with the first pair, which the attributes point at
+void mp3codec_sync_pairs(t_mp3codec *x)
+{
+    for (long p = 1; p < x->pair_count; p++) {
+        if (x->pair[p]) mp3codec_core_copy_params(x->pair[p], &x->core);
+    }
+}
+
+// Toggles or sample rate changed: rebuild every pair's states
+void mp3codec_rebuild(t_mp3codec *x)
+{
+    x->config_dirty = 0;  // This rebuild covers any toggle still waiting for config_qelem
+    mp3codec_sync_pairs(x);
+    for (long p = 0; p < x->pair_count; p++) {
+        if (x->pair[p]) mp3codec_config_changed(x->pair[p]);
     }
+}
+
+// Overdrive sends messages from the scheduler thread. Building states touches the process-wide
+// config cache and delay table, which only the main thread uses, so anything that builds one
+// from another thread is sent to the main thread instead (defer_low copies the atoms).
+int mp3codec_defer_message(t_mp3codec *x, t_symbol *s, long argc, t_atom *argv)
+{
+    if (systhread_ismainthread()) return 0;
+    defer_low(x, (method)mp3codec_message_main, s, (short)argc, argv);
+    return 1;
+}
+
+int mp3codec_defer_attr(t_mp3codec *x, void *attr, long argc, t_atom *argv)
+{
+    if (systhread_ismainthread()) return 0;
+    t_symbol *name = (t_symbol *)object_method(attr, gensym("getname"));
+    defer_low(x, (method)mp3codec_attr_main, name, (short)argc, argv);
+    return 1;
+}
+
+void mp3codec_message_main(t_mp3codec *x, t_symbol *s, long argc, t_atom *argv)
+{
+    object_method_typed(x, s, argc, argv, NULL);
+}
+
+void mp3codec_attr_main(t_mp3codec *x, t_symbol *s, long argc, t_atom *argv)
+{
+    object_attr_setvalueof(x, s, argc, argv);
+}
+
+// chans and stereo decide the inlets, so they can only be given as creation arguments
+t_max_err mp3codec_layout_set(t_mp3codec *x, void *attr, long argc, t_atom *argv)
+{
+    t_symbol *name = (t_symbol *)object_method(attr, gensym("getname"));
+    long current = name == gensym("chans") ? x->chans : x->stereo;
     
-    if (x->enable_lowpass) {
-        // Apply aggressive low-pass filtering based on quality
-        if (QUALITY_BITRATES[x->quality] <= 32) {
-            lame_set_lowpassfreq(x->gfp, 4000);  // Telephone quality
-        } else if (QUALITY_BITRATES[x->quality] <= 64) {
-            lame_set_lowpassfreq(x->gfp, 6000);  // Harsh filtering
-        } else {
-            lame_set_lowpassfreq(x->gfp, 8000);  // Moderate filtering
+    if (argc && argv && atom_getlong(argv) != current) {
+        post("mp3codec~: @%s can only be set as a creation argument", name->s_name);
+    }
+    return MAX_ERR_NONE;
+}
+
+void mp3codec_dsp64(t_mp3codec *x, t_object *dsp64, short *count, double samplerate, long maxvectorsize, long flags)
+{
+    // Host rates above 48 kHz are resampled, so moving between 48 and 96 kHz keeps the running
+    // encoder; only a new codec rate needs new states
+    if (mp3codec_core_set_host_rate(&x->core, (long)samplerate)) {
+        mp3codec_rebuild(x);
+    }
+    x->core.vector_size = maxvectorsize;
+    mp3codec_source_check_rate(x);
+    
+    // A signal on the quality inlet takes over from morph; warm every level for it now, on the
+    // main thread, so the audio thread only ever switches between built states
+    long quality_signal = count[x->chans] != 0;
+    if (quality_signal != x->core.quality_signal) {
+        x->core.quality_signal = quality_signal;
+        mp3codec_pool_update_all(x);
+    }
+    mp3codec_sync_pairs(x);
+    for (long p = 0; p < x->pair_count; p++) {
+        // Low latency ring depth depends on the vector size
+        if (x->pair[p]) mp3codec_update_latency(x->pair[p]);
+    }
+    mp3codec_fit_pairs(x);  // Compact rings follow the new latency
+    
+    // Mono cores still produce a right channel; it goes here
+    if (!x->stereo || (x->chans & 1)) {
+        if (x->scratch_size < maxvectorsize) {
+            if (x->scratch) sysmem_freeptr(x->scratch);
+            x->scratch = (double *)sysmem_newptr(maxvectorsize * sizeof(double));
+            x->scratch_size = x->scratch ? maxvectorsize : 0;
         }
-        post("mp3codec~: Enabled low-pass filter (%d Hz)", 
-             QUALITY_BITRATES[x->quality] <= 32 ? 4000 : 
-             QUALITY_BITRATES[x->quality] <= 64 ? 6000 : 8000);
     }
     
-    if (x->enable_highpass) {
-        lame_set_highpassfreq(x->gfp, 100);     // Cut bass
-        post("mp3codec~: Enabled high-pass filter (100 Hz)");
+    // The layout is fixed by now, so pick the routine for it here rather than in every callback.
+    // A single core (the default stereo pair, or one mono channel) skips the pair loop.
+    method perform = (method)mp3codec_perform64;
+    if (x->pair_count == 1 && x->pair[0]) {
+        if (x->core.channels == 2) {
+            perform = (method)mp3codec_perform64_stereo;
+        } else if (x->scratch && x->scratch_size >= maxvectorsize) {
+            perform = (method)mp3codec_perform64_mono;
+        }
+    }
+    object_method(dsp64, gensym("dsp_add64"), x, perform, 0, NULL);
+}
+
+// One-core perform routines. dsp64 has already checked the core exists and the scratch buffer
+// covers the vector, the quality inlet always follows the audio inlets, and there are no other
+// pairs to keep in step, so the callback goes straight to the core.
+#define MP3CODEC_PERFORM_ONE_CORE(name, right_in, right_out) \
+    void name(t_mp3codec *x, t_object *dsp64, double **ins, long numins, double **outs, long numouts, \
+              long sampleframes, long flags, void *userparam) \
+    { \
+        x->core.quality_input = ins[x->chans]; \
+        mp3codec_core_process(&x->core, ins[0], right_in, outs[0], right_out, sampleframes); \
+    }
+
+MP3CODEC_PERFORM_ONE_CORE(mp3codec_perform64_stereo, ins[1], outs[1])
+MP3CODEC_PERFORM_ONE_CORE(mp3codec_perform64_mono, ins[0], x->scratch)
+
+// Any other layout: every pair in turn, each following the first one's parameters
+void mp3codec_perform64(t_mp3codec *x, t_object *dsp64, double **ins, long numins, double **outs, long numouts, long sampleframes, long flags, void *userparam)
+{
+    // Critical safety checks first
+    if (!x || numins < x->chans || numouts < x->chans) {
+        return;  // Silent fail for NULL object
     }
     
-    // Important: disable the bit reservoir for lower latency
-    lame_set_disable_reservoir(x->gfp, 1);
+    // Every pair follows the same quality signal
+    const double *quality_input = numins > x->chans ? ins[x->chans] : NULL;
     
-    if (lame_init_params(x->gfp) < 0) {
-        // If LAME rejects the parameters (common with very low bitrates), try fallback
-        if (QUALITY_BITRATES[x->quality] <= 16) {
-            post("mp3codec~: LAME rejected %d kbps, trying 32 kbps fallback", QUALITY_BITRATES[x->quality]);
-            lame_set_brate(x->gfp, 32);
-            lame_set_lowpassfreq(x->gfp, 6000);  // Still keep aggressive filtering
-            
-            if (lame_init_params(x->gfp) < 0) {
-                error("mp3codec~: Failed to initialize LAME even with 32 kbps fallback");
-                lame_close(x->gfp);
-                x->gfp = NULL;
-                return -1;
-            } else {
-                post("mp3codec~: Successfully initialized with 32 kbps fallback");
-            }
+    long ch = 0;
+    for (long p = 0; p < x->pair_count; p++) {
+        t_mp3codec_core *c = x->pair[p];
+        if (!c) {
+            ch += x->stereo ? 2 : 1;
+            continue;
+        }
+        if (p) {
+            mp3codec_core_follow(c, &x->core);
+        }
+        c->quality_input = quality_input;
+        
+        if (c->channels == 2) {
+            mp3codec_core_process(c, ins[ch], ins[ch + 1], outs[ch], outs[ch + 1], sampleframes);
+            ch += 2;
+        } else if (x->scratch && x->scratch_size >= sampleframes) {
+            mp3codec_core_process(c, ins[ch], ins[ch], outs[ch], x->scratch, sampleframes);
+            ch += 1;
         } else {
-            error("mp3codec~: Failed to set LAME parameters for %d kbps", QUALITY_BITRATES[x->quality]);
-            lame_close(x->gfp);
-            x->gfp = NULL;
-            return -1;
+            memset(outs[ch], 0, sampleframes * sizeof(double));
+            ch += 1;
         }
     }
+}
+
+void mp3codec_worker_start(t_mp3codec *x)
+{
+    if (x->scheduled) return;
     
-    // Debug: Show actual LAME configuration
-    post("mp3codec~: LAME configured - Quality: %d, Bitrate: %d, Mode: %d, Channels: %d", 
-         lame_get_quality(x->gfp),
-         lame_get_brate(x->gfp), 
-         lame_get_mode(x->gfp),
-         lame_get_num_channels(x->gfp));
-    
-    // Initialize decoder
-    x->hip = hip_decode_init();
-    if (!x->hip) {
-        error("mp3codec~: Failed to initialize LAME hip decoder");
-        lame_close(x->gfp);
-        x->gfp = NULL;
-        return -1;
+    for (long p = 0; p < x->pair_count; p++) {
+        if (!x->pair[p] || mp3codec_queues_alloc(x->pair[p]) < 0) {
+            error("mp3codec~: Failed to allocate threaded pipeline queues");
+            return;
+        }
     }
     
-    // Allocate buffers
-    x->encode_buffer_left = (float*)sysmem_newptrclear(PCM_BUFFER_SIZE * sizeof(float));
-    x->encode_buffer_right = (float*)sysmem_newptrclear(PCM_BUFFER_SIZE * sizeof(float));
-    x->mp3_accumulator = (unsigned char*)sysmem_newptrclear(DECODE_BUFFER_SIZE);
-    x->decode_pcm_left = (short*)sysmem_newptrclear(PCM_BUFFER_SIZE * sizeof(short));
-    x->decode_pcm_right = (short*)sysmem_newptrclear(PCM_BUFFER_SIZE * sizeof(short));
+    for (long p = 0; p < x->pair_count; p++) {
+        if (mp3codec_scheduler_add(x->pair[p]) < 0) {
+            error("mp3codec~: No codec threads available - staying on the audio thread");
+            while (p--) {
+                mp3codec_scheduler_remove(x->pair[p]);
+            }
+            return;
+        }
+    }
+    x->scheduled = 1;
     
-    // Ring buffer for output smoothing (holds 4 frames worth)
-    x->ring_size = MP3_FRAME_SIZE * 4;  // 4608 samples
-    x->output_ring_left = (float*)sysmem_newptrclear(x->ring_size * sizeof(float));
-    x->output_ring_right = (float*)sysmem_newptrclear(x->ring_size * sizeof(float));
+    // The audio thread switches each pair over on its next callback
+    for (long p = 0; p < x->pair_count; p++) {
+        atomic_store_explicit(&x->pair[p]->pipeline_request, 1, memory_order_release);
+    }
+}
+
+void mp3codec_worker_stop(t_mp3codec *x)
+{
+    if (!x->scheduled) return;
     
-    // Reset buffer positions
-    x->encode_buffer_fill = 0;
-    x->mp3_accumulator_fill = 0;
-    x->ring_write_pos = 0;
-    x->ring_read_pos = 0;
+    // Remove waits out any frame in progress, so the audio thread only resumes inline
+    // encoding once no codec thread can touch gfp/hip
+    for (long p = 0; p < x->pair_count; p++) {
+        if (x->pair[p]) mp3codec_scheduler_remove(x->pair[p]);
+    }
+    x->scheduled = 0;
     
-    // Get actual LAME delays after initialization
-    x->lame_encoder_delay = lame_get_encoder_delay(x->gfp);
-    x->lame_decoder_delay = 528;  // Standard hip decoder delay
-    x->buffer_latency_samples = MP3_FRAME_SIZE;  // Our frame buffering
+    for (long p = 0; p < x->pair_count; p++) {
+        if (x->pair[p]) atomic_store_explicit(&x->pair[p]->pipeline_request, 0, memory_order_release);
+    }
+}
+
+t_max_err mp3codec_threaded_set(t_mp3codec *x, void *attr, long argc, t_atom *argv)
+{
+    long n = (argc && argv) ? (atom_getlong(argv) != 0) : 0;
     
-    // Calculate total system latency
-    x->total_latency_samples = x->lame_encoder_delay + x->lame_decoder_delay + x->buffer_latency_samples;
-    x->total_latency_ms = (double)x->total_latency_samples / (double)x->sample_rate * 1000.0;
-    x->decode_delay_compensation = 0;  // Disable delay compensation for debugging
+    if (mp3codec_defer_attr(x, attr, argc, argv)) return MAX_ERR_NONE;
     
-    x->initialized = 1;
+    if (n != x->core.threaded) {
+        x->core.threaded = n;
+        if (x->core.threaded) {
+            mp3codec_worker_start(x);
+        } else {
+            mp3codec_worker_stop(x);
+        }
+        mp3codec_sync_pairs(x);
+        mp3codec_relatch_pairs(x, 0);
+        if (x->core.threaded && x->pair_count > 1) {
+            post("mp3codec~: Threaded pipeline enabled - %ld pairs on %ld shared threads", x->pair_count,
+                 mp3codec_scheduler_workers());
+        } else {
+            post("mp3codec~: Threaded pipeline %s", x->core.threaded ? "enabled" : "disabled");
+        }
+    }
+    return MAX_ERR_NONE;
+}
+
+t_max_err mp3codec_lowlatency_set(t_mp3codec *x, void *attr, long argc, t_atom *argv)
+{
+    long n = (argc && argv) ? (atom_getlong(argv) != 0) : 0;
     
-    post("mp3codec~: MP3 processor initialized - Quality %ld (%d kbps CBR), Total latency: %.1f ms (%d samples)", 
-         x->quality, QUALITY_BITRATES[x->quality], x->total_latency_ms, x->total_latency_samples);
+    if (mp3codec_defer_attr(x, attr, argc, argv)) return MAX_ERR_NONE;
     
-    return 0;
+    if (n != x->core.low_latency) {
+        // The audio thread re-lays the ring out on its next callback
+        x->core.low_latency = n;
+        mp3codec_sync_pairs(x);
+        mp3codec_relatch_pairs(x, 1);
+        post("mp3codec~: Low latency mode %s - %d samples (%.1f ms)", x->core.low_latency ? "enabled" : "disabled",
+             x->core.total_latency_samples, x->core.total_latency_ms);
+    }
+    return MAX_ERR_NONE;
 }
 
-void mp3codec_cleanup_processor(t_mp3codec *x)
+t_max_err mp3codec_render_set(t_mp3codec *x, void *attr, long argc, t_atom *argv)
 {
-    if (!x) return;
+    long n = (argc && argv) ? (atom_getlong(argv) != 0) : 0;
+    
+    if (mp3codec_defer_attr(x, attr, argc, argv)) return MAX_ERR_NONE;
+    
+    if (n != x->core.render) {
+        // The audio thread picks the batch size up at its next frame boundary, and moves to
+        // the aligned ring (as in low latency mode) on its next callback
+        x->core.render = n;
+        mp3codec_sync_pairs(x);
+        mp3codec_relatch_pairs(x, 1);
+        post("mp3codec~: Render mode %s - %d samples (%.1f ms)%s", x->core.render ? "enabled" : "disabled",
+             x->core.total_latency_samples, x->core.total_latency_ms,
+             (x->core.render && x->core.threaded) ? ", no batching while threaded" : "");
+    }
+    return MAX_ERR_NONE;
+}
+
+t_max_err mp3codec_resample_set(t_mp3codec *x, void *attr, long argc, t_atom *argv)
+{
+    long n = (argc && argv) ? CLAMP(atom_getlong(argv), 0, RESAMPLE_QUALITIES - 1) : 1;
     
-    // Ensure processing is disabled first
-    x->initialized = 0;
+    if (mp3codec_defer_attr(x, attr, argc, argv)) return MAX_ERR_NONE;
     
-    // Clear LAME objects safely
-    if (x->gfp) {
-        lame_close(x->gfp);
-        x->gfp = NULL;
+    if (n != x->core.resample_quality) {
+        // The audio thread redesigns its filters on the next callback
+        x->core.resample_quality = n;
+        mp3codec_sync_pairs(x);
+        for (long p = 0; p < x->pair_count; p++) {
+            if (x->pair[p]) mp3codec_update_latency(x->pair[p]);
+        }
+        if (x->core.resampler.factor > 1) {
+            post("mp3codec~: Resampler quality %ld - %d samples (%.1f ms)", n,
+                 x->core.total_latency_samples, x->core.total_latency_ms);
+        }
     }
+    return MAX_ERR_NONE;
+}
+
+// Takes the mode by name or by index
+t_max_err mp3codec_mode_set(t_mp3codec *x, void *attr, long argc, t_atom *argv)
+{
+    long n = MP3CODEC_MODE_CBR;
     
-    if (x->hip) {
-        hip_decode_exit(x->hip);
-        x->hip = NULL;
+    if (mp3codec_defer_attr(x, attr, argc, argv)) return MAX_ERR_NONE;
+    if (argc && argv && atom_gettype(argv) == A_SYM) {
+        for (n = 0; n < MP3CODEC_MODES; n++) {
+            if (atom_getsym(argv) == gensym(mp3codec_mode_name(n))) break;
+        }
+        if (n == MP3CODEC_MODES) {
+            error("mp3codec~: mode %s is not cbr, abr or vbr", atom_getsym(argv)->s_name);
+            return MAX_ERR_GENERIC;
+        }
+    } else if (argc && argv) {
+        n = CLAMP(atom_getlong(argv), 0, MP3CODEC_MODES - 1);
     }
     
-    // Free memory buffers safely
-    if (x->encode_buffer_left) {
-        sysmem_freeptr(x->encode_buffer_left);
-        x->encode_buffer_left = NULL;
+    if (n != x->core.mode) {
+        // Every state (active, morph pool, guard) is rebuilt in the new mode
+        x->core.mode = n;
+        mp3codec_rebuild(x);
+        mp3codec_fit_pairs(x);  // The guard only holds a compact arena's second lane in abr/vbr
+        mp3codec_quality_post(x, "Bitrate mode changed");
     }
-    if (x->encode_buffer_right) {
-        sysmem_freeptr(x->encode_buffer_right);
-        x->encode_buffer_right = NULL;
+    return MAX_ERR_NONE;
+}
+
+t_max_err mp3codec_guard_set(t_mp3codec *x, void *attr, long argc, t_atom *argv)
+{
+    long n = (argc && argv) ? (atom_getlong(argv) != 0) : 0;
+    
+    if (mp3codec_defer_attr(x, attr, argc, argv)) return MAX_ERR_NONE;
+    
+    if (n != x->core.guard) {
+        x->core.guard = n;
+        mp3codec_sync_pairs(x);
+        for (long p = 0; p < x->pair_count; p++) {
+            if (x->pair[p]) mp3codec_guard_update(x->pair[p]);
+        }
+        mp3codec_fit_pairs(x);  // A compact arena has a second lane only while something can start one
+        post("mp3codec~: Deadline guard %s%s", n ? "enabled" : "disabled",
+             (n && x->core.mode == MP3CODEC_MODE_CBR) ? " (only acts in abr/vbr mode)" : "");
     }
-    if (x->mp3_accumulator) {
-        sysmem_freeptr(x->mp3_accumulator);
-        x->mp3_accumulator = NULL;
+    return MAX_ERR_NONE;
+}
+
+t_max_err mp3codec_idle_set(t_mp3codec *x, void *attr, long argc, t_atom *argv)
+{
+    // Read at every frame boundary, so no state needs rebuilding
+    x->core.idle = (argc && argv) ? (atom_getlong(argv) != 0) : 0;
+    mp3codec_sync_pairs(x);
+    return MAX_ERR_NONE;
+}
+
+t_max_err mp3codec_reservoir_set(t_mp3codec *x, void *attr, long argc, t_atom *argv)
+{
+    long n = (argc && argv) ? (atom_getlong(argv) != 0) : 0;
+    
+    if (mp3codec_defer_attr(x, attr, argc, argv)) return MAX_ERR_NONE;
+    
+    if (n != x->core.reservoir) {
+        // Every state is rebuilt, and the rebuild measures the new delay and ring depth
+        x->core.reservoir = n;
+        mp3codec_rebuild(x);
+        mp3codec_relatch_pairs(x, 0);
+        post("mp3codec~: Bit reservoir %s - %d samples (%.1f ms)", n ? "enabled" : "disabled",
+             x->core.total_latency_samples, x->core.total_latency_ms);
     }
-    if (x->decode_pcm_left) {
-        sysmem_freeptr(x->decode_pcm_left);
-        x->decode_pcm_left = NULL;
+    return MAX_ERR_NONE;
+}
+
+t_max_err mp3codec_stagger_set(t_mp3codec *x, void *attr, long argc, t_atom *argv)
+{
+    long n = (argc && argv) ? (atom_getlong(argv) != 0) : 0;
+    
+    if (n != x->core.stagger) {
+        // Each codec owner moves its frame boundaries at its next callback
+        x->core.stagger = n;
+        mp3codec_sync_pairs(x);
+        post("mp3codec~: Frame stagger %s%s", n ? "enabled" : "disabled",
+             (n && x->share != gensym("")) ? " (not while in a share group)" : "");
     }
-    if (x->decode_pcm_right) {
-        sysmem_freeptr(x->decode_pcm_right);
-        x->decode_pcm_right = NULL;
+    return MAX_ERR_NONE;
+}
+
+t_max_err mp3codec_morph_set(t_mp3codec *x, void *attr, long argc, t_atom *argv)
+{
+    if (mp3codec_defer_attr(x, attr, argc, argv)) return MAX_ERR_NONE;
+    if (argc && argv) {
+        x->core.morph = CLAMP(atom_getfloat(argv), -1.0, (double)(QUALITY_LEVELS - 1));
+        mp3codec_pool_update_all(x);
+        mp3codec_fit_pairs(x);  // Only does anything when morph turns on or off
     }
-    if (x->output_ring_left) {
-        sysmem_freeptr(x->output_ring_left);
-        x->output_ring_left = NULL;
+    return MAX_ERR_NONE;
+}
+
+t_max_err mp3codec_morph_pool_set(t_mp3codec *x, void *attr, long argc, t_atom *argv)
+{
+    if (mp3codec_defer_attr(x, attr, argc, argv)) return MAX_ERR_NONE;
+    if (argc && argv) {
+        x->core.morph_pool = CLAMP(atom_getlong(argv), 2, QUALITY_LEVELS);
+        mp3codec_pool_update_all(x);
     }
-    if (x->output_ring_right) {
-        sysmem_freeptr(x->output_ring_right);
-        x->output_ring_right = NULL;
+    return MAX_ERR_NONE;
+}
+
+// Morph parameters changed: every pair warms the same pool
+void mp3codec_pool_update_all(t_mp3codec *x)
+{
+    mp3codec_sync_pairs(x);
+    for (long p = 0; p < x->pair_count; p++) {
+        if (x->pair[p]) mp3codec_pool_update(x->pair[p]);
     }
-    
-    // Reset buffer state
-    x->encode_buffer_fill = 0;
-    x->mp3_accumulator_fill = 0;
-    x->ring_write_pos = 0;
-    x->ring_read_pos = 0;
 }
 
-void mp3codec_dsp64(t_mp3codec *x, t_object *dsp64, short *count, double samplerate, long maxvectorsize, long flags)
+// Report what the warm morph states cost, so the pool size can be chosen
+void mp3codec_pool(t_mp3codec *x)
 {
-    if (x->sample_rate != (long)samplerate) {
-        x->sample_rate = (long)samplerate;
-        mp3codec_init_processor(x);
+    long lane_bytes = MP3_BUFFER_SIZE + 2 * PCM_BUFFER_SIZE * sizeof(short);
+    int lanes = (x->pair_count && x->pair[0]) ? x->pair[0]->arena_lanes : MORPH_LANES;
+    long total = 0;
+    long warm = 0;
+    
+    post("mp3codec~: Morph pool (%s, morph %.2f):", x->core.morph >= 0.0 ? "on" : "off", x->core.morph);
+    for (long q = 0; q < QUALITY_LEVELS; q++) {
+        if (!x->core.pool_generation[q]) continue;
+        
+        post("  Quality %ld (%d kbps): %ld bytes", q, QUALITY_BITRATES[q], x->core.pool_memory[q]);
+        if (x->analysis_outlet) {
+            t_atom pool_data[3];
+            atom_setlong(pool_data, q);
+            atom_setlong(pool_data + 1, QUALITY_BITRATES[q]);
+            atom_setlong(pool_data + 2, x->core.pool_memory[q]);
+            outlet_anything(x->analysis_outlet, gensym("pool"), 3, pool_data);
+        }
+        total += x->core.pool_memory[q];
+        warm++;
     }
+    post("  %ld warm states, %ld bytes total (0 = allocator statistics unavailable)", warm, total);
+    post("  Lane buffers: %d x %ld bytes", lanes, lane_bytes);
     
-    object_method(dsp64, gensym("dsp_add64"), x, mp3codec_perform64, 0, NULL);
+    long spares, spare_bytes, hits, misses;
+    mp3codec_cache_summary(&spares, &spare_bytes, &hits, &misses);
+    post("  Config cache (all instances): %ld spare states, %ld bytes, %ld hits, %ld misses",
+         spares, spare_bytes, hits, misses);
 }
 
-void mp3codec_perform64(t_mp3codec *x, t_object *dsp64, double **ins, long numins, double **outs, long numouts, long sampleframes, long flags, void *userparam)
+t_max_err mp3codec_compact_set(t_mp3codec *x, void *attr, long argc, t_atom *argv)
 {
-    static long debug_counter = 0;
-    debug_counter++;
+    long n = (argc && argv) ? (atom_getlong(argv) != 0) : 0;
     
-    // Critical safety checks first
-    if (!x) {
-        return;  // Silent fail for NULL object
-    }
+    if (mp3codec_defer_attr(x, attr, argc, argv)) return MAX_ERR_NONE;
     
-    // Check if we're in a valid state before proceeding
-    if (!x->initialized) {
-        // If not initialized, output silence and return
-        for (long i = 0; i < sampleframes; i++) {
-            outs[0][i] = 0.0;
-            outs[1][i] = 0.0;
+    if (n != x->core.compact) {
+        x->core.compact = n;
+        mp3codec_sync_pairs(x);
+        
+        // The constructor fits the arenas once the processors are up
+        if (!x->core.initialized) return MAX_ERR_NONE;
+        mp3codec_fit_pairs(x);
+        post("mp3codec~: Compact buffers %s", n ? "enabled" : "disabled");
+    }
+    return MAX_ERR_NONE;
+}
+
+// Main thread, after a setting that moves the latency: measure the codec delay again if it
+// can have changed, refit compact arenas, then publish every pair's latency
+void mp3codec_relatch_pairs(t_mp3codec *x, int remeasure)
+{
+    for (long p = 0; remeasure && p < x->pair_count; p++) {
+        if (x->pair[p] && x->pair[p]->initialized) {
+            mp3codec_measure_delay(x->pair[p]);
         }
-        return;
     }
-    
-    if (debug_counter % 200 == 0) {
-        post("mp3codec~: perform64 called - sampleframes: %ld, encode_buffer_fill: %d", sampleframes, x->encode_buffer_fill);
+    mp3codec_fit_pairs(x);
+    for (long p = 0; p < x->pair_count; p++) {
+        if (x->pair[p]) mp3codec_update_latency(x->pair[p]);
     }
-    
-    if (x->bypass) {
-        // Bypass mode - pass input directly to output
-        if (debug_counter % 1000 == 0) {
-            post("mp3codec~: **BYPASS MODE** - passing input directly to output");
-        }
-        if (numins >= 2 && numouts >= 2) {
-            for (long i = 0; i < sampleframes; i++) {
-                outs[0][i] = ins[0][i] * x->input_gain * x->output_gain;
-                outs[1][i] = ins[1][i] * x->input_gain * x->output_gain;
-            }
-        }
+}
+
+// Main thread: lay every pair's arena out again for @compact and the current latency. The
+// audio thread is held out (outputting silence) and the codec threads let go of the cores
+// first, so none of them is inside an arena while it moves.
+void mp3codec_fit_pairs(t_mp3codec *x)
+{
+    // Nothing to hold the audio for while every arena already fits
+    short due = 0;
+    for (long p = 0; p < x->pair_count; p++) {
+        if (x->pair[p] && mp3codec_core_fit_due(x->pair[p])) due = 1;
+    }
+    if (!due) {
         return;
     }
     
-    // Check buffer pointers
-    if (!x->encode_buffer_left || !x->encode_buffer_right || !x->output_ring_left || !x->output_ring_right) {
-        if (debug_counter % 100 == 0) {
-            post("mp3codec~: ERROR - NULL buffer pointers (encode_l=%p, encode_r=%p, ring_l=%p, ring_r=%p)", 
-                 x->encode_buffer_left, x->encode_buffer_right, x->output_ring_left, x->output_ring_right);
-        }
-        // Output silence if buffers not ready
-        for (long i = 0; i < sampleframes; i++) {
-            outs[0][i] = 0.0;
-            outs[1][i] = 0.0;
+    for (long p = 0; p < x->pair_count; p++) {
+        if (x->pair[p]) mp3codec_core_hold(x->pair[p], 1);
+    }
+    for (long p = 0; p < x->pair_count; p++) {
+        while (x->pair[p] && mp3codec_core_busy(x->pair[p])) {
+            systhread_sleep(1);
         }
-        return;
     }
-    
-    unsigned char mp3_buffer[MP3_BUFFER_SIZE];
-    int mp3_bytes = 0;
-    int samples_processed = 0;
-    
-    // Process input in chunks
-    while (samples_processed < sampleframes) {
-        int samples_to_copy = sampleframes - samples_processed;
-        int buffer_space = MP3_FRAME_SIZE - x->encode_buffer_fill;
-        
-        if (samples_to_copy > buffer_space) {
-            samples_to_copy = buffer_space;
+    if (x->scheduled) {
+        for (long p = 0; p < x->pair_count; p++) {
+            if (x->pair[p]) mp3codec_scheduler_remove(x->pair[p]);
         }
-        
-        // Copy samples to encode buffer with input gain
-        for (int i = 0; i < samples_to_copy; i++) {
-            x->encode_buffer_left[x->encode_buffer_fill + i] = 
-                (float)(ins[0][samples_processed + i] * x->input_gain);
-            x->encode_buffer_right[x->encode_buffer_fill + i] = 
-                (float)(ins[1][samples_processed + i] * x->input_gain);
+    }
+    for (long p = 0; p < x->pair_count; p++) {
+        if (x->pair[p] && mp3codec_core_fit(x->pair[p]) < 0) {
+            error("mp3codec~: Failed to allocate buffers - keeping the previous ones");
         }
-        
-        x->encode_buffer_fill += samples_to_copy;
-        samples_processed += samples_to_copy;
-        
-        // If we have a full frame, encode it
-        if (x->encode_buffer_fill >= MP3_FRAME_SIZE) {
-            if (debug_counter % 200 == 0) {
-                post("mp3codec~: About to encode frame (buffer_fill: %d)", x->encode_buffer_fill);
-            }
-            // Safety check LAME pointers and initialized state
-            if (!x->initialized || !x->gfp || !x->hip) {
-                if (debug_counter % 100 == 0) {
-                    post("mp3codec~: ERROR - Invalid state (initialized=%ld, gfp=%p, hip=%p)", 
-                         x->initialized, x->gfp, x->hip);
+    }
+    if (x->scheduled) {
+        for (long p = 0; p < x->pair_count; p++) {
+            if (x->pair[p] && mp3codec_scheduler_add(x->pair[p]) < 0) {
+                // Slots just freed by this object, so this only happens if another took them.
+                // Threaded mode goes as a whole, so the attribute says how the pairs run.
+                error("mp3codec~: No codec threads available - threaded pipeline disabled");
+                mp3codec_worker_stop(x);
+                x->core.threaded = 0;
+                mp3codec_sync_pairs(x);
+                for (long q = 0; q < x->pair_count; q++) {
+                    if (x->pair[q]) mp3codec_update_latency(x->pair[q]);
                 }
-                x->encode_buffer_fill = 0;  // Reset to prevent infinite loop
+                object_attr_touch((t_object *)x, gensym("threaded"));
                 break;
             }
-            
-            // Convert float to short for encoding
-            short pcm_left[MP3_FRAME_SIZE];
-            short pcm_right[MP3_FRAME_SIZE];
-            
-            for (int i = 0; i < MP3_FRAME_SIZE; i++) {
-                pcm_left[i] = float_to_short(x->encode_buffer_left[i]);
-                pcm_right[i] = float_to_short(x->encode_buffer_right[i]);
-            }
-            
-            // Encode the frame
-            mp3_bytes = lame_encode_buffer(x->gfp, 
-                                         pcm_left, 
-                                         pcm_right, 
-                                         MP3_FRAME_SIZE, 
-                                         mp3_buffer, 
-                                         MP3_BUFFER_SIZE);
-            
-            // Debug encoding results with more detail
-            if (debug_counter % 200 == 0) {
-                post("mp3codec~: Encoded frame - MP3 bytes: %d, Quality: %ld, Expected bytes for %d kbps: ~%d", 
-                     mp3_bytes, x->quality, QUALITY_BITRATES[x->quality], 
-                     (QUALITY_BITRATES[x->quality] * 1152) / (8 * 44100 / 1000));
-                     
-                // For quality 9, show first few bytes of MP3 data to verify it's actually compressed
-                if (x->quality >= 8 && mp3_bytes > 4) {
-                    post("mp3codec~: MP3 header bytes: 0x%02X 0x%02X 0x%02X 0x%02X (verify sync and bitrate)", 
-                         mp3_buffer[0], mp3_buffer[1], mp3_buffer[2], mp3_buffer[3]);
-                }
-            }
-            
-            // Reset encode buffer
-            x->encode_buffer_fill = 0;
-            
-            // If we got MP3 data, decode it immediately
-            if (mp3_bytes > 0) {
-                // Add to accumulator
-                if (x->mp3_accumulator_fill + mp3_bytes < DECODE_BUFFER_SIZE) {
-                    memcpy(x->mp3_accumulator + x->mp3_accumulator_fill, 
-                           mp3_buffer, 
-                           mp3_bytes);
-                    x->mp3_accumulator_fill += mp3_bytes;
-                }
-                
-                // Try to decode (single attempt per encoded frame)
-                int decoded_samples = hip_decode(x->hip, 
-                                               x->mp3_accumulator, 
-                                               x->mp3_accumulator_fill, 
-                                               x->decode_pcm_left, 
-                                               x->decode_pcm_right);
-                
-                if (decoded_samples > 0) {
-                    // Add decoded samples to ring buffer with bounds checking
-                    int old_write_pos = x->ring_write_pos;
-                    for (int i = 0; i < decoded_samples; i++) {
-                        x->output_ring_left[x->ring_write_pos] = 
-                            short_to_float(x->decode_pcm_left[i]);
-                        x->output_ring_right[x->ring_write_pos] = 
-                            short_to_float(x->decode_pcm_right[i]);
-                        x->ring_write_pos++;
-                        if (x->ring_write_pos >= x->ring_size) {
-                            x->ring_write_pos = 0;
-                        }
-                    }
-                    
-                    // Debug decode results
-                    if (debug_counter % 200 == 0) {
-                        post("mp3codec~: Decoded %d samples, write_pos %d->%d", decoded_samples, old_write_pos, x->ring_write_pos);
-                    }
-                    
-                    // Clear accumulator after successful decode
-                    x->mp3_accumulator_fill = 0;
-                } else if (decoded_samples == 0) {
-                    // Need more data - keep accumulating
-                    if (debug_counter % 500 == 0) {
-                        post("mp3codec~: Decoder needs more data (accumulator: %d bytes)", x->mp3_accumulator_fill);
-                    }
-                } else {
-                    // Error - clear accumulator
-                    if (debug_counter % 100 == 0) {
-                        post("mp3codec~: Decode error: %d", decoded_samples);
-                    }
-                    x->mp3_accumulator_fill = 0;
-                }
-            }
         }
     }
-    
-    // Output from ring buffer
-    for (long i = 0; i < sampleframes; i++) {
-        // Check if we have enough samples in the ring buffer
-        int available;
-        if (x->ring_write_pos >= x->ring_read_pos) {
-            available = x->ring_write_pos - x->ring_read_pos;
-        } else {
-            available = (x->ring_size - x->ring_read_pos) + x->ring_write_pos;
-        }
-        
-        // Debug ring buffer status more frequently
-        if (debug_counter % 200 == 0 && i == 0) {
-            post("mp3codec~: Ring buffer - available: %d, threshold: %d, read_pos: %d, write_pos: %d", 
-                 available, x->total_latency_samples, x->ring_read_pos, x->ring_write_pos);
-        }
-        
-        if (available > x->total_latency_samples || !x->decode_delay_compensation) {
-            // **OUTPUTTING MP3 PROCESSED AUDIO**
-            outs[0][i] = (double)(x->output_ring_left[x->ring_read_pos] * x->output_gain);
-            outs[1][i] = (double)(x->output_ring_right[x->ring_read_pos] * x->output_gain);
-            x->ring_read_pos++;
-            if (x->ring_read_pos >= x->ring_size) {
-                x->ring_read_pos = 0;
-            }
-            
-            // Debug confirmation every so often
-            if (debug_counter % 1000 == 0 && i == 0) {
-                post("mp3codec~: **OUTPUTTING MP3 PROCESSED AUDIO** from ring buffer");
-            }
-        } else {
-            // Not enough samples yet - output silence
-            if (debug_counter % 200 == 0 && i == 0) {
-                post("mp3codec~: SILENCE - not enough samples (available: %d, need: %d)", available, x->total_latency_samples);
-            }
-            outs[0][i] = 0.0;
-            outs[1][i] = 0.0;
+    for (long p = 0; p < x->pair_count; p++) {
+        if (x->pair[p]) mp3codec_core_hold(x->pair[p], 0);
+    }
+}
+
+// Report what this object holds, so compact can be weighed up for large instance counts
+void mp3codec_memory(t_mp3codec *x)
+{
+    t_mp3codec_memory m, total = {0};
+    long rings = 0;
+    
+    for (long p = 0; p < x->pair_count; p++) {
+        if (!x->pair[p]) continue;
+        mp3codec_core_memory(x->pair[p], &m);
+        total.core += m.core;
+        total.arena += m.arena;
+        total.queues += m.queues;
+        total.tap += m.tap;
+        total.states += m.states;
+        if (!rings++) {
+            total.ring = m.ring;
+            total.ring_needed = m.ring_needed;
         }
     }
+    
+    // The first core is part of the object; the right-channel scratch of mono pairs is its own
+    long object = (long)(sizeof(t_mp3codec) - sizeof(t_mp3codec_core)) + x->scratch_size * (long)sizeof(double);
+    long sum = object + total.core + total.arena + total.queues + total.tap + total.states;
+    
+    post("mp3codec~: Memory (compact %s, %ld %s):", x->core.compact ? "on" : "off", x->pair_count,
+         x->pair_count > 1 ? "pairs" : "pair");
+    post("  Object and cores: %ld bytes", object + total.core);
+    post("  Audio buffers: %ld bytes (ring %ld samples, the latency needs %ld)", total.arena, total.ring, total.ring_needed);
+    post("  Threaded queues: %ld bytes", total.queues);
+    post("  Bitstream tap: %ld bytes", total.tap);
+    post("  LAME states: %ld bytes (0 = allocator statistics unavailable)", total.states);
+    post("  Total: %ld bytes", sum);
+    
+    if (x->analysis_outlet) {
+        t_atom memory_data[6];
+        atom_setlong(memory_data, sum);
+        atom_setlong(memory_data + 1, object + total.core);
+        atom_setlong(memory_data + 2, total.arena);
+        atom_setlong(memory_data + 3, total.queues);
+        atom_setlong(memory_data + 4, total.tap);
+        atom_setlong(memory_data + 5, total.states);
+        outlet_anything(x->analysis_outlet, gensym("memory"), 6, memory_data);
+    }
 }
 
 void mp3codec_quality(t_mp3codec *x, long n)
 {
     if (!x) return;
     
-    // Disable processing FIRST and wait longer for audio thread to exit
-    x->initialized = 0;
-    
-    // Longer delay to ensure audio thread exits perform routine
-    systhread_sleep(50);
+    t_atom quality;
+    atom_setlong(&quality, n);
+    if (mp3codec_defer_message(x, gensym("quality"), 1, &quality)) return;
     
     // Update quality parameter
-    long old_quality = x->quality;
-    x->quality = CLAMP(n, 0, 9);
-    
-    // Only reinitialize if quality actually changed
-    if (old_quality != x->quality) {
-        // Reinitialize processor with new quality
-        if (mp3codec_init_processor(x) < 0) {
-            error("mp3codec~: Failed to change quality to %ld", x->quality);
-            // Try to restore previous quality
-            x->quality = old_quality;
-            if (mp3codec_init_processor(x) < 0) {
-                error("mp3codec~: Failed to restore previous quality - external may be unstable");
+    long old_quality = x->core.quality;
+    x->core.quality = CLAMP(n, 0, 9);
+    
+    // Only rebuild if quality actually changed; the running state keeps playing meanwhile
+    if (old_quality != x->core.quality) {
+        // Build every pair's state before publishing any, so a failure leaves all of them at
+        // the old quality
+        t_mp3codec_state *built[MAX_CHANNELS] = {NULL};
+        int failed = 0;
+        mp3codec_sync_pairs(x);
+        for (long p = 0; p < x->pair_count && !failed; p++) {
+            if (x->pair[p] && x->pair[p]->initialized) {
+                built[p] = mp3codec_state_acquire(x->pair[p], x->core.quality, 1, 1);
+                failed = !built[p];
+            }
+        }
+        if (failed) {
+            error("mp3codec~: Failed to change quality to %ld", x->core.quality);
+            // The previous states are still active, so just restore the parameter
+            for (long p = 0; p < x->pair_count; p++) {
+                mp3codec_state_free(built[p]);
             }
+            x->core.quality = old_quality;
+            mp3codec_sync_pairs(x);
         } else {
-            post("mp3codec~: Quality changed to %ld (%d kbps CBR)", x->quality, QUALITY_BITRATES[x->quality]);
+            for (long p = 0; p < x->pair_count; p++) {
+                // A pair that never started is initialized at the new quality instead
+                if (built[p]) {
+                    mp3codec_state_publish(x->pair[p], built[p]);
+                } else if (x->pair[p] && mp3codec_state_request(x->pair[p]) < 0) {
+                    error("mp3codec~: Failed to initialize MP3 processor");
+                }
+            }
+            mp3codec_quality_post(x, "Quality changed to");
         }
     } else {
-        // Quality unchanged, just re-enable
-        x->initialized = 1;
-        post("mp3codec~: Quality unchanged at %ld (%d kbps CBR)", x->quality, QUALITY_BITRATES[x->quality]);
+        mp3codec_quality_post(x, "Quality unchanged at");
+    }
+}
+
+// "<what> 5 (128 kbps CBR)", in the current bitrate mode
+void mp3codec_quality_post(t_mp3codec *x, const char *what)
+{
+    long q = x->core.quality;
+    
+    if (x->core.mode == MP3CODEC_MODE_VBR) {
+        post("mp3codec~: %s %ld (VBR -V %ld)", what, q, q);
+    } else {
+        post("mp3codec~: %s %ld (%d kbps %s)", what, q, QUALITY_BITRATES[q],
+             x->core.mode == MP3CODEC_MODE_ABR ? "ABR" : "CBR");
     }
 }
 
 void mp3codec_bypass(t_mp3codec *x, long n)
 {
-    x->bypass = (n != 0);
+    x->core.bypass = (n != 0);
 }
 
 void mp3codec_reset(t_mp3codec *x)
 {
-    if (!x) return;
-    
-    // Thread-safe reset: disable processing first
-    x->initialized = 0;
-    
-    // Longer delay to ensure audio thread exits
-    systhread_sleep(50);
-    
-    // Reinitialize processor
-    if (mp3codec_init_processor(x) < 0) {
+    if (!x || mp3codec_defer_message(x, gensym("reset"), 0, NULL)) return;
+    
+    // Hand a fresh encoder/decoder pair (and fresh morph pool) to the codec owner
+    int failed = 0;
+    for (long p = 0; p < x->pair_count; p++) {
+        if (!x->pair[p]) continue;
+        x->pair[p]->config_generation++;
+        if (mp3codec_state_request(x->pair[p]) < 0) failed = 1;
+        mp3codec_pool_update(x->pair[p]);
+    }
+    if (failed) {
         error("mp3codec~: Reset failed - processor may be unstable");
     } else {
         post("mp3codec~: Processor reset successfully");
     }
 }
 
-// Individual compression toggle functions
-void mp3codec_lowpass(t_mp3codec *x, long n)
+// The toggle attributes in preset order, with the fields they set
+static void mp3codec_toggle_fields(t_mp3codec_core *c, long *toggles[PRESET_TOGGLES])
 {
-    if (!x) return;
-    x->enable_lowpass = (n != 0);
-    post("mp3codec~: Low-pass filter %s", x->enable_lowpass ? "enabled" : "disabled");
-    
-    // Reinitialize to apply change
-    x->initialized = 0;
-    systhread_sleep(50);
-    mp3codec_init_processor(x);
+    toggles[0] = &c->enable_lowpass;
+    toggles[1] = &c->enable_highpass;
+    toggles[2] = &c->enable_ms_stereo;
+    toggles[3] = &c->enable_ath_only;
+    toggles[4] = &c->enable_experimental;
+    toggles[5] = &c->enable_emphasis;
 }
 
-void mp3codec_highpass(t_mp3codec *x, long n)
+// Any thread (Overdrive sends messages from the scheduler): set the field, and leave the
+// rebuild to config_qelem, so a burst of toggles costs one
+t_max_err mp3codec_toggle_set(t_mp3codec *x, void *attr, long argc, t_atom *argv)
 {
-    if (!x) return;
-    x->enable_highpass = (n != 0);
-    post("mp3codec~: High-pass filter %s", x->enable_highpass ? "enabled" : "disabled");
-    
-    // Reinitialize to apply change
-    x->initialized = 0;
-    systhread_sleep(50);
-    mp3codec_init_processor(x);
+    t_symbol *name = (t_symbol *)object_method(attr, gensym("getname"));
+    long *toggles[PRESET_TOGGLES];
+    long n = (argc && argv) ? (atom_getlong(argv) != 0) : 0;
+    
+    mp3codec_toggle_fields(&x->core, toggles);
+    for (int i = 0; i < PRESET_TOGGLES; i++) {
+        if (name != gensym(MP3CODEC_TOGGLES[i].name) || *toggles[i] == n) continue;
+        *toggles[i] = n;
+        post("mp3codec~: %s %s", MP3CODEC_TOGGLES[i].label, n ? "enabled" : "disabled");
+        x->config_dirty = 1;
+        qelem_set(x->config_qelem);
+    }
+    return MAX_ERR_NONE;
 }
 
-void mp3codec_msstereo(t_mp3codec *x, long n)
+// qelem: one rebuild for every toggle changed since the last (unless one already ran), at the
+// quality of the last preset recalled meanwhile; a preset that changed only the quality swaps
+// one state in
+void mp3codec_config_drain(t_mp3codec *x)
 {
-    if (!x) return;
-    x->enable_ms_stereo = (n != 0);
-    post("mp3codec~: Forced mid/side stereo %s", x->enable_ms_stereo ? "enabled" : "disabled");
-    
-    // Reinitialize to apply change
-    x->initialized = 0;
-    systhread_sleep(50);
-    mp3codec_init_processor(x);
+    long quality = x->preset_quality;
+    
+    x->preset_quality = -1;
+    if (x->config_dirty) {
+        if (quality >= 0) x->core.quality = quality;
+        mp3codec_rebuild(x);
+        if (quality >= 0) mp3codec_quality_post(x, "Preset recalled at quality");
+    } else if (quality >= 0) {
+        mp3codec_quality(x, quality);
+    }
 }
 
-void mp3codec_athonly(t_mp3codec *x, long n)
+static void mp3codec_preset_get(t_mp3codec *x, t_atom *av)
 {
-    if (!x) return;
-    x->enable_ath_only = (n != 0);
-    post("mp3codec~: ATH-only psychoacoustic model %s", x->enable_ath_only ? "enabled" : "disabled");
+    long *toggles[PRESET_TOGGLES];
+    
+    mp3codec_toggle_fields(&x->core, toggles);
+    atom_setlong(av, x->core.quality);
+    atom_setfloat(av + 1, x->core.input_gain);
+    atom_setfloat(av + 2, x->core.output_gain);
+    for (int i = 0; i < PRESET_TOGGLES; i++) {
+        atom_setlong(av + 3 + i, *toggles[i]);
+    }
+}
+
+// Apply every value given (missing trailing ones keep their setting) and rebuild at most once.
+// Gains take effect at once and need no rebuild. The quality and toggles are only recorded here
+// and left to config_qelem, like a toggle message, so a recall from any thread (pattr, or
+// Overdrive's scheduler) never builds a state itself: a quality change alone swaps one state in,
+// and any toggle change rebuilds once at the new quality. A configuration used before comes from
+// the config cache.
+static void mp3codec_preset_apply(t_mp3codec *x, long argc, t_atom *argv)
+{
+    t_mp3codec_core *c = &x->core;
+    long *toggles[PRESET_TOGGLES];
+    long quality = argc > 0 ? CLAMP(atom_getlong(argv), 0, 9) : c->quality;
+    int toggled = 0;
+    
+    mp3codec_toggle_fields(c, toggles);
+    if (argc > 1) c->input_gain = CLAMP(atom_getfloat(argv + 1), 0.0, 4.0);
+    if (argc > 2) c->output_gain = CLAMP(atom_getfloat(argv + 2), 0.0, 4.0);
+    for (int i = 0; i < PRESET_TOGGLES && 3 + i < argc; i++) {
+        long on = atom_getlong(argv + 3 + i) != 0;
+        if (on != *toggles[i]) {
+            *toggles[i] = on;
+            toggled = 1;
+        }
+    }
     
-    // Reinitialize to apply change
-    x->initialized = 0;
-    systhread_sleep(50);
-    mp3codec_init_processor(x);
+    // A recall still waiting for config_qelem is superseded, even by the running quality
+    mp3codec_sync_pairs(x);
+    if (toggled || quality != c->quality || x->preset_quality >= 0) {
+        x->preset_quality = quality;
+        if (toggled) x->config_dirty = 1;
+        qelem_set(x->config_qelem);
+    }
 }
 
-void mp3codec_experimental(t_mp3codec *x, long n)
+// preset <quality> <input_gain> <output_gain> <lowpass> <highpass> <msstereo> <athonly>
+// <experimental> <emphasis>; with no arguments, the current preset goes out the analysis outlet
+void mp3codec_preset(t_mp3codec *x, t_symbol *s, long argc, t_atom *argv)
 {
-    if (!x) return;
-    x->enable_experimental = (n != 0);
-    post("mp3codec~: Experimental compression modes %s", x->enable_experimental ? "enabled" : "disabled");
+    if (argc) {
+        mp3codec_preset_apply(x, argc, argv);
+        return;
+    }
     
-    // Reinitialize to apply change
-    x->initialized = 0;
-    systhread_sleep(50);
-    mp3codec_init_processor(x);
+    t_atom preset[PRESET_VALUES];
+    mp3codec_preset_get(x, preset);
+    outlet_anything(x->analysis_outlet, gensym("preset"), PRESET_VALUES, preset);
 }
 
-void mp3codec_emphasis(t_mp3codec *x, long n)
+// pattr stores and recalls the preset list
+t_max_err mp3codec_getvalueof(t_mp3codec *x, long *ac, t_atom **av)
 {
-    if (!x) return;
-    x->enable_emphasis = (n != 0);
-    post("mp3codec~: Pre-emphasis %s", x->enable_emphasis ? "enabled" : "disabled");
+    char alloc;
     
-    // Reinitialize to apply change
-    x->initialized = 0;
-    systhread_sleep(50);
-    mp3codec_init_processor(x);
+    if (atom_alloc_array(PRESET_VALUES, ac, av, &alloc) != MAX_ERR_NONE) {
+        return MAX_ERR_OUT_OF_MEM;
+    }
+    mp3codec_preset_get(x, *av);
+    *ac = PRESET_VALUES;
+    return MAX_ERR_NONE;
+}
+
+t_max_err mp3codec_setvalueof(t_mp3codec *x, long ac, t_atom *av)
+{
+    if (ac && av) mp3codec_preset_apply(x, ac, av);
+    return MAX_ERR_NONE;
 }
 
 void mp3codec_latency(t_mp3codec *x)
 {
-    if (!x || !x->initialized) {
+    if (!x || !x->core.initialized) {
         post("mp3codec~: Not initialized - cannot report latency");
         return;
     }
     
+    t_mp3codec_core *c = &x->core;
+    
     // Detailed latency breakdown
     post("mp3codec~: Latency Analysis:");
-    post("  LAME Encoder Delay: %d samples (%.1f ms)", 
-         x->lame_encoder_delay, 
-         (double)x->lame_encoder_delay / (double)x->sample_rate * 1000.0);
-    post("  LAME Decoder Delay: %d samples (%.1f ms)", 
-         x->lame_decoder_delay,
-         (double)x->lame_decoder_delay / (double)x->sample_rate * 1000.0);
-    post("  Buffer Latency: %d samples (%.1f ms)", 
-         x->buffer_latency_samples,
-         (double)x->buffer_latency_samples / (double)x->sample_rate * 1000.0);
-    post("  TOTAL LATENCY: %d samples (%.1f ms)", 
-         x->total_latency_samples, x->total_latency_ms);
-    post("  At %d Hz: %.1f audio frames delay", 
-         x->sample_rate, (double)x->total_latency_samples / 512.0);
+    post("  LAME Encoder Delay: %d samples (%.1f ms)",
+         c->lame_encoder_delay,
+         (double)c->lame_encoder_delay / (double)c->sample_rate * 1000.0);
+    post("  LAME Decoder Delay: %d samples (%.1f ms)",
+         c->lame_decoder_delay,
+         (double)c->lame_decoder_delay / (double)c->sample_rate * 1000.0);
+    post("  Buffer Latency: %d samples (%.1f ms)",
+         c->buffer_latency_samples,
+         (double)c->buffer_latency_samples / (double)c->sample_rate * 1000.0);
+    if (c->pipeline_latency_samples) {
+        post("  Worker Pipeline: %d samples (%.1f ms)",
+             c->pipeline_latency_samples,
+             (double)c->pipeline_latency_samples / (double)c->sample_rate * 1000.0);
+    }
+    if (c->low_latency || c->render) {
+        post("  %s: measured codec delay %d samples, codec holds back up to %d",
+             c->low_latency ? "Low latency" : "Render", c->codec_delay, c->codec_lag);
+    }
+    if (c->resampler.factor > 1) {
+        post("  Resampler: %ld Hz host, %ld Hz codec, filters %d samples (%.1f ms) at the host rate",
+             c->host_rate, c->sample_rate, c->resample_latency_samples,
+             (double)c->resample_latency_samples / (double)c->host_rate * 1000.0);
+    }
+    post("  TOTAL LATENCY: %d samples (%.1f ms)",
+         c->total_latency_samples, c->total_latency_ms);
+    post("  At %ld Hz: %.1f audio frames delay",
+         c->host_rate, (double)c->total_latency_samples / 512.0);
     
     // Send latency data to analysis outlet
     if (x->analysis_outlet) {
         t_atom latency_data[4];
-        atom_setfloat(latency_data, x->total_latency_ms);
-        atom_setlong(latency_data + 1, x->total_latency_samples);
-        atom_setlong(latency_data + 2, x->lame_encoder_delay);
-        atom_setlong(latency_data + 3, x->lame_decoder_delay);
+        atom_setfloat(latency_data, c->total_latency_ms);
+        atom_setlong(latency_data + 1, c->total_latency_samples);
+        atom_setlong(latency_data + 2, c->lame_encoder_delay);
+        atom_setlong(latency_data + 3, c->lame_decoder_delay);
         outlet_list(x->analysis_outlet, NULL, 4, latency_data);
     }
 }
 
+// qelem: report the events the audio path queued since the last drain
+void mp3codec_event_drain(t_mp3codec *x)
+{
+    int type;
+    long value, frame;
+    
+    for (long p = 0; p < x->pair_count; p++) {
+        if (!x->pair[p]) continue;
+        while (mp3codec_core_next_event(x->pair[p], &type, &value, &frame)) {
+            if (x->pair_count > 1) {
+                post("mp3codec~: pair %ld: %s (%ld) at frame %ld", p + 1, mp3codec_event_name(type), value, frame);
+            } else {
+                post("mp3codec~: %s (%ld) at frame %ld", mp3codec_event_name(type), value, frame);
+            }
+        }
+    }
+}
+
+t_max_err mp3codec_analysis_set(t_mp3codec *x, void *attr, long argc, t_atom *argv)
+{
+    // Read by the codec owner as each frame is parsed; nothing to rebuild
+    x->core.analysis = (argc && argv) ? (atom_getlong(argv) != 0) : 0;
+    mp3codec_sync_pairs(x);
+    return MAX_ERR_NONE;
+}
+
+// Main thread, from analysis_qelem: everything queued since the last drain, oldest first
+void mp3codec_analysis_drain(t_mp3codec *x)
+{
+    t_mp3codec_frame_info info;
+    t_atom list[10];
+    
+    for (long p = 0; p < x->pair_count; p++) {
+        if (!x->pair[p]) continue;
+        while (mp3codec_core_next_frame_info(x->pair[p], &info)) {
+            atom_setlong(list, info.frame);
+            atom_setlong(list + 1, info.bytes);
+            atom_setlong(list + 2, info.kbps);
+            atom_setlong(list + 3, info.ms_stereo);
+            atom_setlong(list + 4, info.reservoir);
+            atom_setlong(list + 5, info.block_type[0][0]);
+            atom_setlong(list + 6, info.block_type[0][1]);
+            atom_setlong(list + 7, info.block_type[1][0]);
+            atom_setlong(list + 8, info.block_type[1][1]);
+            atom_setlong(list + 9, p + 1);
+            if (x->analysis_outlet) {
+                outlet_anything(x->analysis_outlet, gensym("frame"), x->pair_count > 1 ? 10 : 9, list);
+            }
+        }
+    }
+}
+
+void mp3codec_stats(t_mp3codec *x)
+{
+    long frames = 0, bytes = 0, errors = 0, underruns = 0, encode_errors = 0, dropped = 0, late = 0, lost = 0;
+    long guarded = 0, tapped = 0, tap_dropped = 0, idle = 0, shared = 0, analysis_lost = 0;
+    
+    // Summed over all pairs
+    for (long p = 0; p < x->pair_count; p++) {
+        if (!x->pair[p]) continue;
+        t_mp3codec_stats *st = &x->pair[p]->stats;
+        frames += atomic_load_explicit(&st->frames_encoded, memory_order_relaxed);
+        bytes += atomic_load_explicit(&st->bytes_produced, memory_order_relaxed);
+        errors += atomic_load_explicit(&st->decode_errors, memory_order_relaxed);
+        underruns += atomic_load_explicit(&st->underruns, memory_order_relaxed);
+        encode_errors += atomic_load_explicit(&st->encode_errors, memory_order_relaxed);
+        dropped += atomic_load_explicit(&st->frames_dropped, memory_order_relaxed);
+        late += atomic_load_explicit(&st->deadline_misses, memory_order_relaxed);
+        lost += atomic_load_explicit(&st->events_lost, memory_order_relaxed);
+        guarded += atomic_load_explicit(&st->guarded_frames, memory_order_relaxed);
+        tapped += atomic_load_explicit(&st->tap_frames, memory_order_relaxed);
+        tap_dropped += atomic_load_explicit(&st->tap_dropped, memory_order_relaxed);
+        idle += atomic_load_explicit(&st->idle_frames, memory_order_relaxed);
+        shared += atomic_load_explicit(&st->shared_frames, memory_order_relaxed);
+        analysis_lost += atomic_load_explicit(&st->analysis_lost, memory_order_relaxed);
+    }
+    
+    if (x->pair_count > 1) {
+        post("mp3codec~: Statistics (%ld pairs):", x->pair_count);
+    } else {
+        post("mp3codec~: Statistics:");
+    }
+    post("  Frames encoded: %ld (%ld MP3 bytes)", frames, bytes);
+    post("  Decode errors: %ld", errors);
+    post("  Output underruns: %ld", underruns);
+    post("  Encode errors: %ld", encode_errors);
+    post("  Frames dropped by worker: %ld", dropped);
+    post("  Frames past their deadline: %ld", late);
+    post("  Frames coded by the deadline guard: %ld", guarded);
+    post("  MP3 frames tapped: %ld (%ld dropped)%s", tapped, tap_dropped, x->tap ? "" : " - not recording");
+    post("  Frames skipped as silence: %ld", idle);
+    post("  Frames taken from the share group: %ld%s", shared, x->share != gensym("") ? "" : " - not sharing");
+    if (lost) {
+        post("  Events not reported (ring full): %ld", lost);
+    }
+    if (analysis_lost) {
+        post("  Frame analysis records not sent (ring full): %ld", analysis_lost);
+    }
+    
+    // Send statistics to analysis outlet
+    if (x->analysis_outlet) {
+        t_atom stats_data[12];
+        atom_setlong(stats_data, frames);
+        atom_setlong(stats_data + 1, bytes);
+        atom_setlong(stats_data + 2, errors);
+        atom_setlong(stats_data + 3, underruns);
+        atom_setlong(stats_data + 4, encode_errors);
+        atom_setlong(stats_data + 5, dropped);
+        atom_setlong(stats_data + 6, late);
+        atom_setlong(stats_data + 7, guarded);
+        atom_setlong(stats_data + 8, tapped);
+        atom_setlong(stats_data + 9, tap_dropped);
+        atom_setlong(stats_data + 10, idle);
+        atom_setlong(stats_data + 11, shared);
+        outlet_anything(x->analysis_outlet, gensym("stats"), 12, stats_data);
+    }
+}
+
+t_max_err mp3codec_share_set(t_mp3codec *x, void *attr, long argc, t_atom *argv)
+{
+    t_symbol *name = (argc && argv && atom_gettype(argv) == A_SYM) ? atom_getsym(argv) : gensym("");
+    
+    if (name == gensym("none")) {
+        name = gensym("");
+    }
+    if (name == x->share) {
+        return MAX_ERR_NONE;
+    }
+    
+    // Every pair joins; pairs that carry different channels simply never match each other
+    for (long p = 0; p < x->pair_count; p++) {
+        if (!x->pair[p]) continue;
+        t_mp3codec_share *g = NULL;
+        if (name != gensym("")) {
+            g = mp3codec_share_join(name->s_name);
+            if (!g) {
+                error("mp3codec~: Failed to allocate share group %s", name->s_name);
+                continue;
+            }
+        }
+        mp3codec_core_set_share(x->pair[p], g);
+    }
+    
+    if (name != gensym("")) {
+        post("mp3codec~: Sharing output in group %s", name->s_name);
+    } else {
+        post("mp3codec~: Left share group %s", x->share->s_name);
+    }
+    x->share = name;
+    return MAX_ERR_NONE;
+}
+
+t_max_err mp3codec_source_set(t_mp3codec *x, void *attr, long argc, t_atom *argv)
+{
+    t_symbol *name = (argc && argv && atom_gettype(argv) == A_SYM) ? atom_getsym(argv) : gensym("");
+    char path[MAX_PATH_CHARS], reason[256];
+    
+    if (name == gensym("") || name == gensym("none")) {
+        if (x->source_rate) {
+            post("mp3codec~: Source off - coding the input again");
+        }
+        mp3codec_core_set_source(&x->core, NULL);
+        x->source = gensym("");
+        x->source_rate = 0;
+        return MAX_ERR_NONE;
+    }
+    
+    if (path_nameconform(name->s_name, path, PATH_STYLE_NATIVE, PATH_TYPE_ABSOLUTE) != MAX_ERR_NONE) {
+        snprintf(path, sizeof(path), "%s", name->s_name);
+    }
+    
+    // Mapping and indexing happen here, on the main thread; the audio thread only decodes
+    t_mp3codec_source *src = mp3codec_source_open(path, reason, sizeof(reason));
+    if (!src) {
+        error("mp3codec~: Can't play %s as a source: %s", path, reason);
+        return MAX_ERR_GENERIC;
+    }
+    post("mp3codec~: Playing %s - %ld frames, %.1f s at %ld Hz%s", path, src->frame_count,
+         (double)mp3codec_source_length(src) / (double)src->sample_rate, src->sample_rate,
+         x->pair_count > 1 ? " (first pair only)" : "");
+    
+    x->source = name;
+    x->source_rate = src->sample_rate;
+    mp3codec_core_set_source(&x->core, src);
+    mp3codec_source_check_rate(x);
+    return MAX_ERR_NONE;
+}
+
+// The file plays at the codec rate, so anything else stays silent rather than play off-speed
+void mp3codec_source_check_rate(t_mp3codec *x)
+{
+    if (x->source_rate && x->core.sample_rate && x->source_rate != x->core.sample_rate) {
+        error("mp3codec~: %s is at %ld Hz but the codec runs at %ld Hz - the source stays silent",
+              x->source->s_name, x->source_rate, x->core.sample_rate);
+    }
+}
+
+// Jump to ms into the source, through the frame index
+void mp3codec_seek(t_mp3codec *x, double ms)
+{
+    if (!x->source_rate) {
+        error("mp3codec~: seek needs a source file (@source)");
+        return;
+    }
+    mp3codec_core_seek_source(&x->core, (long)(MAX(ms, 0.0) * (double)x->source_rate / 1000.0));
+}
+
+// record <path> / stream <host:port>: no argument, 0 or stop ends whichever is running
+int mp3codec_tap_stop_requested(t_mp3codec *x, long argc, t_atom *argv)
+{
+    mp3codec_tap_stop(x->tap);
+    x->tap = NULL;
+    if (!argc) return 1;
+    if (atom_gettype(argv) == A_SYM) return atom_getsym(argv) == gensym("stop");
+    return atom_getlong(argv) == 0;
+}
+
+void mp3codec_record(t_mp3codec *x, t_symbol *s, long argc, t_atom *argv)
+{
+    char path[MAX_PATH_CHARS];
+    
+    if (mp3codec_tap_stop_requested(x, argc, argv)) return;
+    if (atom_gettype(argv) != A_SYM) {
+        error("mp3codec~: record needs a file path");
+        return;
+    }
+    if (path_nameconform(atom_getsym(argv)->s_name, path, PATH_STYLE_NATIVE, PATH_TYPE_ABSOLUTE) != MAX_ERR_NONE) {
+        snprintf(path, sizeof(path), "%s", atom_getsym(argv)->s_name);
+    }
+    
+    x->tap = mp3codec_tap_record(x->pair, x->pair_count, path, x->tap_qelem);
+    if (x->tap) {
+        post("mp3codec~: Recording the MP3 bitstream to %s%s", path, x->pair_count < 2 ? "" :
+             x->stereo ? " (one file per channel pair)" : " (one file per channel)");
+    }
+}
+
+void mp3codec_stream(t_mp3codec *x, t_symbol *s, long argc, t_atom *argv)
+{
+    if (mp3codec_tap_stop_requested(x, argc, argv)) return;
+    if (atom_gettype(argv) != A_SYM) {
+        error("mp3codec~: stream needs host:port");
+        return;
+    }
+    
+    // One connection carries one bitstream
+    x->tap = mp3codec_tap_stream(&x->core, atom_getsym(argv)->s_name, x->tap_qelem);
+    if (x->tap) {
+        post("mp3codec~: Streaming the MP3 bitstream to %s%s", atom_getsym(argv)->s_name,
+             x->pair_count > 1 ? " (first pair only)" : "");
+    }
+}
+
+// qelem: the writer gave up (disk full, connection lost) - report it and let it go
+void mp3codec_tap_failed(t_mp3codec *x)
+{
+    // A tap stopped by hand since then may have been replaced by a healthy one
+    if (!x->tap || !atomic_load(&x->tap->failed)) return;
+    mp3codec_tap_stop(x->tap);
+    x->tap = NULL;
+}
+
+// Report per-frame codec cost over the last CPU_WINDOW frames
+void mp3codec_cpu(t_mp3codec *x)
+{
+    static const char *stage_names[] = {"encode", "decode", "total"};
+    t_mp3codec_cpu_summary summary[3];
+    
+    for (int stage = MP3CODEC_CPU_ENCODE; stage <= MP3CODEC_CPU_TOTAL; stage++) {
+        if (!mp3codec_core_cpu_summary(&x->core, stage, &summary[stage])) {
+            post("mp3codec~: No frames timed yet");
+            return;
+        }
+    }
+    
+    // Every pair runs the same settings, so the first one stands for all of them
+    post("mp3codec~: Codec CPU per frame (last %ld frames, %s%s):", summary[0].frames,
+         atomic_load_explicit(&x->core.pipeline_mode, memory_order_relaxed) ? "worker thread" : "audio thread",
+         x->pair_count > 1 ? ", first pair" : "");
+    for (int stage = MP3CODEC_CPU_ENCODE; stage <= MP3CODEC_CPU_TOTAL; stage++) {
+        t_mp3codec_cpu_summary *s = &summary[stage];
+        post("  %-7s min %7.1f  mean %7.1f  p99 %7.1f  max %7.1f us", stage_names[stage], s->min, s->mean, s->p99, s->max);
+        if (x->analysis_outlet) {
+            t_atom cpu_data[5];
+            atom_setsym(cpu_data, gensym(stage_names[stage]));
+            atom_setfloat(cpu_data + 1, s->min);
+            atom_setfloat(cpu_data + 2, s->mean);
+            atom_setfloat(cpu_data + 3, s->p99);
+            atom_setfloat(cpu_data + 4, s->max);
+            outlet_anything(x->analysis_outlet, gensym("cpu"), 5, cpu_data);
+        }
+    }
+    
+    // Average load against the frame period, and the worst frame against the one callback it lands in
+    double frame_us = (double)MP3_FRAME_SIZE / (double)x->core.sample_rate * 1e6;
+    double vector_us = (double)x->core.vector_size / (double)x->core.host_rate * 1e6;
+    double mean_share = summary[MP3CODEC_CPU_TOTAL].mean / frame_us * 100.0;
+    double peak_share = summary[MP3CODEC_CPU_TOTAL].max / vector_us * 100.0;
+    post("  Load: %.2f%% of the frame period on average, worst frame %.1f%% of a %ld-sample callback",
+         mean_share, peak_share, x->core.vector_size);
+    if (x->pair_count > 1) {
+        post("  All %ld pairs: about %.2f%% of one core", x->pair_count, mean_share * x->pair_count);
+    }
+    
+    if (x->analysis_outlet) {
+        t_atom load_data[3];
+        atom_setsym(load_data, gensym("load"));
+        atom_setfloat(load_data + 1, mean_share);
+        atom_setfloat(load_data + 2, peak_share);
+        outlet_anything(x->analysis_outlet, gensym("cpu"), 3, load_data);
+    }
+}
+
 void mp3codec_assist(t_mp3codec *x, void *b, long m, long a, char *s)
 {
+    // Any other layout numbers its channels
+    if (x->chans != 2 || !x->stereo) {
+        if (a < x->chans) {
+            sprintf(s, "(signal) Channel %ld Audio %s", a + 1, m == ASSIST_INLET ? "Input" : "Output");
+        } else if (m == ASSIST_INLET) {
+            sprintf(s, "(signal) Quality 0-9, read at each frame boundary");
+        } else if (m == ASSIST_OUTLET) {
+            sprintf(s, a == x->chans ? "Analysis Data" : "Status Messages");
+        }
+        return;
+    }
+    
     if (m == ASSIST_INLET) {
         switch (a) {
             case 0: sprintf(s, "(signal) Left Audio Input"); break;
             case 1: sprintf(s, "(signal) Right Audio Input"); break;
-            case 2: sprintf(s, "Control Messages"); break;
+            case 2: sprintf(s, "(signal) Quality 0-9, read at each frame boundary"); break;
         }
     } else {
         switch (a) {
@@ -845,4 +1686,4 @@ void mp3codec_assist(t_mp3codec *x, void *b, long m, long a, char *s)
             case 3: sprintf(s, "Status Messages"); break;
         }
     }
-}
\ No newline at end of file
+}